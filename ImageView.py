@@ -1,17 +1,16 @@
 from matplotlib.pyplot import imshow, show
 import numpy as np
+import sys
 
 
-f = open(r"<Desktop Location>\Desktop\img_temp\pixels.txt", "r")
-f2 = open(r"<Desktop Location>\Desktop\img_temp\info.txt", "r")
+# ImageWrite file.png writes file.npy next to it, so: python ImageView.py file.npy
+pixels = np.load(sys.argv[1], mmap_mode="r")
 
-newvals = [int(x) for x in f.readline().split(',') if x != '\n']
-info = [int(x) for x in f2.readline().split(',') if x != '\n']
+if pixels.dtype == np.uint16:
+    pixels = pixels / 65535.0
 
-width = info[0]
-height = info[1]
-bpx = info[2]
+if pixels.ndim == 3 and pixels.shape[2] == 2:
+    pixels = pixels[:, :, 0]
 
-newvals = np.array(newvals).reshape((height, width, bpx))
-imshow(newvals)
+imshow(pixels, cmap="gray" if pixels.ndim == 2 else None)
 show()
@@ -52,6 +52,8 @@ In Order to actually GET the picture from a PNG, you need to:
     1. Combine the data from all the IDAT chunks (there can be multiple)
 
     2. Use the uncompress() function on the IDAT chunks to get the values we're going to work with
+       (This program doesn't actually glue them together; it hands each IDAT chunk to inflate() in turn
+        and only inflates one row at a time, so it never holds more than two rows of filtered data)
 
     3. With these values, you'll need to preform 'Adaptive filtering'.
        With this, at the start of each row of the PNG, there is a filter byte. The value of this byte determines how the values in its row are filtered:
@@ -68,14 +70,132 @@ In Order to actually GET the picture from a PNG, you need to:
 */
 
 
+// Strict -std=c11 Hides madvise And clock_gettime, Which The File Mapping And The Timers Need
+#ifndef _WIN32
+#define _GNU_SOURCE
+#endif
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include "zlib.h"
 
+// Define HAVE_ZLIBNG And/Or HAVE_LIBDEFLATE (And Link Against Them) To Build Those Inflate Backends In,
+// And PNG_INFLATE_BACKEND To The Name Of The One That Should Be Used By Default
+#ifdef HAVE_ZLIBNG
+#include <zlib-ng.h>
+#endif
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+#ifndef PNG_INFLATE_BACKEND
+#define PNG_INFLATE_BACKEND "zlib"
+#endif
 
-#define bytesToInt(a, b, c, d) ((a) << 24 | (b) << 16 | (c) << 8 | (d))
+// Define HAVE_LIBPNG (And Link With -lpng) So --bench --compare Can Check Every Image Against libpng
+#ifdef HAVE_LIBPNG
+#include <png.h>
+#endif
+
+// Define PNG_NO_SIMD To Build With Only The Plain C Unfilter Kernels
+#if !defined(PNG_NO_SIMD) && defined(__SSE2__)
+#define PNG_SIMD_SSE2
+#include <emmintrin.h>
+#if defined(__GNUC__)
+#define PNG_SIMD_X86_DISPATCH // SSSE3 And AVX2 Kernels, Only Used If The CPU Running Us Has Them
+#include <immintrin.h>
+#endif
+#endif
+#if !defined(PNG_NO_SIMD) && defined(__ARM_NEON)
+#define PNG_SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <strings.h>
+#include <pthread.h> // Batch Decoding Runs On pthreads, So Link With -pthread
+#endif
+
+
+#define bytesToInt(a, b, c, d) ((unsigned long)(a) << 24 | (b) << 16 | (c) << 8 | (d))
 #define compType(a, b) ((a)[0]==(b)[0] && (a)[1]==(b)[1] && (a)[2]==(b)[2] && (a)[3]==(b)[3])
 
+// Loader Flags
+#define PNG_COPY_CHUNKS    1 // Give Every Chunk Its Own Copy Of Its Data, Instead Of A View Into The File
+#define PNG_CRC_CRITICAL   2 // Only Check The CRCs Of Critical Chunks (IHDR, PLTE, IDAT, IEND)
+#define PNG_SKIP_CRC       4 // Don't Check Any CRCs, For Files That Are Already Trusted
+#define PNG_USE_ARENA      8 // Keep Each PNG's File, Chunks, Palette And Scratch In The Decoder's Arena, Until It Reads The Next One
+
+#define ARENA_ALIGN     64        // Every Arena Allocation Starts On A Cache Line
+#define ARENA_MIN_BLOCK (1 << 16) // Smallest Block The Arena Asks malloc For
+
+#define PROBE_INFLATE_LIMIT (1 << 24) // Most Bytes A Compressed ICC Profile Or zTXt Chunk Is Allowed To Inflate To
+
+// Stages Of A Decode, Which --bench Times One At A Time And PNGStats As They Happen, Then The Whole Decode
+#define STAGE_READ     0
+#define STAGE_PARSE    1
+#define STAGE_CRC      2
+#define STAGE_INFLATE  3
+#define STAGE_UNFILTER 4
+#define STAGE_EXPAND   5
+#define STAGE_DECODE   6
+#define STAGE_COUNT    7
+
+// Define PNG_STATS To Build In The Timers And Counters That Fill PNGDecoder.stats. Without It They're Compiled
+// Out Completely, And The Stats Just Stay At Zero
+#ifdef PNG_STATS
+#define statsClock(name) long long name = getNanoseconds()
+#define statsStage(stats, stage, since, size) (since = addStageStats(stats, stage, since, size))
+#define statsFilter(stats, filter) ((stats)->filterRows[filter]++)
+#else
+#define statsClock(name)
+#define statsStage(stats, stage, since, size)
+#define statsFilter(stats, filter)
+#endif
+
+// Kinds Of File The Command Line Can Write Pixels To (See writePixels)
+#define OUTPUT_NPY  0 // NumPy Array, height x width (x channels), For np.load
+#define OUTPUT_RAW  1 // Just The Samples, Row After Row
+#define OUTPUT_PPM  2 // Netpbm PGM Or PPM, Which Have No Alpha
+#define OUTPUT_PAM  3 // Netpbm PAM, Which Does
+#define OUTPUT_TEXT 4 // width,height,channels On One Line, Then Every Sample Separated By Commas On The Next
+#define OUTPUT_BUFFER_BYTES (1 << 20) // How Much Is Written At A Time When Samples Have To Be Byte Swapped Or Printed
+
+// How Much Decoded Pixel Data A PNGCache Keeps In Memory Unless It's Told Otherwise, And How Many Hash Buckets It Starts With
+#define CACHE_DEFAULT_BUDGET ((size_t) 256 << 20)
+#define CACHE_MIN_BUCKETS    64
+
+// Pixel Output Formats (The 16 Bit Ones Are Native-Endian unsigned shorts)
+#define PIX_FORMAT_PIX    0 // One Pix Per Pixel, The Same As PNG.pixels
+#define PIX_FORMAT_GRAY8  1
+#define PIX_FORMAT_GA8    2
+#define PIX_FORMAT_RGB8   3
+#define PIX_FORMAT_RGBA8  4
+#define PIX_FORMAT_GRAY16 5
+#define PIX_FORMAT_GA16   6
+#define PIX_FORMAT_RGB16  7
+#define PIX_FORMAT_RGBA16 8
+#define PIX_PLANAR        16 // Or'd With A Format To Get One Plane Per Channel Instead Of Interleaved Samples
+
+// Status Codes, Returned By Everything That Takes A PNGDecoder. describeStatus Turns Them Into A Message
+#define PNG_OK              0
+#define PNG_ERROR_IO        1 // Couldn't Open Or Read The File
+#define PNG_ERROR_SIGNATURE 2
+#define PNG_ERROR_TRUNCATED 3 // A Chunk Runs Past The End Of The File, Or There's No IEND
+#define PNG_ERROR_LAYOUT    4 // IHDR Isn't First, There's No IDAT, The IDATs Aren't Consecutive, Or A Palette Image Has No PLTE
+#define PNG_ERROR_HEADER    5 // IHDR Holds Something We Can't Decode
+#define PNG_ERROR_CRC       6
+#define PNG_ERROR_DATA      7 // The IDAT Stream Is Corrupt Or Too Short
+#define PNG_ERROR_MEMORY    8
+#define PNG_ERROR_ARGUMENT  9
+
 // List of Critical Chunk Types
 const unsigned char IEND_CHUNK[4] = {'I', 'E', 'N', 'D'};
 const unsigned char IDAT_CHUNK[4] = {'I', 'D', 'A', 'T'};
@@ -103,25 +223,334 @@ const unsigned char ZTXT_CHUNK[4] = {'z', 'T', 'X', 't'};
 
 // An Example Of A Valid PNG Header
 const unsigned char SIGNATURE[8] = {0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A};
-// An Array Which Acts As A Lookup Table For The Error Detection Process
-unsigned long CRC_TABLE[256];
-// Used To See If We Still Need To Compute The CRC Table, Since Its Quicker Than Having It Predefined
-static int CRC_TABLE_COMPUTED = 0;
+// Lookup Tables For The Error Detection Process. CRC_TABLE[0] Is The Usual Byte-At-A-Time Table, The Other Seven Let
+// CRC32 Take 8 Bytes Per Step (CRC_TABLE[k][n] Is The CRC Of Byte n Followed By k Zero Bytes)
+const unsigned int CRC_TABLE[8][256] = {
+    {
+        0x00000000U, 0x77073096U, 0xee0e612cU, 0x990951baU, 0x076dc419U, 0x706af48fU, 0xe963a535U, 0x9e6495a3U,
+        0x0edb8832U, 0x79dcb8a4U, 0xe0d5e91eU, 0x97d2d988U, 0x09b64c2bU, 0x7eb17cbdU, 0xe7b82d07U, 0x90bf1d91U,
+        0x1db71064U, 0x6ab020f2U, 0xf3b97148U, 0x84be41deU, 0x1adad47dU, 0x6ddde4ebU, 0xf4d4b551U, 0x83d385c7U,
+        0x136c9856U, 0x646ba8c0U, 0xfd62f97aU, 0x8a65c9ecU, 0x14015c4fU, 0x63066cd9U, 0xfa0f3d63U, 0x8d080df5U,
+        0x3b6e20c8U, 0x4c69105eU, 0xd56041e4U, 0xa2677172U, 0x3c03e4d1U, 0x4b04d447U, 0xd20d85fdU, 0xa50ab56bU,
+        0x35b5a8faU, 0x42b2986cU, 0xdbbbc9d6U, 0xacbcf940U, 0x32d86ce3U, 0x45df5c75U, 0xdcd60dcfU, 0xabd13d59U,
+        0x26d930acU, 0x51de003aU, 0xc8d75180U, 0xbfd06116U, 0x21b4f4b5U, 0x56b3c423U, 0xcfba9599U, 0xb8bda50fU,
+        0x2802b89eU, 0x5f058808U, 0xc60cd9b2U, 0xb10be924U, 0x2f6f7c87U, 0x58684c11U, 0xc1611dabU, 0xb6662d3dU,
+        0x76dc4190U, 0x01db7106U, 0x98d220bcU, 0xefd5102aU, 0x71b18589U, 0x06b6b51fU, 0x9fbfe4a5U, 0xe8b8d433U,
+        0x7807c9a2U, 0x0f00f934U, 0x9609a88eU, 0xe10e9818U, 0x7f6a0dbbU, 0x086d3d2dU, 0x91646c97U, 0xe6635c01U,
+        0x6b6b51f4U, 0x1c6c6162U, 0x856530d8U, 0xf262004eU, 0x6c0695edU, 0x1b01a57bU, 0x8208f4c1U, 0xf50fc457U,
+        0x65b0d9c6U, 0x12b7e950U, 0x8bbeb8eaU, 0xfcb9887cU, 0x62dd1ddfU, 0x15da2d49U, 0x8cd37cf3U, 0xfbd44c65U,
+        0x4db26158U, 0x3ab551ceU, 0xa3bc0074U, 0xd4bb30e2U, 0x4adfa541U, 0x3dd895d7U, 0xa4d1c46dU, 0xd3d6f4fbU,
+        0x4369e96aU, 0x346ed9fcU, 0xad678846U, 0xda60b8d0U, 0x44042d73U, 0x33031de5U, 0xaa0a4c5fU, 0xdd0d7cc9U,
+        0x5005713cU, 0x270241aaU, 0xbe0b1010U, 0xc90c2086U, 0x5768b525U, 0x206f85b3U, 0xb966d409U, 0xce61e49fU,
+        0x5edef90eU, 0x29d9c998U, 0xb0d09822U, 0xc7d7a8b4U, 0x59b33d17U, 0x2eb40d81U, 0xb7bd5c3bU, 0xc0ba6cadU,
+        0xedb88320U, 0x9abfb3b6U, 0x03b6e20cU, 0x74b1d29aU, 0xead54739U, 0x9dd277afU, 0x04db2615U, 0x73dc1683U,
+        0xe3630b12U, 0x94643b84U, 0x0d6d6a3eU, 0x7a6a5aa8U, 0xe40ecf0bU, 0x9309ff9dU, 0x0a00ae27U, 0x7d079eb1U,
+        0xf00f9344U, 0x8708a3d2U, 0x1e01f268U, 0x6906c2feU, 0xf762575dU, 0x806567cbU, 0x196c3671U, 0x6e6b06e7U,
+        0xfed41b76U, 0x89d32be0U, 0x10da7a5aU, 0x67dd4accU, 0xf9b9df6fU, 0x8ebeeff9U, 0x17b7be43U, 0x60b08ed5U,
+        0xd6d6a3e8U, 0xa1d1937eU, 0x38d8c2c4U, 0x4fdff252U, 0xd1bb67f1U, 0xa6bc5767U, 0x3fb506ddU, 0x48b2364bU,
+        0xd80d2bdaU, 0xaf0a1b4cU, 0x36034af6U, 0x41047a60U, 0xdf60efc3U, 0xa867df55U, 0x316e8eefU, 0x4669be79U,
+        0xcb61b38cU, 0xbc66831aU, 0x256fd2a0U, 0x5268e236U, 0xcc0c7795U, 0xbb0b4703U, 0x220216b9U, 0x5505262fU,
+        0xc5ba3bbeU, 0xb2bd0b28U, 0x2bb45a92U, 0x5cb36a04U, 0xc2d7ffa7U, 0xb5d0cf31U, 0x2cd99e8bU, 0x5bdeae1dU,
+        0x9b64c2b0U, 0xec63f226U, 0x756aa39cU, 0x026d930aU, 0x9c0906a9U, 0xeb0e363fU, 0x72076785U, 0x05005713U,
+        0x95bf4a82U, 0xe2b87a14U, 0x7bb12baeU, 0x0cb61b38U, 0x92d28e9bU, 0xe5d5be0dU, 0x7cdcefb7U, 0x0bdbdf21U,
+        0x86d3d2d4U, 0xf1d4e242U, 0x68ddb3f8U, 0x1fda836eU, 0x81be16cdU, 0xf6b9265bU, 0x6fb077e1U, 0x18b74777U,
+        0x88085ae6U, 0xff0f6a70U, 0x66063bcaU, 0x11010b5cU, 0x8f659effU, 0xf862ae69U, 0x616bffd3U, 0x166ccf45U,
+        0xa00ae278U, 0xd70dd2eeU, 0x4e048354U, 0x3903b3c2U, 0xa7672661U, 0xd06016f7U, 0x4969474dU, 0x3e6e77dbU,
+        0xaed16a4aU, 0xd9d65adcU, 0x40df0b66U, 0x37d83bf0U, 0xa9bcae53U, 0xdebb9ec5U, 0x47b2cf7fU, 0x30b5ffe9U,
+        0xbdbdf21cU, 0xcabac28aU, 0x53b39330U, 0x24b4a3a6U, 0xbad03605U, 0xcdd70693U, 0x54de5729U, 0x23d967bfU,
+        0xb3667a2eU, 0xc4614ab8U, 0x5d681b02U, 0x2a6f2b94U, 0xb40bbe37U, 0xc30c8ea1U, 0x5a05df1bU, 0x2d02ef8dU
+    },
+    {
+        0x00000000U, 0x191b3141U, 0x32366282U, 0x2b2d53c3U, 0x646cc504U, 0x7d77f445U, 0x565aa786U, 0x4f4196c7U,
+        0xc8d98a08U, 0xd1c2bb49U, 0xfaefe88aU, 0xe3f4d9cbU, 0xacb54f0cU, 0xb5ae7e4dU, 0x9e832d8eU, 0x87981ccfU,
+        0x4ac21251U, 0x53d92310U, 0x78f470d3U, 0x61ef4192U, 0x2eaed755U, 0x37b5e614U, 0x1c98b5d7U, 0x05838496U,
+        0x821b9859U, 0x9b00a918U, 0xb02dfadbU, 0xa936cb9aU, 0xe6775d5dU, 0xff6c6c1cU, 0xd4413fdfU, 0xcd5a0e9eU,
+        0x958424a2U, 0x8c9f15e3U, 0xa7b24620U, 0xbea97761U, 0xf1e8e1a6U, 0xe8f3d0e7U, 0xc3de8324U, 0xdac5b265U,
+        0x5d5daeaaU, 0x44469febU, 0x6f6bcc28U, 0x7670fd69U, 0x39316baeU, 0x202a5aefU, 0x0b07092cU, 0x121c386dU,
+        0xdf4636f3U, 0xc65d07b2U, 0xed705471U, 0xf46b6530U, 0xbb2af3f7U, 0xa231c2b6U, 0x891c9175U, 0x9007a034U,
+        0x179fbcfbU, 0x0e848dbaU, 0x25a9de79U, 0x3cb2ef38U, 0x73f379ffU, 0x6ae848beU, 0x41c51b7dU, 0x58de2a3cU,
+        0xf0794f05U, 0xe9627e44U, 0xc24f2d87U, 0xdb541cc6U, 0x94158a01U, 0x8d0ebb40U, 0xa623e883U, 0xbf38d9c2U,
+        0x38a0c50dU, 0x21bbf44cU, 0x0a96a78fU, 0x138d96ceU, 0x5ccc0009U, 0x45d73148U, 0x6efa628bU, 0x77e153caU,
+        0xbabb5d54U, 0xa3a06c15U, 0x888d3fd6U, 0x91960e97U, 0xded79850U, 0xc7cca911U, 0xece1fad2U, 0xf5facb93U,
+        0x7262d75cU, 0x6b79e61dU, 0x4054b5deU, 0x594f849fU, 0x160e1258U, 0x0f152319U, 0x243870daU, 0x3d23419bU,
+        0x65fd6ba7U, 0x7ce65ae6U, 0x57cb0925U, 0x4ed03864U, 0x0191aea3U, 0x188a9fe2U, 0x33a7cc21U, 0x2abcfd60U,
+        0xad24e1afU, 0xb43fd0eeU, 0x9f12832dU, 0x8609b26cU, 0xc94824abU, 0xd05315eaU, 0xfb7e4629U, 0xe2657768U,
+        0x2f3f79f6U, 0x362448b7U, 0x1d091b74U, 0x04122a35U, 0x4b53bcf2U, 0x52488db3U, 0x7965de70U, 0x607eef31U,
+        0xe7e6f3feU, 0xfefdc2bfU, 0xd5d0917cU, 0xcccba03dU, 0x838a36faU, 0x9a9107bbU, 0xb1bc5478U, 0xa8a76539U,
+        0x3b83984bU, 0x2298a90aU, 0x09b5fac9U, 0x10aecb88U, 0x5fef5d4fU, 0x46f46c0eU, 0x6dd93fcdU, 0x74c20e8cU,
+        0xf35a1243U, 0xea412302U, 0xc16c70c1U, 0xd8774180U, 0x9736d747U, 0x8e2de606U, 0xa500b5c5U, 0xbc1b8484U,
+        0x71418a1aU, 0x685abb5bU, 0x4377e898U, 0x5a6cd9d9U, 0x152d4f1eU, 0x0c367e5fU, 0x271b2d9cU, 0x3e001cddU,
+        0xb9980012U, 0xa0833153U, 0x8bae6290U, 0x92b553d1U, 0xddf4c516U, 0xc4eff457U, 0xefc2a794U, 0xf6d996d5U,
+        0xae07bce9U, 0xb71c8da8U, 0x9c31de6bU, 0x852aef2aU, 0xca6b79edU, 0xd37048acU, 0xf85d1b6fU, 0xe1462a2eU,
+        0x66de36e1U, 0x7fc507a0U, 0x54e85463U, 0x4df36522U, 0x02b2f3e5U, 0x1ba9c2a4U, 0x30849167U, 0x299fa026U,
+        0xe4c5aeb8U, 0xfdde9ff9U, 0xd6f3cc3aU, 0xcfe8fd7bU, 0x80a96bbcU, 0x99b25afdU, 0xb29f093eU, 0xab84387fU,
+        0x2c1c24b0U, 0x350715f1U, 0x1e2a4632U, 0x07317773U, 0x4870e1b4U, 0x516bd0f5U, 0x7a468336U, 0x635db277U,
+        0xcbfad74eU, 0xd2e1e60fU, 0xf9ccb5ccU, 0xe0d7848dU, 0xaf96124aU, 0xb68d230bU, 0x9da070c8U, 0x84bb4189U,
+        0x03235d46U, 0x1a386c07U, 0x31153fc4U, 0x280e0e85U, 0x674f9842U, 0x7e54a903U, 0x5579fac0U, 0x4c62cb81U,
+        0x8138c51fU, 0x9823f45eU, 0xb30ea79dU, 0xaa1596dcU, 0xe554001bU, 0xfc4f315aU, 0xd7626299U, 0xce7953d8U,
+        0x49e14f17U, 0x50fa7e56U, 0x7bd72d95U, 0x62cc1cd4U, 0x2d8d8a13U, 0x3496bb52U, 0x1fbbe891U, 0x06a0d9d0U,
+        0x5e7ef3ecU, 0x4765c2adU, 0x6c48916eU, 0x7553a02fU, 0x3a1236e8U, 0x230907a9U, 0x0824546aU, 0x113f652bU,
+        0x96a779e4U, 0x8fbc48a5U, 0xa4911b66U, 0xbd8a2a27U, 0xf2cbbce0U, 0xebd08da1U, 0xc0fdde62U, 0xd9e6ef23U,
+        0x14bce1bdU, 0x0da7d0fcU, 0x268a833fU, 0x3f91b27eU, 0x70d024b9U, 0x69cb15f8U, 0x42e6463bU, 0x5bfd777aU,
+        0xdc656bb5U, 0xc57e5af4U, 0xee530937U, 0xf7483876U, 0xb809aeb1U, 0xa1129ff0U, 0x8a3fcc33U, 0x9324fd72U
+    },
+    {
+        0x00000000U, 0x01c26a37U, 0x0384d46eU, 0x0246be59U, 0x0709a8dcU, 0x06cbc2ebU, 0x048d7cb2U, 0x054f1685U,
+        0x0e1351b8U, 0x0fd13b8fU, 0x0d9785d6U, 0x0c55efe1U, 0x091af964U, 0x08d89353U, 0x0a9e2d0aU, 0x0b5c473dU,
+        0x1c26a370U, 0x1de4c947U, 0x1fa2771eU, 0x1e601d29U, 0x1b2f0bacU, 0x1aed619bU, 0x18abdfc2U, 0x1969b5f5U,
+        0x1235f2c8U, 0x13f798ffU, 0x11b126a6U, 0x10734c91U, 0x153c5a14U, 0x14fe3023U, 0x16b88e7aU, 0x177ae44dU,
+        0x384d46e0U, 0x398f2cd7U, 0x3bc9928eU, 0x3a0bf8b9U, 0x3f44ee3cU, 0x3e86840bU, 0x3cc03a52U, 0x3d025065U,
+        0x365e1758U, 0x379c7d6fU, 0x35dac336U, 0x3418a901U, 0x3157bf84U, 0x3095d5b3U, 0x32d36beaU, 0x331101ddU,
+        0x246be590U, 0x25a98fa7U, 0x27ef31feU, 0x262d5bc9U, 0x23624d4cU, 0x22a0277bU, 0x20e69922U, 0x2124f315U,
+        0x2a78b428U, 0x2bbade1fU, 0x29fc6046U, 0x283e0a71U, 0x2d711cf4U, 0x2cb376c3U, 0x2ef5c89aU, 0x2f37a2adU,
+        0x709a8dc0U, 0x7158e7f7U, 0x731e59aeU, 0x72dc3399U, 0x7793251cU, 0x76514f2bU, 0x7417f172U, 0x75d59b45U,
+        0x7e89dc78U, 0x7f4bb64fU, 0x7d0d0816U, 0x7ccf6221U, 0x798074a4U, 0x78421e93U, 0x7a04a0caU, 0x7bc6cafdU,
+        0x6cbc2eb0U, 0x6d7e4487U, 0x6f38fadeU, 0x6efa90e9U, 0x6bb5866cU, 0x6a77ec5bU, 0x68315202U, 0x69f33835U,
+        0x62af7f08U, 0x636d153fU, 0x612bab66U, 0x60e9c151U, 0x65a6d7d4U, 0x6464bde3U, 0x662203baU, 0x67e0698dU,
+        0x48d7cb20U, 0x4915a117U, 0x4b531f4eU, 0x4a917579U, 0x4fde63fcU, 0x4e1c09cbU, 0x4c5ab792U, 0x4d98dda5U,
+        0x46c49a98U, 0x4706f0afU, 0x45404ef6U, 0x448224c1U, 0x41cd3244U, 0x400f5873U, 0x4249e62aU, 0x438b8c1dU,
+        0x54f16850U, 0x55330267U, 0x5775bc3eU, 0x56b7d609U, 0x53f8c08cU, 0x523aaabbU, 0x507c14e2U, 0x51be7ed5U,
+        0x5ae239e8U, 0x5b2053dfU, 0x5966ed86U, 0x58a487b1U, 0x5deb9134U, 0x5c29fb03U, 0x5e6f455aU, 0x5fad2f6dU,
+        0xe1351b80U, 0xe0f771b7U, 0xe2b1cfeeU, 0xe373a5d9U, 0xe63cb35cU, 0xe7fed96bU, 0xe5b86732U, 0xe47a0d05U,
+        0xef264a38U, 0xeee4200fU, 0xeca29e56U, 0xed60f461U, 0xe82fe2e4U, 0xe9ed88d3U, 0xebab368aU, 0xea695cbdU,
+        0xfd13b8f0U, 0xfcd1d2c7U, 0xfe976c9eU, 0xff5506a9U, 0xfa1a102cU, 0xfbd87a1bU, 0xf99ec442U, 0xf85cae75U,
+        0xf300e948U, 0xf2c2837fU, 0xf0843d26U, 0xf1465711U, 0xf4094194U, 0xf5cb2ba3U, 0xf78d95faU, 0xf64fffcdU,
+        0xd9785d60U, 0xd8ba3757U, 0xdafc890eU, 0xdb3ee339U, 0xde71f5bcU, 0xdfb39f8bU, 0xddf521d2U, 0xdc374be5U,
+        0xd76b0cd8U, 0xd6a966efU, 0xd4efd8b6U, 0xd52db281U, 0xd062a404U, 0xd1a0ce33U, 0xd3e6706aU, 0xd2241a5dU,
+        0xc55efe10U, 0xc49c9427U, 0xc6da2a7eU, 0xc7184049U, 0xc25756ccU, 0xc3953cfbU, 0xc1d382a2U, 0xc011e895U,
+        0xcb4dafa8U, 0xca8fc59fU, 0xc8c97bc6U, 0xc90b11f1U, 0xcc440774U, 0xcd866d43U, 0xcfc0d31aU, 0xce02b92dU,
+        0x91af9640U, 0x906dfc77U, 0x922b422eU, 0x93e92819U, 0x96a63e9cU, 0x976454abU, 0x9522eaf2U, 0x94e080c5U,
+        0x9fbcc7f8U, 0x9e7eadcfU, 0x9c381396U, 0x9dfa79a1U, 0x98b56f24U, 0x99770513U, 0x9b31bb4aU, 0x9af3d17dU,
+        0x8d893530U, 0x8c4b5f07U, 0x8e0de15eU, 0x8fcf8b69U, 0x8a809decU, 0x8b42f7dbU, 0x89044982U, 0x88c623b5U,
+        0x839a6488U, 0x82580ebfU, 0x801eb0e6U, 0x81dcdad1U, 0x8493cc54U, 0x8551a663U, 0x8717183aU, 0x86d5720dU,
+        0xa9e2d0a0U, 0xa820ba97U, 0xaa6604ceU, 0xaba46ef9U, 0xaeeb787cU, 0xaf29124bU, 0xad6fac12U, 0xacadc625U,
+        0xa7f18118U, 0xa633eb2fU, 0xa4755576U, 0xa5b73f41U, 0xa0f829c4U, 0xa13a43f3U, 0xa37cfdaaU, 0xa2be979dU,
+        0xb5c473d0U, 0xb40619e7U, 0xb640a7beU, 0xb782cd89U, 0xb2cddb0cU, 0xb30fb13bU, 0xb1490f62U, 0xb08b6555U,
+        0xbbd72268U, 0xba15485fU, 0xb853f606U, 0xb9919c31U, 0xbcde8ab4U, 0xbd1ce083U, 0xbf5a5edaU, 0xbe9834edU
+    },
+    {
+        0x00000000U, 0xb8bc6765U, 0xaa09c88bU, 0x12b5afeeU, 0x8f629757U, 0x37def032U, 0x256b5fdcU, 0x9dd738b9U,
+        0xc5b428efU, 0x7d084f8aU, 0x6fbde064U, 0xd7018701U, 0x4ad6bfb8U, 0xf26ad8ddU, 0xe0df7733U, 0x58631056U,
+        0x5019579fU, 0xe8a530faU, 0xfa109f14U, 0x42acf871U, 0xdf7bc0c8U, 0x67c7a7adU, 0x75720843U, 0xcdce6f26U,
+        0x95ad7f70U, 0x2d111815U, 0x3fa4b7fbU, 0x8718d09eU, 0x1acfe827U, 0xa2738f42U, 0xb0c620acU, 0x087a47c9U,
+        0xa032af3eU, 0x188ec85bU, 0x0a3b67b5U, 0xb28700d0U, 0x2f503869U, 0x97ec5f0cU, 0x8559f0e2U, 0x3de59787U,
+        0x658687d1U, 0xdd3ae0b4U, 0xcf8f4f5aU, 0x7733283fU, 0xeae41086U, 0x525877e3U, 0x40edd80dU, 0xf851bf68U,
+        0xf02bf8a1U, 0x48979fc4U, 0x5a22302aU, 0xe29e574fU, 0x7f496ff6U, 0xc7f50893U, 0xd540a77dU, 0x6dfcc018U,
+        0x359fd04eU, 0x8d23b72bU, 0x9f9618c5U, 0x272a7fa0U, 0xbafd4719U, 0x0241207cU, 0x10f48f92U, 0xa848e8f7U,
+        0x9b14583dU, 0x23a83f58U, 0x311d90b6U, 0x89a1f7d3U, 0x1476cf6aU, 0xaccaa80fU, 0xbe7f07e1U, 0x06c36084U,
+        0x5ea070d2U, 0xe61c17b7U, 0xf4a9b859U, 0x4c15df3cU, 0xd1c2e785U, 0x697e80e0U, 0x7bcb2f0eU, 0xc377486bU,
+        0xcb0d0fa2U, 0x73b168c7U, 0x6104c729U, 0xd9b8a04cU, 0x446f98f5U, 0xfcd3ff90U, 0xee66507eU, 0x56da371bU,
+        0x0eb9274dU, 0xb6054028U, 0xa4b0efc6U, 0x1c0c88a3U, 0x81dbb01aU, 0x3967d77fU, 0x2bd27891U, 0x936e1ff4U,
+        0x3b26f703U, 0x839a9066U, 0x912f3f88U, 0x299358edU, 0xb4446054U, 0x0cf80731U, 0x1e4da8dfU, 0xa6f1cfbaU,
+        0xfe92dfecU, 0x462eb889U, 0x549b1767U, 0xec277002U, 0x71f048bbU, 0xc94c2fdeU, 0xdbf98030U, 0x6345e755U,
+        0x6b3fa09cU, 0xd383c7f9U, 0xc1366817U, 0x798a0f72U, 0xe45d37cbU, 0x5ce150aeU, 0x4e54ff40U, 0xf6e89825U,
+        0xae8b8873U, 0x1637ef16U, 0x048240f8U, 0xbc3e279dU, 0x21e91f24U, 0x99557841U, 0x8be0d7afU, 0x335cb0caU,
+        0xed59b63bU, 0x55e5d15eU, 0x47507eb0U, 0xffec19d5U, 0x623b216cU, 0xda874609U, 0xc832e9e7U, 0x708e8e82U,
+        0x28ed9ed4U, 0x9051f9b1U, 0x82e4565fU, 0x3a58313aU, 0xa78f0983U, 0x1f336ee6U, 0x0d86c108U, 0xb53aa66dU,
+        0xbd40e1a4U, 0x05fc86c1U, 0x1749292fU, 0xaff54e4aU, 0x322276f3U, 0x8a9e1196U, 0x982bbe78U, 0x2097d91dU,
+        0x78f4c94bU, 0xc048ae2eU, 0xd2fd01c0U, 0x6a4166a5U, 0xf7965e1cU, 0x4f2a3979U, 0x5d9f9697U, 0xe523f1f2U,
+        0x4d6b1905U, 0xf5d77e60U, 0xe762d18eU, 0x5fdeb6ebU, 0xc2098e52U, 0x7ab5e937U, 0x680046d9U, 0xd0bc21bcU,
+        0x88df31eaU, 0x3063568fU, 0x22d6f961U, 0x9a6a9e04U, 0x07bda6bdU, 0xbf01c1d8U, 0xadb46e36U, 0x15080953U,
+        0x1d724e9aU, 0xa5ce29ffU, 0xb77b8611U, 0x0fc7e174U, 0x9210d9cdU, 0x2aacbea8U, 0x38191146U, 0x80a57623U,
+        0xd8c66675U, 0x607a0110U, 0x72cfaefeU, 0xca73c99bU, 0x57a4f122U, 0xef189647U, 0xfdad39a9U, 0x45115eccU,
+        0x764dee06U, 0xcef18963U, 0xdc44268dU, 0x64f841e8U, 0xf92f7951U, 0x41931e34U, 0x5326b1daU, 0xeb9ad6bfU,
+        0xb3f9c6e9U, 0x0b45a18cU, 0x19f00e62U, 0xa14c6907U, 0x3c9b51beU, 0x842736dbU, 0x96929935U, 0x2e2efe50U,
+        0x2654b999U, 0x9ee8defcU, 0x8c5d7112U, 0x34e11677U, 0xa9362eceU, 0x118a49abU, 0x033fe645U, 0xbb838120U,
+        0xe3e09176U, 0x5b5cf613U, 0x49e959fdU, 0xf1553e98U, 0x6c820621U, 0xd43e6144U, 0xc68bceaaU, 0x7e37a9cfU,
+        0xd67f4138U, 0x6ec3265dU, 0x7c7689b3U, 0xc4caeed6U, 0x591dd66fU, 0xe1a1b10aU, 0xf3141ee4U, 0x4ba87981U,
+        0x13cb69d7U, 0xab770eb2U, 0xb9c2a15cU, 0x017ec639U, 0x9ca9fe80U, 0x241599e5U, 0x36a0360bU, 0x8e1c516eU,
+        0x866616a7U, 0x3eda71c2U, 0x2c6fde2cU, 0x94d3b949U, 0x090481f0U, 0xb1b8e695U, 0xa30d497bU, 0x1bb12e1eU,
+        0x43d23e48U, 0xfb6e592dU, 0xe9dbf6c3U, 0x516791a6U, 0xccb0a91fU, 0x740cce7aU, 0x66b96194U, 0xde0506f1U
+    },
+    {
+        0x00000000U, 0x3d6029b0U, 0x7ac05360U, 0x47a07ad0U, 0xf580a6c0U, 0xc8e08f70U, 0x8f40f5a0U, 0xb220dc10U,
+        0x30704bc1U, 0x0d106271U, 0x4ab018a1U, 0x77d03111U, 0xc5f0ed01U, 0xf890c4b1U, 0xbf30be61U, 0x825097d1U,
+        0x60e09782U, 0x5d80be32U, 0x1a20c4e2U, 0x2740ed52U, 0x95603142U, 0xa80018f2U, 0xefa06222U, 0xd2c04b92U,
+        0x5090dc43U, 0x6df0f5f3U, 0x2a508f23U, 0x1730a693U, 0xa5107a83U, 0x98705333U, 0xdfd029e3U, 0xe2b00053U,
+        0xc1c12f04U, 0xfca106b4U, 0xbb017c64U, 0x866155d4U, 0x344189c4U, 0x0921a074U, 0x4e81daa4U, 0x73e1f314U,
+        0xf1b164c5U, 0xccd14d75U, 0x8b7137a5U, 0xb6111e15U, 0x0431c205U, 0x3951ebb5U, 0x7ef19165U, 0x4391b8d5U,
+        0xa121b886U, 0x9c419136U, 0xdbe1ebe6U, 0xe681c256U, 0x54a11e46U, 0x69c137f6U, 0x2e614d26U, 0x13016496U,
+        0x9151f347U, 0xac31daf7U, 0xeb91a027U, 0xd6f18997U, 0x64d15587U, 0x59b17c37U, 0x1e1106e7U, 0x23712f57U,
+        0x58f35849U, 0x659371f9U, 0x22330b29U, 0x1f532299U, 0xad73fe89U, 0x9013d739U, 0xd7b3ade9U, 0xead38459U,
+        0x68831388U, 0x55e33a38U, 0x124340e8U, 0x2f236958U, 0x9d03b548U, 0xa0639cf8U, 0xe7c3e628U, 0xdaa3cf98U,
+        0x3813cfcbU, 0x0573e67bU, 0x42d39cabU, 0x7fb3b51bU, 0xcd93690bU, 0xf0f340bbU, 0xb7533a6bU, 0x8a3313dbU,
+        0x0863840aU, 0x3503adbaU, 0x72a3d76aU, 0x4fc3fedaU, 0xfde322caU, 0xc0830b7aU, 0x872371aaU, 0xba43581aU,
+        0x9932774dU, 0xa4525efdU, 0xe3f2242dU, 0xde920d9dU, 0x6cb2d18dU, 0x51d2f83dU, 0x167282edU, 0x2b12ab5dU,
+        0xa9423c8cU, 0x9422153cU, 0xd3826fecU, 0xeee2465cU, 0x5cc29a4cU, 0x61a2b3fcU, 0x2602c92cU, 0x1b62e09cU,
+        0xf9d2e0cfU, 0xc4b2c97fU, 0x8312b3afU, 0xbe729a1fU, 0x0c52460fU, 0x31326fbfU, 0x7692156fU, 0x4bf23cdfU,
+        0xc9a2ab0eU, 0xf4c282beU, 0xb362f86eU, 0x8e02d1deU, 0x3c220dceU, 0x0142247eU, 0x46e25eaeU, 0x7b82771eU,
+        0xb1e6b092U, 0x8c869922U, 0xcb26e3f2U, 0xf646ca42U, 0x44661652U, 0x79063fe2U, 0x3ea64532U, 0x03c66c82U,
+        0x8196fb53U, 0xbcf6d2e3U, 0xfb56a833U, 0xc6368183U, 0x74165d93U, 0x49767423U, 0x0ed60ef3U, 0x33b62743U,
+        0xd1062710U, 0xec660ea0U, 0xabc67470U, 0x96a65dc0U, 0x248681d0U, 0x19e6a860U, 0x5e46d2b0U, 0x6326fb00U,
+        0xe1766cd1U, 0xdc164561U, 0x9bb63fb1U, 0xa6d61601U, 0x14f6ca11U, 0x2996e3a1U, 0x6e369971U, 0x5356b0c1U,
+        0x70279f96U, 0x4d47b626U, 0x0ae7ccf6U, 0x3787e546U, 0x85a73956U, 0xb8c710e6U, 0xff676a36U, 0xc2074386U,
+        0x4057d457U, 0x7d37fde7U, 0x3a978737U, 0x07f7ae87U, 0xb5d77297U, 0x88b75b27U, 0xcf1721f7U, 0xf2770847U,
+        0x10c70814U, 0x2da721a4U, 0x6a075b74U, 0x576772c4U, 0xe547aed4U, 0xd8278764U, 0x9f87fdb4U, 0xa2e7d404U,
+        0x20b743d5U, 0x1dd76a65U, 0x5a7710b5U, 0x67173905U, 0xd537e515U, 0xe857cca5U, 0xaff7b675U, 0x92979fc5U,
+        0xe915e8dbU, 0xd475c16bU, 0x93d5bbbbU, 0xaeb5920bU, 0x1c954e1bU, 0x21f567abU, 0x66551d7bU, 0x5b3534cbU,
+        0xd965a31aU, 0xe4058aaaU, 0xa3a5f07aU, 0x9ec5d9caU, 0x2ce505daU, 0x11852c6aU, 0x562556baU, 0x6b457f0aU,
+        0x89f57f59U, 0xb49556e9U, 0xf3352c39U, 0xce550589U, 0x7c75d999U, 0x4115f029U, 0x06b58af9U, 0x3bd5a349U,
+        0xb9853498U, 0x84e51d28U, 0xc34567f8U, 0xfe254e48U, 0x4c059258U, 0x7165bbe8U, 0x36c5c138U, 0x0ba5e888U,
+        0x28d4c7dfU, 0x15b4ee6fU, 0x521494bfU, 0x6f74bd0fU, 0xdd54611fU, 0xe03448afU, 0xa794327fU, 0x9af41bcfU,
+        0x18a48c1eU, 0x25c4a5aeU, 0x6264df7eU, 0x5f04f6ceU, 0xed242adeU, 0xd044036eU, 0x97e479beU, 0xaa84500eU,
+        0x4834505dU, 0x755479edU, 0x32f4033dU, 0x0f942a8dU, 0xbdb4f69dU, 0x80d4df2dU, 0xc774a5fdU, 0xfa148c4dU,
+        0x78441b9cU, 0x4524322cU, 0x028448fcU, 0x3fe4614cU, 0x8dc4bd5cU, 0xb0a494ecU, 0xf704ee3cU, 0xca64c78cU
+    },
+    {
+        0x00000000U, 0xcb5cd3a5U, 0x4dc8a10bU, 0x869472aeU, 0x9b914216U, 0x50cd91b3U, 0xd659e31dU, 0x1d0530b8U,
+        0xec53826dU, 0x270f51c8U, 0xa19b2366U, 0x6ac7f0c3U, 0x77c2c07bU, 0xbc9e13deU, 0x3a0a6170U, 0xf156b2d5U,
+        0x03d6029bU, 0xc88ad13eU, 0x4e1ea390U, 0x85427035U, 0x9847408dU, 0x531b9328U, 0xd58fe186U, 0x1ed33223U,
+        0xef8580f6U, 0x24d95353U, 0xa24d21fdU, 0x6911f258U, 0x7414c2e0U, 0xbf481145U, 0x39dc63ebU, 0xf280b04eU,
+        0x07ac0536U, 0xccf0d693U, 0x4a64a43dU, 0x81387798U, 0x9c3d4720U, 0x57619485U, 0xd1f5e62bU, 0x1aa9358eU,
+        0xebff875bU, 0x20a354feU, 0xa6372650U, 0x6d6bf5f5U, 0x706ec54dU, 0xbb3216e8U, 0x3da66446U, 0xf6fab7e3U,
+        0x047a07adU, 0xcf26d408U, 0x49b2a6a6U, 0x82ee7503U, 0x9feb45bbU, 0x54b7961eU, 0xd223e4b0U, 0x197f3715U,
+        0xe82985c0U, 0x23755665U, 0xa5e124cbU, 0x6ebdf76eU, 0x73b8c7d6U, 0xb8e41473U, 0x3e7066ddU, 0xf52cb578U,
+        0x0f580a6cU, 0xc404d9c9U, 0x4290ab67U, 0x89cc78c2U, 0x94c9487aU, 0x5f959bdfU, 0xd901e971U, 0x125d3ad4U,
+        0xe30b8801U, 0x28575ba4U, 0xaec3290aU, 0x659ffaafU, 0x789aca17U, 0xb3c619b2U, 0x35526b1cU, 0xfe0eb8b9U,
+        0x0c8e08f7U, 0xc7d2db52U, 0x4146a9fcU, 0x8a1a7a59U, 0x971f4ae1U, 0x5c439944U, 0xdad7ebeaU, 0x118b384fU,
+        0xe0dd8a9aU, 0x2b81593fU, 0xad152b91U, 0x6649f834U, 0x7b4cc88cU, 0xb0101b29U, 0x36846987U, 0xfdd8ba22U,
+        0x08f40f5aU, 0xc3a8dcffU, 0x453cae51U, 0x8e607df4U, 0x93654d4cU, 0x58399ee9U, 0xdeadec47U, 0x15f13fe2U,
+        0xe4a78d37U, 0x2ffb5e92U, 0xa96f2c3cU, 0x6233ff99U, 0x7f36cf21U, 0xb46a1c84U, 0x32fe6e2aU, 0xf9a2bd8fU,
+        0x0b220dc1U, 0xc07ede64U, 0x46eaaccaU, 0x8db67f6fU, 0x90b34fd7U, 0x5bef9c72U, 0xdd7beedcU, 0x16273d79U,
+        0xe7718facU, 0x2c2d5c09U, 0xaab92ea7U, 0x61e5fd02U, 0x7ce0cdbaU, 0xb7bc1e1fU, 0x31286cb1U, 0xfa74bf14U,
+        0x1eb014d8U, 0xd5ecc77dU, 0x5378b5d3U, 0x98246676U, 0x852156ceU, 0x4e7d856bU, 0xc8e9f7c5U, 0x03b52460U,
+        0xf2e396b5U, 0x39bf4510U, 0xbf2b37beU, 0x7477e41bU, 0x6972d4a3U, 0xa22e0706U, 0x24ba75a8U, 0xefe6a60dU,
+        0x1d661643U, 0xd63ac5e6U, 0x50aeb748U, 0x9bf264edU, 0x86f75455U, 0x4dab87f0U, 0xcb3ff55eU, 0x006326fbU,
+        0xf135942eU, 0x3a69478bU, 0xbcfd3525U, 0x77a1e680U, 0x6aa4d638U, 0xa1f8059dU, 0x276c7733U, 0xec30a496U,
+        0x191c11eeU, 0xd240c24bU, 0x54d4b0e5U, 0x9f886340U, 0x828d53f8U, 0x49d1805dU, 0xcf45f2f3U, 0x04192156U,
+        0xf54f9383U, 0x3e134026U, 0xb8873288U, 0x73dbe12dU, 0x6eded195U, 0xa5820230U, 0x2316709eU, 0xe84aa33bU,
+        0x1aca1375U, 0xd196c0d0U, 0x5702b27eU, 0x9c5e61dbU, 0x815b5163U, 0x4a0782c6U, 0xcc93f068U, 0x07cf23cdU,
+        0xf6999118U, 0x3dc542bdU, 0xbb513013U, 0x700de3b6U, 0x6d08d30eU, 0xa65400abU, 0x20c07205U, 0xeb9ca1a0U,
+        0x11e81eb4U, 0xdab4cd11U, 0x5c20bfbfU, 0x977c6c1aU, 0x8a795ca2U, 0x41258f07U, 0xc7b1fda9U, 0x0ced2e0cU,
+        0xfdbb9cd9U, 0x36e74f7cU, 0xb0733dd2U, 0x7b2fee77U, 0x662adecfU, 0xad760d6aU, 0x2be27fc4U, 0xe0beac61U,
+        0x123e1c2fU, 0xd962cf8aU, 0x5ff6bd24U, 0x94aa6e81U, 0x89af5e39U, 0x42f38d9cU, 0xc467ff32U, 0x0f3b2c97U,
+        0xfe6d9e42U, 0x35314de7U, 0xb3a53f49U, 0x78f9ececU, 0x65fcdc54U, 0xaea00ff1U, 0x28347d5fU, 0xe368aefaU,
+        0x16441b82U, 0xdd18c827U, 0x5b8cba89U, 0x90d0692cU, 0x8dd55994U, 0x46898a31U, 0xc01df89fU, 0x0b412b3aU,
+        0xfa1799efU, 0x314b4a4aU, 0xb7df38e4U, 0x7c83eb41U, 0x6186dbf9U, 0xaada085cU, 0x2c4e7af2U, 0xe712a957U,
+        0x15921919U, 0xdececabcU, 0x585ab812U, 0x93066bb7U, 0x8e035b0fU, 0x455f88aaU, 0xc3cbfa04U, 0x089729a1U,
+        0xf9c19b74U, 0x329d48d1U, 0xb4093a7fU, 0x7f55e9daU, 0x6250d962U, 0xa90c0ac7U, 0x2f987869U, 0xe4c4abccU
+    },
+    {
+        0x00000000U, 0xa6770bb4U, 0x979f1129U, 0x31e81a9dU, 0xf44f2413U, 0x52382fa7U, 0x63d0353aU, 0xc5a73e8eU,
+        0x33ef4e67U, 0x959845d3U, 0xa4705f4eU, 0x020754faU, 0xc7a06a74U, 0x61d761c0U, 0x503f7b5dU, 0xf64870e9U,
+        0x67de9cceU, 0xc1a9977aU, 0xf0418de7U, 0x56368653U, 0x9391b8ddU, 0x35e6b369U, 0x040ea9f4U, 0xa279a240U,
+        0x5431d2a9U, 0xf246d91dU, 0xc3aec380U, 0x65d9c834U, 0xa07ef6baU, 0x0609fd0eU, 0x37e1e793U, 0x9196ec27U,
+        0xcfbd399cU, 0x69ca3228U, 0x582228b5U, 0xfe552301U, 0x3bf21d8fU, 0x9d85163bU, 0xac6d0ca6U, 0x0a1a0712U,
+        0xfc5277fbU, 0x5a257c4fU, 0x6bcd66d2U, 0xcdba6d66U, 0x081d53e8U, 0xae6a585cU, 0x9f8242c1U, 0x39f54975U,
+        0xa863a552U, 0x0e14aee6U, 0x3ffcb47bU, 0x998bbfcfU, 0x5c2c8141U, 0xfa5b8af5U, 0xcbb39068U, 0x6dc49bdcU,
+        0x9b8ceb35U, 0x3dfbe081U, 0x0c13fa1cU, 0xaa64f1a8U, 0x6fc3cf26U, 0xc9b4c492U, 0xf85cde0fU, 0x5e2bd5bbU,
+        0x440b7579U, 0xe27c7ecdU, 0xd3946450U, 0x75e36fe4U, 0xb044516aU, 0x16335adeU, 0x27db4043U, 0x81ac4bf7U,
+        0x77e43b1eU, 0xd19330aaU, 0xe07b2a37U, 0x460c2183U, 0x83ab1f0dU, 0x25dc14b9U, 0x14340e24U, 0xb2430590U,
+        0x23d5e9b7U, 0x85a2e203U, 0xb44af89eU, 0x123df32aU, 0xd79acda4U, 0x71edc610U, 0x4005dc8dU, 0xe672d739U,
+        0x103aa7d0U, 0xb64dac64U, 0x87a5b6f9U, 0x21d2bd4dU, 0xe47583c3U, 0x42028877U, 0x73ea92eaU, 0xd59d995eU,
+        0x8bb64ce5U, 0x2dc14751U, 0x1c295dccU, 0xba5e5678U, 0x7ff968f6U, 0xd98e6342U, 0xe86679dfU, 0x4e11726bU,
+        0xb8590282U, 0x1e2e0936U, 0x2fc613abU, 0x89b1181fU, 0x4c162691U, 0xea612d25U, 0xdb8937b8U, 0x7dfe3c0cU,
+        0xec68d02bU, 0x4a1fdb9fU, 0x7bf7c102U, 0xdd80cab6U, 0x1827f438U, 0xbe50ff8cU, 0x8fb8e511U, 0x29cfeea5U,
+        0xdf879e4cU, 0x79f095f8U, 0x48188f65U, 0xee6f84d1U, 0x2bc8ba5fU, 0x8dbfb1ebU, 0xbc57ab76U, 0x1a20a0c2U,
+        0x8816eaf2U, 0x2e61e146U, 0x1f89fbdbU, 0xb9fef06fU, 0x7c59cee1U, 0xda2ec555U, 0xebc6dfc8U, 0x4db1d47cU,
+        0xbbf9a495U, 0x1d8eaf21U, 0x2c66b5bcU, 0x8a11be08U, 0x4fb68086U, 0xe9c18b32U, 0xd82991afU, 0x7e5e9a1bU,
+        0xefc8763cU, 0x49bf7d88U, 0x78576715U, 0xde206ca1U, 0x1b87522fU, 0xbdf0599bU, 0x8c184306U, 0x2a6f48b2U,
+        0xdc27385bU, 0x7a5033efU, 0x4bb82972U, 0xedcf22c6U, 0x28681c48U, 0x8e1f17fcU, 0xbff70d61U, 0x198006d5U,
+        0x47abd36eU, 0xe1dcd8daU, 0xd034c247U, 0x7643c9f3U, 0xb3e4f77dU, 0x1593fcc9U, 0x247be654U, 0x820cede0U,
+        0x74449d09U, 0xd23396bdU, 0xe3db8c20U, 0x45ac8794U, 0x800bb91aU, 0x267cb2aeU, 0x1794a833U, 0xb1e3a387U,
+        0x20754fa0U, 0x86024414U, 0xb7ea5e89U, 0x119d553dU, 0xd43a6bb3U, 0x724d6007U, 0x43a57a9aU, 0xe5d2712eU,
+        0x139a01c7U, 0xb5ed0a73U, 0x840510eeU, 0x22721b5aU, 0xe7d525d4U, 0x41a22e60U, 0x704a34fdU, 0xd63d3f49U,
+        0xcc1d9f8bU, 0x6a6a943fU, 0x5b828ea2U, 0xfdf58516U, 0x3852bb98U, 0x9e25b02cU, 0xafcdaab1U, 0x09baa105U,
+        0xfff2d1ecU, 0x5985da58U, 0x686dc0c5U, 0xce1acb71U, 0x0bbdf5ffU, 0xadcafe4bU, 0x9c22e4d6U, 0x3a55ef62U,
+        0xabc30345U, 0x0db408f1U, 0x3c5c126cU, 0x9a2b19d8U, 0x5f8c2756U, 0xf9fb2ce2U, 0xc813367fU, 0x6e643dcbU,
+        0x982c4d22U, 0x3e5b4696U, 0x0fb35c0bU, 0xa9c457bfU, 0x6c636931U, 0xca146285U, 0xfbfc7818U, 0x5d8b73acU,
+        0x03a0a617U, 0xa5d7ada3U, 0x943fb73eU, 0x3248bc8aU, 0xf7ef8204U, 0x519889b0U, 0x6070932dU, 0xc6079899U,
+        0x304fe870U, 0x9638e3c4U, 0xa7d0f959U, 0x01a7f2edU, 0xc400cc63U, 0x6277c7d7U, 0x539fdd4aU, 0xf5e8d6feU,
+        0x647e3ad9U, 0xc209316dU, 0xf3e12bf0U, 0x55962044U, 0x90311ecaU, 0x3646157eU, 0x07ae0fe3U, 0xa1d90457U,
+        0x579174beU, 0xf1e67f0aU, 0xc00e6597U, 0x66796e23U, 0xa3de50adU, 0x05a95b19U, 0x34414184U, 0x92364a30U
+    },
+    {
+        0x00000000U, 0xccaa009eU, 0x4225077dU, 0x8e8f07e3U, 0x844a0efaU, 0x48e00e64U, 0xc66f0987U, 0x0ac50919U,
+        0xd3e51bb5U, 0x1f4f1b2bU, 0x91c01cc8U, 0x5d6a1c56U, 0x57af154fU, 0x9b0515d1U, 0x158a1232U, 0xd92012acU,
+        0x7cbb312bU, 0xb01131b5U, 0x3e9e3656U, 0xf23436c8U, 0xf8f13fd1U, 0x345b3f4fU, 0xbad438acU, 0x767e3832U,
+        0xaf5e2a9eU, 0x63f42a00U, 0xed7b2de3U, 0x21d12d7dU, 0x2b142464U, 0xe7be24faU, 0x69312319U, 0xa59b2387U,
+        0xf9766256U, 0x35dc62c8U, 0xbb53652bU, 0x77f965b5U, 0x7d3c6cacU, 0xb1966c32U, 0x3f196bd1U, 0xf3b36b4fU,
+        0x2a9379e3U, 0xe639797dU, 0x68b67e9eU, 0xa41c7e00U, 0xaed97719U, 0x62737787U, 0xecfc7064U, 0x205670faU,
+        0x85cd537dU, 0x496753e3U, 0xc7e85400U, 0x0b42549eU, 0x01875d87U, 0xcd2d5d19U, 0x43a25afaU, 0x8f085a64U,
+        0x562848c8U, 0x9a824856U, 0x140d4fb5U, 0xd8a74f2bU, 0xd2624632U, 0x1ec846acU, 0x9047414fU, 0x5ced41d1U,
+        0x299dc2edU, 0xe537c273U, 0x6bb8c590U, 0xa712c50eU, 0xadd7cc17U, 0x617dcc89U, 0xeff2cb6aU, 0x2358cbf4U,
+        0xfa78d958U, 0x36d2d9c6U, 0xb85dde25U, 0x74f7debbU, 0x7e32d7a2U, 0xb298d73cU, 0x3c17d0dfU, 0xf0bdd041U,
+        0x5526f3c6U, 0x998cf358U, 0x1703f4bbU, 0xdba9f425U, 0xd16cfd3cU, 0x1dc6fda2U, 0x9349fa41U, 0x5fe3fadfU,
+        0x86c3e873U, 0x4a69e8edU, 0xc4e6ef0eU, 0x084cef90U, 0x0289e689U, 0xce23e617U, 0x40ace1f4U, 0x8c06e16aU,
+        0xd0eba0bbU, 0x1c41a025U, 0x92cea7c6U, 0x5e64a758U, 0x54a1ae41U, 0x980baedfU, 0x1684a93cU, 0xda2ea9a2U,
+        0x030ebb0eU, 0xcfa4bb90U, 0x412bbc73U, 0x8d81bcedU, 0x8744b5f4U, 0x4beeb56aU, 0xc561b289U, 0x09cbb217U,
+        0xac509190U, 0x60fa910eU, 0xee7596edU, 0x22df9673U, 0x281a9f6aU, 0xe4b09ff4U, 0x6a3f9817U, 0xa6959889U,
+        0x7fb58a25U, 0xb31f8abbU, 0x3d908d58U, 0xf13a8dc6U, 0xfbff84dfU, 0x37558441U, 0xb9da83a2U, 0x7570833cU,
+        0x533b85daU, 0x9f918544U, 0x111e82a7U, 0xddb48239U, 0xd7718b20U, 0x1bdb8bbeU, 0x95548c5dU, 0x59fe8cc3U,
+        0x80de9e6fU, 0x4c749ef1U, 0xc2fb9912U, 0x0e51998cU, 0x04949095U, 0xc83e900bU, 0x46b197e8U, 0x8a1b9776U,
+        0x2f80b4f1U, 0xe32ab46fU, 0x6da5b38cU, 0xa10fb312U, 0xabcaba0bU, 0x6760ba95U, 0xe9efbd76U, 0x2545bde8U,
+        0xfc65af44U, 0x30cfafdaU, 0xbe40a839U, 0x72eaa8a7U, 0x782fa1beU, 0xb485a120U, 0x3a0aa6c3U, 0xf6a0a65dU,
+        0xaa4de78cU, 0x66e7e712U, 0xe868e0f1U, 0x24c2e06fU, 0x2e07e976U, 0xe2ade9e8U, 0x6c22ee0bU, 0xa088ee95U,
+        0x79a8fc39U, 0xb502fca7U, 0x3b8dfb44U, 0xf727fbdaU, 0xfde2f2c3U, 0x3148f25dU, 0xbfc7f5beU, 0x736df520U,
+        0xd6f6d6a7U, 0x1a5cd639U, 0x94d3d1daU, 0x5879d144U, 0x52bcd85dU, 0x9e16d8c3U, 0x1099df20U, 0xdc33dfbeU,
+        0x0513cd12U, 0xc9b9cd8cU, 0x4736ca6fU, 0x8b9ccaf1U, 0x8159c3e8U, 0x4df3c376U, 0xc37cc495U, 0x0fd6c40bU,
+        0x7aa64737U, 0xb60c47a9U, 0x3883404aU, 0xf42940d4U, 0xfeec49cdU, 0x32464953U, 0xbcc94eb0U, 0x70634e2eU,
+        0xa9435c82U, 0x65e95c1cU, 0xeb665bffU, 0x27cc5b61U, 0x2d095278U, 0xe1a352e6U, 0x6f2c5505U, 0xa386559bU,
+        0x061d761cU, 0xcab77682U, 0x44387161U, 0x889271ffU, 0x825778e6U, 0x4efd7878U, 0xc0727f9bU, 0x0cd87f05U,
+        0xd5f86da9U, 0x19526d37U, 0x97dd6ad4U, 0x5b776a4aU, 0x51b26353U, 0x9d1863cdU, 0x1397642eU, 0xdf3d64b0U,
+        0x83d02561U, 0x4f7a25ffU, 0xc1f5221cU, 0x0d5f2282U, 0x079a2b9bU, 0xcb302b05U, 0x45bf2ce6U, 0x89152c78U,
+        0x50353ed4U, 0x9c9f3e4aU, 0x121039a9U, 0xdeba3937U, 0xd47f302eU, 0x18d530b0U, 0x965a3753U, 0x5af037cdU,
+        0xff6b144aU, 0x33c114d4U, 0xbd4e1337U, 0x71e413a9U, 0x7b211ab0U, 0xb78b1a2eU, 0x39041dcdU, 0xf5ae1d53U,
+        0x2c8e0fffU, 0xe0240f61U, 0x6eab0882U, 0xa201081cU, 0xa8c40105U, 0x646e019bU, 0xeae10678U, 0x264b06e6U
+    }
+};
+
+/*
+Unpacking Tables For Samples Smaller Than A Byte:
+UNPACK_nBIT[scale][b] Is The Byte b Split Into Its 8/n Samples, Leftmost First, Either As They Are (scale 0, For
+Palette Indexes) Or Stretched Out To 0-255 (scale 1, For Grayscale), So A Whole Byte Unpacks With One Lookup
+*/
+#define UNPACK1(b, s) {((b)>>7&1)*(s), ((b)>>6&1)*(s), ((b)>>5&1)*(s), ((b)>>4&1)*(s), ((b)>>3&1)*(s), ((b)>>2&1)*(s), ((b)>>1&1)*(s), ((b)&1)*(s)}
+#define UNPACK2(b, s) {((b)>>6&3)*(s), ((b)>>4&3)*(s), ((b)>>2&3)*(s), ((b)&3)*(s)}
+#define UNPACK4(b, s) {((b)>>4&15)*(s), ((b)&15)*(s)}
+#define UNPACK_TABLE4(X, b, s)  X(b, s), X((b)+1, s), X((b)+2, s), X((b)+3, s)
+#define UNPACK_TABLE16(X, b, s) UNPACK_TABLE4(X, b, s), UNPACK_TABLE4(X, (b)+4, s), UNPACK_TABLE4(X, (b)+8, s), UNPACK_TABLE4(X, (b)+12, s)
+#define UNPACK_TABLE64(X, b, s) UNPACK_TABLE16(X, b, s), UNPACK_TABLE16(X, (b)+16, s), UNPACK_TABLE16(X, (b)+32, s), UNPACK_TABLE16(X, (b)+48, s)
+#define UNPACK_TABLE(X, s)      {UNPACK_TABLE64(X, 0, s), UNPACK_TABLE64(X, 64, s), UNPACK_TABLE64(X, 128, s), UNPACK_TABLE64(X, 192, s)}
+
+const unsigned char UNPACK_1BIT[2][256][8] = {UNPACK_TABLE(UNPACK1, 1), UNPACK_TABLE(UNPACK1, 255)};
+const unsigned char UNPACK_2BIT[2][256][4] = {UNPACK_TABLE(UNPACK2, 1), UNPACK_TABLE(UNPACK2, 85)};
+const unsigned char UNPACK_4BIT[2][256][2] = {UNPACK_TABLE(UNPACK4, 1), UNPACK_TABLE(UNPACK4, 17)};
 
 
 typedef struct Pix {
     int RGBA[4];
 } Pix;
 typedef struct PLTE {
-    Pix* indexes;
+    Pix* indexes;   // RGBA[3] is the alpha from tRNS, or 255 if there isn't one
     int indexCount;
+
+    // every possible index (all 256 of them, the ones past the end of the palette being opaque black) packed as
+    // R, G, B, A bytes, so expanding an index is one 32 bit load, and as gray, alpha byte pairs. See packPalette
+    unsigned int* packed;
+    unsigned char* gray;
 } PLTE;
+typedef struct TRNS {
+    int present; // 1 if a grayscale or RGB image has a tRNS chunk (a palette's goes in PLTE instead)
+    int key[3];  // the one gray level, or RGB color, that's fully transparent, at the image's bit depth
+} TRNS;
 typedef struct Chunk {
     int length;
     unsigned char type[4];
     unsigned char *data;
     unsigned char crc[4];
+
+    long int offset; // where data starts in PNG.bytes
+    int owned;       // 1 if data is a private copy that has to be freed
 } Chunk;
+typedef struct ChunkIndex {
+    int ihdr;            // index of the first IHDR chunk, -1 if there isn't one
+    int plte;            // index of the first PLTE chunk, -1 if there isn't one
+    int trns;            // index of the first tRNS chunk, -1 if there isn't one
+    int idatFirst;       // index of the first IDAT chunk, -1 if there isn't one
+    int idatCount;       // how many IDAT chunks follow it (they have to be consecutive)
+    long int idatLength; // combined length of the IDAT run
+} ChunkIndex;
 typedef struct IHDR {
     int width;
     int height;
@@ -132,43 +561,770 @@ typedef struct IHDR {
     int interlacem;
     int channels;
 } IHDR;
+typedef struct ArenaBlock {
+    struct ArenaBlock* next; // the block that filled up before this one
+    size_t size;             // bytes after the header
+    size_t used;
+} ArenaBlock;
+typedef struct PNGArena {
+    ArenaBlock* blocks; // newest first. After a reset there's only ever one, with room for the biggest image so far
+    size_t used;        // bytes handed out since the last reset, over every block
+    size_t peak;        // the most that's ever been handed out between two resets
+} PNGArena;
+typedef struct ArenaMark {
+    ArenaBlock* block;
+    size_t blockUsed;
+    size_t used;
+} ArenaMark;
 typedef struct PNG {
     Chunk* chunks;
     int chunkCount;
+    ChunkIndex index;
 
     unsigned char* bytes;
     long int byteCount;
+    int mapped; // 1 if bytes is a memory-mapped view of the file rather than a malloc'd buffer
+    PNGArena* arena; // the decoder's arena if bytes, chunks and palette live in it (PNG_USE_ARENA), otherwise NULL
 
     IHDR iheader;
     PLTE palette;
+    TRNS transparency;
     Pix* pixels;
 } PNG;
+typedef struct CorpusImage {
+    int width;
+    int height;
+    int colort;
+    int bitd;
+    int interlacem;
+    int filter;       // 0-4 to use that filter on every row, or 5 to go round all five from one row to the next
+    long int split;   // most bytes in one IDAT chunk, 0 for the whole stream in one
+    int transparent;  // 1 to add a tRNS chunk, for the color types that can have one
+    unsigned int seed;
+} CorpusImage;
+typedef struct BenchResult {
+    double seconds[STAGE_COUNT]; // each stage's best time out of all the iterations
+    double bytes[STAGE_COUNT];   // how much each stage works through: the file, the inflated rows, or the pixels
+    double pixels;
+    double reference;             // libpng's best time for the whole decode, with --compare
+    int matched;                  // 1 if libpng decoded exactly the same pixels
+} BenchResult;
+typedef struct PNGText {
+    char keyword[80];
+    char* text;   // NUL terminated, and Latin-1 like the PNG spec says
+} PNGText;
+typedef struct PNGInfo {
+    IHDR iheader;
+    int paletteCount;   // how many colors PLTE has, 0 if there isn't one
+    int transparent;    // 1 if there's a tRNS chunk
+
+    int hasPhys;        // pHYs: pixels per unit along each axis, where the unit is 1 for meters or 0 if it's just an aspect ratio
+    unsigned long pixelsPerUnitX;
+    unsigned long pixelsPerUnitY;
+    int unit;
+
+    int hasTime;        // tIME: when the image was last changed, in UTC
+    int year, month, day, hour, minute, second;
+
+    char iccName[80];   // iCCP: the embedded ICC profile, already inflated, or NULL if there isn't one
+    unsigned char* iccProfile;
+    long int iccLength;
+
+    PNGText* texts;     // every tEXt and zTXt chunk, in the order they're in the file
+    int textCount;
+
+    long int bytesRead; // how far into the file probePNG had to read
+} PNGInfo;
+// Inflate Backend Results
+#define INFLATE_OK     0 // Made Progress, Call Again With More Input Or Output Space
+#define INFLATE_DONE   1 // Reached The End Of The zlib Stream
+#define INFLATE_ERROR -1
+
+typedef struct InflateBackend {
+    char* name;
+
+    // incremental inflate, all NULL if the backend can only do a whole buffer at once
+    void* (*start)(void);
+    int (*run)(void*, unsigned char**, unsigned int*, unsigned char**, unsigned int*);
+    int (*reset)(void*); // gets a finished (or abandoned) state ready for a new stream, returns 1 on success
+    void (*end)(void*);
+
+    // inflates (compressed, its length) into exactly (out, out_len) bytes, returns 1 on success. The first argument
+    // is where the backend can keep whatever it needs between images (see PNGDecoder.wholeState), which endWhole
+    // frees. NULL makes it start from scratch every time. endWhole is NULL for backends that don't keep anything
+    int (*whole)(void**, unsigned char*, long int, unsigned char*, long int);
+    void (*endWhole)(void*);
+
+    // for inflating segments of the stream separately (see decodePixelsParallel), NULL if the backend can't:
+    // starts a state for a bare deflate stream without the zlib header, and says whether a state stopped
+    // exactly between two deflate blocks
+    void* (*startRaw)(void);
+    int (*boundary)(void*);
+} InflateBackend;
+
+// Undoes one type of filter on one scanline: (row, row above it, bytes in the row, bytes per pixel)
+typedef void (*UnfilterKernel)(unsigned char*, unsigned char*, int, int);
+
+typedef struct Adam7Pass {
+    int x, y;                     // the pass's first pixel
+    int dx, dy;                   // how far apart its pixels are
+    int blockWidth, blockHeight;  // how much of the image each of them stands in for until later passes fill it in
+} Adam7Pass;
+
+// The Seven Passes Of An Interlaced Image
+const Adam7Pass ADAM7[7] = {
+    {0, 0, 8, 8, 8, 8}, {4, 0, 8, 8, 4, 8}, {0, 4, 4, 8, 4, 4}, {2, 0, 4, 4, 2, 4},
+    {0, 2, 2, 4, 2, 2}, {1, 0, 2, 2, 1, 2}, {0, 1, 1, 2, 1, 1}
+};
+
+typedef struct PNGStats {
+    long long nanoseconds[STAGE_COUNT]; // time spent in each stage (STAGE_READ etc), added up over every image
+    long long bytes[STAGE_COUNT];       // and what it got through: the file, the inflated rows, or the pixels out
+    long long filterRows[5];            // rows that were unfiltered with each filter type, None to Paeth
+    long long images;                   // images decoded
+    long long peakScratch;              // the most scratch memory one decode has used (see decodeProgressive)
+} PNGStats;
+typedef struct RowDecoder {
+    InflateBackend* backend;
+    void* state;               // the backend's incremental inflate state
+    unsigned char* next_in;
+    unsigned int avail_in;
+    unsigned char* inflated;   // the whole inflated IDAT run, only used by backends that can't stream
+    PNGArena* arena;           // where inflated came from, NULL for malloc
+    PNGStats* stats;           // the decoder's
+
+    Chunk* chunks;
+    ChunkIndex index;
+    int nextIdat; // the next IDAT chunk to hand to inflate
+
+    IHDR image;   // the whole image's header
+    IHDR info;    // the same, except for interlaced images where it's the size of the current pass (see startPass)
+    int stride;   // bytes in one scanline, not counting its filter byte
+    int bpp;      // bytes per complete pixel (at least 1), which is how far back the filters look
+    int row;      // how many rows (of this pass) have been decoded so far
+    long int offset; // where the next row starts in inflated
+
+    unsigned char* rows;     // room for two scanlines, each with its filter byte in front
+    unsigned char* current;
+    unsigned char* previous;
+    UnfilterKernel unfilters[5]; // the fastest kernel for each filter type, picked for this image's bpp
+} RowDecoder;
+typedef struct PNGDecoder {
+    int flags;                // PNG_COPY_CHUNKS etc, applied to every PNG this decoder reads
+    InflateBackend* backend;
+
+    // scratch memory kept between decodes, so decoding the next image usually doesn't allocate
+    unsigned char* rows;      // the RowDecoder's two scanlines
+    long int rowsSize;
+    void* inflateState;       // the backend's incremental state, reset rather than remade for each image
+    void* wholeState;         // and what its whole-buffer inflate keeps between images, like libdeflate's decompressor
+    PNGArena arena;           // everything else a PNG_USE_ARENA decode needs, which each readPNG starts over
+
+    PNGStats stats;           // what every decode so far has spent its time on, if it was built with PNG_STATS
+    struct PNGCache* cache;   // decoded pixels to reuse instead of decoding again, NULL for none (see decodeCached)
+} PNGDecoder;
+typedef struct PNGRowReader {
+    PNG png;            // everything but the pixels, which are handed out one row at a time instead
+    RowDecoder decoder;
+    int format;         // one of the PIX_FORMAT values, rows come out in this layout
+    int status;         // PNG_OK, or why nextRow stopped early
+    int y;              // the next row nextRow hands out
+    void* row;          // the most recent row, reused by every call to nextRow
+    unsigned char* interleaved; // a planar row before it's split into planes
+    unsigned char* pixels;      // an interlaced image, decoded whole when it's opened since no row is done before the last pass
+} PNGRowReader;
+typedef struct PNGRegion {
+    int x, y;          // the rectangle's top left pixel
+    int width, height; // its size, where 0 means everything right of x (or below y)
+    int scale;         // 1, 2, 4 or 8: each pixel out is the average of a scale x scale box of the rectangle's
+} PNGRegion;
+typedef struct RegionDecode {
+    PNG* png;
+    PNGRegion region;   // clipped to the image, so width and height are never 0
+    int format;         // what was asked for, but always interleaved. Planar rows are only split up as they're stored
+    int planar;
+    int outWidth;       // the region divided by the scale, rounded up, since boxes on the edge can be short
+    int outHeight;
+    unsigned char* out;
+    unsigned char* span;   // one row of the region's columns, converted
+    unsigned char* outRow; // one row of output before it's split into planes
+    unsigned int* sums;    // each output sample's box so far, for the output row being filled
+    int boxRows;           // how many rows have gone into sums
+} RegionDecode;
+
+// Called once per row by decodeRowsFromPath, with the row in the format that was asked for.
+// Return nonzero to stop decoding early
+typedef int (*RowCallback)(void* row, int y, IHDR info, void* user);
+
+// Called by decodeProgressive after each pass of an interlaced image (1 to 7), with the whole image so far in the
+// format that was asked for. Return nonzero to stop there, once the preview is good enough
+typedef int (*PassCallback)(int pass, unsigned char* pixels, IHDR info, void* user);
+
+// Just Enough Threading For decodeBatch And decodePixelsParallel
+#ifdef _WIN32
+typedef HANDLE PNGThread;
+typedef CRITICAL_SECTION PNGMutex;
+#define initMutex(m)   InitializeCriticalSection(m)
+#define lockMutex(m)   EnterCriticalSection(m)
+#define unlockMutex(m) LeaveCriticalSection(m)
+#define freeMutex(m)   DeleteCriticalSection(m)
+typedef CONDITION_VARIABLE PNGCond;
+#define initCond(c)    InitializeConditionVariable(c)
+#define waitCond(c, m) SleepConditionVariableCS(c, m, INFINITE)
+#define wakeCond(c)    WakeAllConditionVariable(c)
+#define freeCond(c)    ((void) (c))
+#else
+typedef pthread_t PNGThread;
+typedef pthread_mutex_t PNGMutex;
+#define initMutex(m)   pthread_mutex_init(m, NULL)
+#define lockMutex(m)   pthread_mutex_lock(m)
+#define unlockMutex(m) pthread_mutex_unlock(m)
+#define freeMutex(m)   pthread_mutex_destroy(m)
+typedef pthread_cond_t PNGCond;
+#define initCond(c)    pthread_cond_init(c, NULL)
+#define waitCond(c, m) pthread_cond_wait(c, m)
+#define wakeCond(c)    pthread_cond_broadcast(c)
+#define freeCond(c)    pthread_cond_destroy(c)
+#endif
+
+typedef struct CacheKey {
+    unsigned long long hash; // the stored CRCs of IHDR, PLTE, tRNS and every IDAT, mixed together (see getCacheKey)
+    long int idatLength;
+    int width;
+    int height;
+    int format;
+} CacheKey;
+typedef struct CacheEntry {
+    CacheKey key;
+    unsigned char* pixels;      // read-only once it's in the cache
+    size_t size;
+    int mapped;                 // 1 if pixels is a view of a file in the cache directory, rather than malloc'd
+    int cached;                 // 0 for pixels too big for the budget, which are freed as soon as they're released
+    int users;                  // decodeCached calls that haven't been released yet; entries in use are never evicted
+    struct CacheEntry* newer;   // the LRU list, most recently used first
+    struct CacheEntry* older;
+    struct CacheEntry* next;    // the rest of the hash bucket
+} CacheEntry;
+typedef struct PNGCache {
+    size_t budget;              // most bytes of pixels to keep in memory
+    size_t used;
+    char* directory;            // where decoded images are also written and mapped back from, NULL to only keep them in memory
+    CacheEntry** buckets;
+    int bucketCount;            // always a power of 2
+    int count;
+    CacheEntry* newest;
+    CacheEntry* oldest;
+    long long hits;
+    long long misses;
+    long long loads;            // misses that were mapped in from the directory rather than decoded
+    PNGMutex lock;              // guards everything, so one cache can be shared by all of a batch's workers
+} PNGCache;
+
+typedef struct ThreadStart {
+    void (*function)(void*);
+    void* arg;
+} ThreadStart;
+typedef struct JobQueue {
+    int (*run)(void*, int);
+    void* context;
+    PNGMutex lock;       // guards next and status
+    int next;
+    int count;
+    int status;
+} JobQueue;
+
+// Called by decodeBatch once per path, from whichever worker thread decoded it, so it has to be thread safe.
+// png and pixels (in the format that was asked for) are only valid during the call, and pixels is NULL unless
+// status is PNG_OK. Return nonzero to stop the batch, which skips every path no worker has started on yet
+typedef int (*BatchCallback)(int index, char* path, int status, PNG* png, unsigned char* pixels, void* user);
+
+typedef struct BatchWorker {
+    struct PNGBatch* batch;
+    int id;
+    PNGThread thread;
+    PNGDecoder decoder;  // scratch memory that's reused for every file this worker decodes
+    unsigned char* out;  // and the buffer their pixels are decoded into
+    size_t outSize;
+
+    PNGMutex lock;       // guards next and end, which other workers change when they steal from this one
+    int next;            // the paths this worker still has to decode are [next, end)
+    int end;
+} BatchWorker;
+typedef struct PNGBatch {
+    char** paths;
+    int format;
+    BatchCallback callback;
+    void* user;
+
+    BatchWorker* workers;
+    int workerCount;
+    PNGMutex lock;       // guards stopped
+    int stopped;
+} PNGBatch;
+
+// Parallel Decoding Of A Single Image
+#define PARALLEL_MIN_BYTES   (1 << 22) // Images That Inflate To Less Than This Aren't Worth Starting Threads For
+#define PARALLEL_SEGMENT_MIN (1 << 16) // Compressed Segments Are At Least This Big, However Many Flush Points There Are
+#define PARALLEL_SLOT_BYTES  (1 << 18) // Inflated Bytes Per Slot When Pipelining
+#define PARALLEL_SLOTS       4
+
+typedef struct InflateSegment {
+    unsigned char* in;     // where this segment starts in the compressed stream
+    long int inLength;
+    int raw;               // every segment but the first is a bare deflate stream without the zlib header
+    long int expected;     // a guess at how much it inflates to
+
+    unsigned char* out;
+    long int outLength;
+    long int outCapacity;
+    long int start;        // where out goes in the whole inflated stream
+
+    int finished;          // 1 if the deflate stream ended in this segment, which only the last one may do
+    unsigned char* tail;   // and what was left of its input after that, which should be the Adler-32 trailer
+    long int tailLength;
+    unsigned long adler;   // Adler-32 of out, combined across the segments to check against the trailer
+} InflateSegment;
+typedef struct ParallelDecode {
+    PNG* png;
+    InflateBackend* backend;
+    int format;
+    unsigned char* out;
+    int threads;
+
+    int stride;
+    int bpp;
+    int rowSize;           // stride, or more for images with less than a byte per sample (see startRowDecoder)
+    UnfilterKernel unfilters[5];
+
+    PNGMutex lock;         // guards status, produced and consumed
+    int status;
+
+    InflateSegment* segments;
+    int segmentCount;
+    int* bands;            // the first row of each band, then the height
+    int bandCount;
+
+    RowDecoder rows;       // the pipeline's inflating side
+    unsigned char* slots;
+    long int slotSize;
+    int slotRows;
+    int produced;          // slots inflated so far
+    int consumed;          // slots unfiltered so far
+    PNGCond changed;
+} ParallelDecode;
+
+// Encoder Filter Choices, Besides Filter Types 0-4 Which Use That Filter For Every Row
+#define FILTER_ADAPTIVE   5 // Whichever Filter Leaves The Row With The Smallest Sum Of Absolute Differences
+#define FILTER_EXHAUSTIVE 6 // Whichever Filter Actually Deflates The Smallest, By Trying Every One
+
+#define ENCODE_BLOCK_BYTES (1 << 17) // About How Many Filtered Bytes Each Thread Deflates At A Time
+#define ENCODE_IDAT_BYTES  (1 << 16) // Most Compressed Bytes Written To One IDAT Chunk
+
+// Makes one type of filter on one scanline: (out, row, row above it, bytes in the row, bytes per pixel)
+typedef void (*FilterKernel)(unsigned char*, unsigned char*, unsigned char*, int, int);
+
+typedef struct PNGEncoder {
+    int level;       // zlib compression level, 0 (stored) to 9
+    int filter;      // a filter type from 0 to 4, FILTER_ADAPTIVE or FILTER_EXHAUSTIVE
+    int threads;     // how many threads filter and deflate, 0 for one per core; it doesn't change the file
+    int restartable; // 1 to make every block of rows decodable on its own (see encodePixels)
+} PNGEncoder;
+typedef struct EncodeBlock {
+    int first;            // the block's first row
+    int rows;
+    unsigned char* out;   // its rows, deflated
+    long int outLength;
+    unsigned long adler;  // Adler-32 of its filtered rows, for the zlib trailer
+} EncodeBlock;
+typedef struct PNGEncode {
+    PNGEncoder* encoder;
+    unsigned char* pixels;
+    int format;
+    int indexed;
+    IHDR info;            // what goes in IHDR
+
+    int stride;
+    int bpp;
+    FilterKernel filters[5];
+
+    unsigned char* filtered;  // every row with its filter byte in front, ready to deflate
+    EncodeBlock* blocks;
+    int blockCount;
+} PNGEncode;
 
 
 PNG getPNGFromPath(char*);
-PLTE getPaletteFromChunks(Chunk*, int);
-Chunk* getChunksFromBytes(unsigned char*);
+PNG getPNGFromPathWithFlags(char*, int);
+PLTE getPaletteFromChunks(Chunk*, ChunkIndex, PNGArena*);
+TRNS getTransparencyFromChunks(Chunk*, ChunkIndex, IHDR, PLTE*);
+int packPalette(PLTE*, PNGArena*);
+int getChunksFromBytes(unsigned char*, long int, int, PNGArena*, Chunk**, int*, ChunkIndex*);
+int getHeaderFromChunks(PNG*);
+int getHeaderFromBytes(unsigned char*, IHDR*);
+
+int probePNG(PNGDecoder*, char*, PNGInfo*);
+void freePNGInfo(PNGInfo*);
+int getInfoFromChunk(Chunk*, PNGInfo*);
+int getKeyword(Chunk*, char*);
+int inflateMetadata(unsigned char*, long int, unsigned char**, long int*);
+int probeFromArgs(PNGDecoder*, int, char*[]);
+
+int makeCorpus(char*, unsigned int);
+int writeCorpusImage(char*, CorpusImage*);
+int getCorpusSample(CorpusImage*, int, int, int);
+void packCorpusRow(CorpusImage*, int, int, int, int, unsigned char*);
+int corpusFromArgs(int, char*[]);
+int benchFile(PNGDecoder*, char*, int, int, BenchResult*);
+int unfilterAll(IHDR, unsigned char*, unsigned char*);
+void expandAll(PNG*, unsigned char*, int, unsigned char*, unsigned char*);
+double keepBest(double*, double);
+int benchFromArgs(PNGDecoder*, int, char*[]);
+#ifdef HAVE_LIBPNG
+unsigned char* decodeWithLibpng(char*, int*, int*);
+#endif
 
-int hasValidCRC(Chunk*);
-int getChunkCount(unsigned char*);
+int getOutputType(char*);
+int getOutputFormat(PNG*, int);
+char* getOutputPath(char*, int);
+int writePixels(char*, int, unsigned char*, int, int, int);
+int writeSamples(FILE*, unsigned char*, long int, int, int);
+int writeText(FILE*, unsigned char*, long int, int);
+int isBigEndian(void);
+
+void initDecoder(PNGDecoder*);
+void freeDecoder(PNGDecoder*);
+int setDecoderBackend(PNGDecoder*, char*);
+char* describeStatus(int);
+int readPNG(PNGDecoder*, char*, PNG*);
+int decodePNG(PNGDecoder*, char*, PNG*);
+int decodePixelsAs(PNGDecoder*, PNG*, int, unsigned char**);
+int decodeProgressive(PNGDecoder*, PNG*, int, unsigned char**, PassCallback, void*);
+int decodePasses(RowDecoder*, PNG*, int, unsigned char*, unsigned char*, PassCallback, void*);
+void scatterPassRow(unsigned char*, unsigned char*, int, IHDR, int, int, int);
+int stopAfterPass(int, unsigned char*, IHDR, void*);
+int decodePixelsParallel(PNGDecoder*, PNG*, int, unsigned char**, int);
+void storeRow(unsigned char*, int, PNG*, int, unsigned char*, unsigned char*);
+int decodeRegion(PNGDecoder*, PNG*, PNGRegion*, int, unsigned char**, int*, int*);
+int decodeRegionRows(RegionDecode*, RowDecoder*);
+int decodeRegionPasses(RegionDecode*, RowDecoder*, unsigned char*);
+unsigned char* convertColumns(unsigned char*, unsigned char*, int, PNG*, int, int);
+void storeRegionRow(RegionDecode*, unsigned char*, int);
+void storeOutputRow(RegionDecode*, unsigned char*, int);
+int getRegionFromArg(char*, PNGRegion*);
+
+int hasValidCRC(Chunk*, int, int);
 int hasValidBitDepth(int, int);
 int hasValidSignature(unsigned char*);
 
 void freePNG(PNG);
-void makeCRCTable(void);
 void throwError(char*, int, int);
-void getBytesFromPath(char*, long int*, unsigned char**);
+int getBytesFromPath(char*, long int*, unsigned char**);
+int mapBytesFromPath(char*, long int*, unsigned char**);
+void unmapBytes(unsigned char*, long int);
+int readBytesIntoArena(char*, PNGArena*, long int*, unsigned char**);
+
+void initArena(PNGArena*);
+void freeArena(PNGArena*);
+int resetArena(PNGArena*);
+int reserveArena(PNGArena*, size_t);
+void* allocScratch(PNGArena*, size_t);
+void* growScratch(PNGArena*, void*, size_t, size_t);
+void freeScratch(PNGArena*, void*);
+ArenaMark markArena(PNGArena*);
+void releaseArena(PNGArena*, ArenaMark);
+PNGArena* getArena(PNGDecoder*);
+size_t decodeScratchSize(PNGDecoder*, PNG*);
+
+int startRowDecoder(RowDecoder*, PNGDecoder*, Chunk*, ChunkIndex, IHDR);
+void endRowDecoder(RowDecoder*);
+int startPass(RowDecoder*, int);
+int passSize(int, int, int);
+long int inflatedSize(IHDR);
+void unfilterRow(unsigned char*, unsigned char*, int, int, int);
+void selectUnfilterKernels(int, UnfilterKernel*);
+void unfilterNone(unsigned char*, unsigned char*, int, int);
+void unfilterSub(unsigned char*, unsigned char*, int, int);
+void unfilterUp(unsigned char*, unsigned char*, int, int);
+void unfilterAverage(unsigned char*, unsigned char*, int, int);
+void unfilterPaeth(unsigned char*, unsigned char*, int, int);
 
-unsigned char* getImgFromChunks(Chunk*, IHDR);
+unsigned char* decodeNextRow(RowDecoder*);
+int skipNextRow(RowDecoder*);
+int inflateBytes(RowDecoder*, unsigned char*, unsigned int);
+unsigned char* gatherIDAT(Chunk*, ChunkIndex, int*, PNGArena*);
+
+InflateBackend* getInflateBackend(char*);
+int benchInflateBackends(char*, int);
 unsigned long CRC32(unsigned long, unsigned char*, int);
-Pix* getPixelsFromImg(unsigned char*, IHDR, PLTE);
+unsigned int foldCRC32(unsigned int, unsigned char*, int);
+void expandRow(unsigned char*, Pix*, IHDR, PLTE);
+
+void convertRow(unsigned char*, unsigned char*, int, PNG*);
+void unpackRow(unsigned char*, unsigned char*, int, int, int);
+void expandPalette(unsigned char*, unsigned char*, int, int, PLTE*);
+#ifdef PNG_SIMD_X86_DISPATCH
+int expandPaletteRGBAAVX2(unsigned char*, unsigned char*, int, unsigned int*);
+int expandPaletteRGBAVX2(unsigned char*, unsigned char*, int, unsigned int*);
+#endif
+void scatterToPlanes(unsigned char*, unsigned char*, int, int, long int);
+
+int channelsInFormat(int);
+int bytesPerPixel(int);
+
+int openRowReader(PNGDecoder*, char*, PNGRowReader*);
+int openRowReaderAs(PNGDecoder*, char*, PNGRowReader*, int);
+void closeRowReader(PNGRowReader*);
+void* nextRow(PNGRowReader*);
+int decodeRowsFromPath(PNGDecoder*, char*, RowCallback, void*);
+int decodeRowsFromPathAs(PNGDecoder*, char*, int, RowCallback, void*);
 
+int decodeBatch(char**, int, int, int, PNGDecoder*, BatchCallback, void*);
 
-// An example of a program which takes a PNG, and writes its channels, width, height, and pixel information to two files
+void initEncoder(PNGEncoder*);
+int encodePixels(PNGEncoder*, char*, unsigned char*, int, int, int, PLTE*);
+int writePNG(PNGEncoder*, char*, PNG*);
+int filterBlock(void*, int);
+int deflateBlock(void*, int);
+unsigned char* getRawRow(PNGEncode*, int, unsigned char*);
+int chooseFilter(PNGEncode*, unsigned char*, unsigned char*, unsigned char*, unsigned char**, int, z_stream*);
+long int trialDeflate(z_stream*, unsigned char, unsigned char*, int);
+int feedDeflate(z_stream*, unsigned char*, long int, int);
+int writeEncodedPNG(PNGEncode*, char*, PLTE*);
+int writeChunk(FILE*, const unsigned char*, unsigned char*, long int);
+int encodeFromArgs(PNGDecoder*, int, char*[]);
+long int sumAbsolute(unsigned char*, int);
+void selectFilterKernels(int, FilterKernel*);
+void filterNone(unsigned char*, unsigned char*, unsigned char*, int, int);
+void filterSub(unsigned char*, unsigned char*, unsigned char*, int, int);
+void filterUp(unsigned char*, unsigned char*, unsigned char*, int, int);
+void filterAverage(unsigned char*, unsigned char*, unsigned char*, int, int);
+void filterPaeth(unsigned char*, unsigned char*, unsigned char*, int, int);
+void runBatchWorker(void*);
+int takeBatchPath(BatchWorker*);
+
+int initCache(PNGCache*, size_t, char*);
+void freeCache(PNGCache*);
+CacheKey getCacheKey(PNG*, int);
+unsigned long long mixCacheHash(unsigned long long, unsigned long);
+int decodeCached(PNGDecoder*, PNG*, int, CacheEntry**);
+void releaseCached(PNGCache*, CacheEntry*);
+CacheEntry* findCached(PNGCache*, CacheKey);
+CacheEntry* addCached(PNGCache*, CacheEntry*);
+void evictCached(PNGCache*);
+void unlinkCached(PNGCache*, CacheEntry*);
+void freeCacheEntry(CacheEntry*);
+char* getCachePath(PNGCache*, CacheKey);
+int mapCachedFile(PNGCache*, CacheEntry*);
+int writeCachedFile(PNGCache*, CacheEntry*);
+
+int decodeSegments(ParallelDecode*);
+int findBands(ParallelDecode*);
+int inflateSegmentJob(void*, int);
+int unfilterBandJob(void*, int);
+int inflateSegment(InflateBackend*, InflateSegment*, long int);
+int unfilterBand(ParallelDecode*, int, int);
+int decodePipelined(ParallelDecode*, PNGDecoder*);
+void runPipelineInflate(void*);
+int runPipelineInflateSlot(ParallelDecode*, int);
+
+int runJobs(int, int, int (*)(void*, int), void*);
+void runJobWorker(void*);
+int startThread(PNGThread*, void (*)(void*), void*);
+void joinThread(PNGThread);
+#ifdef _WIN32
+DWORD WINAPI threadEntry(LPVOID);
+#else
+void* threadEntry(void*);
+#endif
+int getCoreCount(void);
+double getWallSeconds(void);
+long long getNanoseconds(void);
+long long addStageStats(PNGStats*, int, long long, long long);
+void addStats(PNGStats*, PNGStats*);
+void writeStatsJSON(FILE*, PNGStats*);
+int writeStatsToPath(char*, PNGStats*);
+int addPathsFromPath(char*, char***, int*);
+int addPath(char*, char*, char***, int*);
+void freePaths(char**, int);
+int printBatchResult(int, char*, int, PNG*, unsigned char*, void*);
+int batchFromArgs(PNGDecoder*, int, char*[]);
+
+void* startZlibInflate(void);
+int runZlibInflate(void*, unsigned char**, unsigned int*, unsigned char**, unsigned int*);
+int resetZlibInflate(void*);
+void endZlibInflate(void*);
+void* startRawZlibInflate(void);
+int boundaryZlibInflate(void*);
+int wholeZlibInflate(void**, unsigned char*, long int, unsigned char*, long int);
+#ifdef HAVE_ZLIBNG
+void* startZlibNGInflate(void);
+int runZlibNGInflate(void*, unsigned char**, unsigned int*, unsigned char**, unsigned int*);
+int resetZlibNGInflate(void*);
+void endZlibNGInflate(void*);
+void* startRawZlibNGInflate(void);
+int boundaryZlibNGInflate(void*);
+int wholeZlibNGInflate(void**, unsigned char*, long int, unsigned char*, long int);
+#endif
+#ifdef HAVE_LIBDEFLATE
+int wholeLibdeflateInflate(void**, unsigned char*, long int, unsigned char*, long int);
+void endLibdeflateInflate(void*);
+#endif
+
+// Inflate Backends Built Into This Program
+InflateBackend INFLATE_BACKENDS[] = {
+    {"zlib", startZlibInflate, runZlibInflate, resetZlibInflate, endZlibInflate, wholeZlibInflate, NULL, startRawZlibInflate, boundaryZlibInflate},
+#ifdef HAVE_ZLIBNG
+    {"zlib-ng", startZlibNGInflate, runZlibNGInflate, resetZlibNGInflate, endZlibNGInflate, wholeZlibNGInflate, NULL, startRawZlibNGInflate, boundaryZlibNGInflate},
+#endif
+#ifdef HAVE_LIBDEFLATE
+    {"libdeflate", NULL, NULL, NULL, NULL, wholeLibdeflateInflate, endLibdeflateInflate, NULL, NULL},
+#endif
+};
+const int INFLATE_BACKEND_COUNT = sizeof(INFLATE_BACKENDS)/sizeof(INFLATE_BACKENDS[0]);
+
+
+// An example of a program which takes a PNG, and writes its width, height, channels and pixels to a file
+// that something else can load straight back in (a .npy file for ImageView.py, unless it's told otherwise)
 int main(int argc, char* argv[])
 {
     int output_text = 1; // Debugging variable
-    PNG fpng = getPNGFromPath(argv[1]);
+    int arg = 1;
+    int threads = 1;
+    int passes = 0;
+    int type = OUTPUT_NPY;
+    char* output = NULL;
+    char* stats = NULL;
+    PNGRegion region = {0, 0, 0, 0, 1};
+    int cropped = 0;
+    char* cache_directory = NULL;
+    PNGCache cache;
+    int status;
+    PNGDecoder decoder;
+    PNG fpng;
+
+    // ImageWrite --bench-inflate file.png [iterations] times every inflate backend on one file
+    if(argc > 2 && strcmp(argv[1], "--bench-inflate") == 0){
+        status = benchInflateBackends(argv[2], argc > 3 ? atoi(argv[3]) : 20);
+        if(status != PNG_OK) fprintf(stderr, "ERROR: %s\n\n", describeStatus(status));
+        return status == PNG_OK ? 0 : EXIT_FAILURE;
+    }
+
+    initDecoder(&decoder);
+
+    // options for decoding a single file, in any order before it:
+    // --inflate <backend> decodes with a backend other than the default,
+    // --threads n decodes one big image on n threads (0 for all of them),
+    // --preview n only decodes the first n passes of an interlaced image, for a blocky preview,
+    // --format and --output say what kind of file to write the pixels to, and where,
+    // --stats path writes where the decode spent its time as JSON ("-" for stdout), if it was built with PNG_STATS,
+    // --region x,y[,width,height] only decodes that rectangle, and --scale 2|4|8 shrinks it (or the whole image),
+    // --cache directory keeps decoded images there, and maps them back in instead of decoding the same image again
+    while(argc > arg+2){
+        if(strcmp(argv[arg], "--inflate") == 0){
+            throwError("ERROR: that inflate backend was not built in\n\n", setDecoderBackend(&decoder, argv[arg+1]) != PNG_OK, EXIT_FAILURE);
+        }
+        else if(strcmp(argv[arg], "--threads") == 0) threads = atoi(argv[arg+1]);
+        else if(strcmp(argv[arg], "--preview") == 0) passes = atoi(argv[arg+1]);
+        else if(strcmp(argv[arg], "--output") == 0) output = argv[arg+1];
+        else if(strcmp(argv[arg], "--stats") == 0) stats = argv[arg+1];
+        else if(strcmp(argv[arg], "--cache") == 0) cache_directory = argv[arg+1];
+        else if(strcmp(argv[arg], "--region") == 0){
+            throwError("ERROR: the region has to be x,y or x,y,width,height\n\n", !getRegionFromArg(argv[arg+1], &region), EXIT_FAILURE);
+            cropped = 1;
+        }
+        else if(strcmp(argv[arg], "--scale") == 0){
+            region.scale = atoi(argv[arg+1]);
+            cropped = 1;
+        }
+        else if(strcmp(argv[arg], "--format") == 0){
+            type = getOutputType(argv[arg+1]);
+            throwError("ERROR: the output format has to be npy, raw, ppm, pam or text\n\n", type < 0, EXIT_FAILURE);
+        }
+        else break;
+        arg += 2;
+    }
+    throwError("usage: ImageWrite [--inflate zlib|zlib-ng|libdeflate] [--threads n] [--preview passes]\n"
+               "                  [--region x,y[,width,height]] [--scale 2|4|8]\n"
+               "                  [--format npy|raw|ppm|pam|text] [--output path] [--stats path] [--cache directory] file.png\n"
+               "       ImageWrite --probe file.png...\n"
+               "       ImageWrite --make-corpus directory [--seed n]\n"
+               "       ImageWrite [--inflate zlib|zlib-ng|libdeflate] --bench file.png|directory... [--iterations n] [--compare]\n"
+               "       ImageWrite --encode in.png out.png [--level n] [--filter f] [--threads n] [--restartable]\n"
+               "       ImageWrite [--inflate zlib|zlib-ng|libdeflate] [--cache directory] --batch [--threads n] [--stats path] file.png|directory...\n"
+               "       ImageWrite --bench-inflate file.png [iterations]\n\n", argc <= arg, EXIT_FAILURE);
+#ifndef PNG_STATS
+    throwError("ERROR: --stats needs ImageWrite built with -DPNG_STATS\n\n", stats != NULL, EXIT_FAILURE);
+#endif
+
+    // ImageWrite --probe path... prints each file's header and metadata without decoding it
+    if(strcmp(argv[arg], "--probe") == 0){
+        status = probeFromArgs(&decoder, argc-arg-1, argv+arg+1);
+        freeDecoder(&decoder);
+        return status;
+    }
+
+    // ImageWrite --make-corpus directory fills it with synthetic PNGs of every kind, for --bench
+    if(strcmp(argv[arg], "--make-corpus") == 0){
+        freeDecoder(&decoder);
+        return corpusFromArgs(argc-arg-1, argv+arg+1);
+    }
+
+    // ImageWrite --bench path... times each stage of decoding every file
+    if(strcmp(argv[arg], "--bench") == 0){
+        status = benchFromArgs(&decoder, argc-arg-1, argv+arg+1);
+        freeDecoder(&decoder);
+        return status;
+    }
+
+    // ImageWrite --encode in.png out.png re-encodes a PNG
+    if(strcmp(argv[arg], "--encode") == 0){
+        status = encodeFromArgs(&decoder, argc-arg-1, argv+arg+1);
+        freeDecoder(&decoder);
+        return status;
+    }
+
+    // the cache is only for whole images, from --batch or a plain decode
+    if(cache_directory != NULL){
+        throwError("ERROR: ran out of memory\n\n", initCache(&cache, 0, cache_directory) != PNG_OK, EXIT_FAILURE);
+        decoder.cache = &cache;
+    }
+
+    // ImageWrite --batch path... decodes all of them across every core and reports on each one
+    if(strcmp(argv[arg], "--batch") == 0){
+        status = batchFromArgs(&decoder, argc-arg-1, argv+arg+1);
+        freeDecoder(&decoder);
+        if(cache_directory != NULL) freeCache(&cache);
+        return status;
+    }
+
+    unsigned char* pixels = NULL;
+    CacheEntry* cached = NULL;
+    int format = PIX_FORMAT_RGBA8;
+    int width = 0, height = 0;
+
+    status = readPNG(&decoder, argv[arg], &fpng);
+    if(status == PNG_OK){
+        format = getOutputFormat(&fpng, type);
+        width = fpng.iheader.width;
+        height = fpng.iheader.height;
+        if(cropped) status = decodeRegion(&decoder, &fpng, &region, format, &pixels, &width, &height);
+        else if(passes > 0) status = decodeProgressive(&decoder, &fpng, format, &pixels, stopAfterPass, &passes);
+        else if(decoder.cache != NULL){
+            status = decodeCached(&decoder, &fpng, format, &cached);
+            if(status == PNG_OK) pixels = cached->pixels;
+        }
+        else status = decodePixelsParallel(&decoder, &fpng, format, &pixels, threads);
+        if(status != PNG_OK) freePNG(fpng);
+    }
+    if(status == PNG_OK && stats != NULL && writeStatsToPath(stats, &decoder.stats) != PNG_OK){
+        fprintf(stderr, "ERROR: couldn't write the stats to %s\n\n", stats);
+    }
+    freeDecoder(&decoder);
+    if(status != PNG_OK){
+        if(cache_directory != NULL) freeCache(&cache);
+        fprintf(stderr, "ERROR: %s\n\n", describeStatus(status));
+        return EXIT_FAILURE;
+    }
 
     if(output_text){
         printf("\n\nthere are %d chunks\n", fpng.chunkCount);
@@ -194,61 +1350,18 @@ int main(int argc, char* argv[])
         }
     }
 
-    FILE *fp = fopen("C:\\Users\\mlfre\\OneDrive\\Desktop\\img_temp\\pixels.txt", "w");
-    throwError("ERROR: could not open pixels.txt\n\n", fp == NULL, EXIT_FAILURE);
-
-    for(int i = 0; i < fpng.iheader.width*fpng.iheader.height; i++){
-
-        if(fpng.palette.indexCount == 0){
-            for(int k = 0; k < fpng.iheader.channels; k++){
-                fprintf(fp, "%d,", fpng.pixels[i].RGBA[k]);
-            }
-        }
-        else{
-            fprintf(fp, "%d,", fpng.pixels[i].RGBA[0]);
-            fprintf(fp, "%d,", fpng.pixels[i].RGBA[1]);
-            fprintf(fp, "%d,", fpng.pixels[i].RGBA[2]);
-        }
-    }
-    fprintf(fp, "\n");
-
-    FILE *fp2 = fopen("C:\\Users\\mlfre\\OneDrive\\Desktop\\img_temp\\info.txt", "w");
-    throwError("ERROR: could not open info.txt\n\n", fp2 == NULL, EXIT_FAILURE);
-
-    fprintf(fp2, "%d,", fpng.iheader.width);
-    fprintf(fp2, "%d,", fpng.iheader.height);
-    if(fpng.palette.indexCount == 0) fprintf(fp2, "%d\n", fpng.iheader.channels);
-    else fprintf(fp2, "3");
-
-    fclose(fp);
-    fclose(fp2);
+    // without --output the file goes next to the PNG, with the format's extension instead of .png
+    char* path = output != NULL ? output : getOutputPath(argv[arg], type);
+    status = path == NULL ? PNG_ERROR_MEMORY : writePixels(path, type, pixels, width, height, format);
+    if(status != PNG_OK) fprintf(stderr, "ERROR: could not write %s: %s\n\n", path != NULL ? path : "the output", describeStatus(status));
+    else if(output_text) printf("wrote %s\n", path);
 
+    if(path != output) free(path);
+    if(cached != NULL) releaseCached(&cache, cached);
+    else free(pixels);
+    if(cache_directory != NULL) freeCache(&cache);
     freePNG(fpng);
-    return 0;
-}
-
-int getChunkCount(unsigned char* bytes)
-{
-    int count = 0;
-    int length = 0;
-    int next_seg = 7;
-    unsigned char type[4] = {0, 0, 0, 0};
-
-    while(!compType(type, IEND_CHUNK)){
-        length = bytesToInt(bytes[next_seg+1], bytes[next_seg+2],
-                            bytes[next_seg+3], bytes[next_seg+4]);
-
-        type[0] = bytes[next_seg+5];
-        type[1] = bytes[next_seg+6];
-        type[2] = bytes[next_seg+7];
-        type[3] = bytes[next_seg+8];
-
-        next_seg+=length+12;
-        count++;
-
-    }
-
-    return count;
+    return status == PNG_OK ? 0 : EXIT_FAILURE;
 }
 
 void throwError(char* message, int condition, int status)
@@ -259,315 +1372,5115 @@ void throwError(char* message, int condition, int status)
     }
 }
 
+// Only the pixels are freed from a PNG whose memory is in its decoder's arena; the rest goes with the next readPNG
 void freePNG(PNG fpng)
 {
-    free(fpng.bytes);
-    for(int i = 0; i < fpng.chunkCount; i++) free(fpng.chunks[i].data);
+    free(fpng.pixels);
+    if(fpng.arena != NULL) return;
+
+    if(fpng.mapped) unmapBytes(fpng.bytes, fpng.byteCount);
+    else free(fpng.bytes);
+
+    for(int i = 0; i < fpng.chunkCount; i++){
+        if(fpng.chunks[i].owned) free(fpng.chunks[i].data);
+    }
     free(fpng.chunks);
     free(fpng.palette.indexes);
-    free(fpng.pixels);
+    free(fpng.palette.packed);
 }
-
-void getBytesFromPath(char* path, long int* length, unsigned char** dest)
+int getBytesFromPath(char* path, long int* length, unsigned char** dest)
 {
     FILE *fp = fopen(path, "rb");
-    throwError("ERROR: could not open file\n\n", fp == NULL, EXIT_FAILURE);
+    if(fp == NULL) return PNG_ERROR_IO;
 
     fseek(fp, 0, SEEK_END);
     *length = ftell(fp);
-
     rewind(fp);
+
     *dest = (unsigned char *)malloc(*length+1);
-    fread(*dest, *length, 1, fp);
+    if(*dest == NULL){
+        fclose(fp);
+        return PNG_ERROR_MEMORY;
+    }
+
+    int complete = *length >= 0 && fread(*dest, 1, *length, fp) == (size_t) *length;
     fclose(fp);
 
+    if(!complete){
+        free(*dest);
+        *dest = NULL;
+        return PNG_ERROR_IO;
+    }
+    return PNG_OK;
 }
 
-PNG getPNGFromPath(char* path)
+// Maps the whole file into memory read-only, so chunks can point straight into it instead of holding copies.
+// Returns 0 if the file couldn't be mapped (e.g. it's empty), in which case the caller should read it normally
+int mapBytesFromPath(char* path, long int* length, unsigned char** dest)
 {
-    PNG new_png;
-    int channels[7] = {1, 0, 3, 1, 2, 0, 4};
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(file == INVALID_HANDLE_VALUE) return 0;
+
+    LARGE_INTEGER size;
+    if(!GetFileSizeEx(file, &size) || size.QuadPart == 0){
+        CloseHandle(file);
+        return 0;
+    }
 
-    getBytesFromPath(path, &new_png.byteCount, &new_png.bytes);
-    new_png.chunkCount = getChunkCount(new_png.bytes);
-    new_png.chunks = getChunksFromBytes(new_png.bytes);
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if(mapping == NULL) return 0;
 
-    new_png.iheader.width = bytesToInt(new_png.chunks[0].data[0], new_png.chunks[0].data[1],
-                               new_png.chunks[0].data[2], new_png.chunks[0].data[3]);
-    new_png.iheader.height = bytesToInt(new_png.chunks[0].data[4], new_png.chunks[0].data[5],
-                                new_png.chunks[0].data[6], new_png.chunks[0].data[7]);
+    *dest = (unsigned char*) MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if(*dest == NULL) return 0;
 
-    new_png.iheader.bitd = new_png.chunks[0].data[8];
-    new_png.iheader.colort = new_png.chunks[0].data[9];
-    new_png.iheader.compm = new_png.chunks[0].data[10];
+    *length = (long int) size.QuadPart;
+#else
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return 0;
 
-    new_png.iheader.filterm = new_png.chunks[0].data[11];
-    new_png.iheader.interlacem = new_png.chunks[0].data[12];
-    new_png.iheader.channels = channels[new_png.iheader.colort];
+    struct stat info;
+    if(fstat(fd, &info) != 0 || info.st_size == 0){
+        close(fd);
+        return 0;
+    }
 
-    throwError("ERROR: PNG has an invalid bit depth\n\n", !hasValidBitDepth(new_png.iheader.bitd, new_png.iheader.colort), EXIT_FAILURE);
-    throwError("ERROR: PNG has an invalid CRC\n\n", !hasValidCRC(new_png.chunks), EXIT_FAILURE);
-    throwError("ERROR: PNG has an invalid signature\n\n", !hasValidSignature(new_png.bytes), EXIT_FAILURE);
+    void* view = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(view == MAP_FAILED) return 0;
 
-    new_png.palette = getPaletteFromChunks(new_png.chunks, new_png.chunkCount);
-    unsigned char* temp = getImgFromChunks(new_png.chunks, new_png.iheader);
-    new_png.pixels = getPixelsFromImg(temp, new_png.iheader, new_png.palette);
+    // chunks are walked front to back, so let the kernel read ahead
+    madvise(view, info.st_size, MADV_SEQUENTIAL);
 
-    free(temp);
-    return new_png;
+    *dest = (unsigned char*) view;
+    *length = (long int) info.st_size;
+#endif
+    return 1;
 }
 
-Chunk* getChunksFromBytes(unsigned char* bytes)
+void unmapBytes(unsigned char* bytes, long int length)
 {
-    int next_seg = 7;
-    int chunks = 0;
-    Chunk* chunk_array = (Chunk*) malloc(sizeof(Chunk)*getChunkCount(bytes));
-
-    while(!compType(chunk_array[chunks-1].type, IEND_CHUNK)){
-        chunk_array[chunks].length = bytesToInt(bytes[next_seg+1], bytes[next_seg+2],
-                                                bytes[next_seg+3], bytes[next_seg+4]);
-
-        chunk_array[chunks].type[0] = bytes[next_seg+5];
-        chunk_array[chunks].type[1] = bytes[next_seg+6];
-        chunk_array[chunks].type[2] = bytes[next_seg+7];
-        chunk_array[chunks].type[3] = bytes[next_seg+8];
-
-        chunk_array[chunks].data = calloc(chunk_array[chunks].length, 1);
-
-        if(chunk_array[chunks].length > 0){
-            for(int cnt = 0; cnt < chunk_array[chunks].length; cnt++){
-                chunk_array[chunks].data[cnt] = bytes[next_seg+9+cnt];
-            }
-        }
-
-        chunk_array[chunks].crc[0] = bytes[next_seg+chunk_array[chunks].length+9];
-        chunk_array[chunks].crc[1] = bytes[next_seg+chunk_array[chunks].length+10];
-        chunk_array[chunks].crc[2] = bytes[next_seg+chunk_array[chunks].length+11];
-        chunk_array[chunks].crc[3] = bytes[next_seg+chunk_array[chunks].length+12];
-
-        next_seg+=chunk_array[chunks].length+12;
-        chunks++;
-
-    }
-
-    return chunk_array;
+#ifdef _WIN32
+    (void) length;
+    UnmapViewOfFile(bytes);
+#else
+    munmap(bytes, length);
+#endif
 }
 
-void makeCRCTable(void){
-    unsigned long c;
-
-    for (int n = 0; n < 256; n++) {
-        c = (unsigned long) n;
+// Reads the whole file into the arena, without the FILE (and its buffer) that fopen would allocate and free again
+int readBytesIntoArena(char* path, PNGArena* arena, long int* length, unsigned char** dest)
+{
+    long int done = 0;
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if(file == INVALID_HANDLE_VALUE) return PNG_ERROR_IO;
 
-        for (int k = 0; k < 8; k++) {
-            c = c & 1 ? 0xedb88320L ^ (c >> 1) : c >> 1;
-        }
-        CRC_TABLE[n] = c;
+    LARGE_INTEGER size;
+    if(!GetFileSizeEx(file, &size) || size.QuadPart > 0x7fffffffL){
+        CloseHandle(file);
+        return PNG_ERROR_IO;
     }
-}
-
-unsigned long CRC32(unsigned long crc, unsigned char *buf, int len){
-    unsigned long c = crc ^ 0xffffffffL;
+    *length = (long int) size.QuadPart;
 
-    if(!CRC_TABLE_COMPUTED){
-        makeCRCTable();
-        CRC_TABLE_COMPUTED = 1;
+    *dest = (unsigned char*) allocScratch(arena, *length+1);
+    while(*dest != NULL && done < *length){
+        DWORD got = 0;
+        if(!ReadFile(file, *dest + done, (DWORD) (*length - done), &got, NULL) || got == 0) break;
+        done += got;
     }
+    CloseHandle(file);
+#else
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return PNG_ERROR_IO;
 
-    for (int n = 0; n < len; n++) {
-        c = CRC_TABLE[(c ^ buf[n]) & 0xff] ^ (c >> 8);
+    struct stat info;
+    if(fstat(fd, &info) != 0 || info.st_size > 0x7fffffffL){
+        close(fd);
+        return PNG_ERROR_IO;
     }
+    *length = (long int) info.st_size;
 
-    return c ^ 0xffffffffL;
+    *dest = (unsigned char*) allocScratch(arena, *length+1);
+    while(*dest != NULL && done < *length){
+        ssize_t got = read(fd, *dest + done, *length - done);
+        if(got <= 0) break;
+        done += got;
+    }
+    close(fd);
+#endif
+    if(*dest == NULL) return PNG_ERROR_MEMORY;
+    return done == *length ? PNG_OK : PNG_ERROR_IO;
 }
 
-
-int hasValidSignature(unsigned char* bytes)
+/*
+Arenas:
+A decoder with PNG_USE_ARENA takes all of a PNG's memory (besides its pixels) from one big block that lasts as
+long as the decoder does. Allocating is just moving an offset along, nothing is freed one piece at a time, and
+the next readPNG starts again from the beginning of the block. If an image doesn't fit, more blocks are chained
+on, and the next reset swaps them all for one block that fits the lot, so once a decoder has seen its biggest
+image it never calls malloc again. That's what makes batches of small images cheap: no trips to malloc to
+contend over, and the same pages used again and again instead of freshly faulted in.
+*/
+void initArena(PNGArena* arena)
 {
-    int equal = 1;
-    for(int i = 0; i < 8; i++) equal = bytes[i] == SIGNATURE[i] ? equal : 0;
-    return equal;
+    arena->blocks = NULL;
+    arena->used = 0;
+    arena->peak = 0;
 }
 
-int hasValidBitDepth(int bitd, int colort)
+void freeArena(PNGArena* arena)
 {
-    if (bitd == 8) return 1;
-    switch(colort){
-        case 0:
-            return bitd == 1 || bitd == 2 || bitd == 4 || bitd == 16;
-        case 3:
-            return bitd == 1 || bitd == 2 || bitd == 4;
-        case 2:
-        case 4:
-        case 6:
-            return bitd == 16;
-        default:
-            return 0;
+    while(arena->blocks != NULL){
+        ArenaBlock* next = arena->blocks->next;
+        free(arena->blocks);
+        arena->blocks = next;
     }
+    arena->used = 0;
 }
 
-int hasValidCRC(Chunk* chunks)
+// Forgets everything handed out since the last reset, leaving a single block with room for at least as much again
+int resetArena(PNGArena* arena)
 {
-    int count = 0;
+    if(arena->blocks != NULL && arena->blocks->next != NULL) freeArena(arena);
 
-    unsigned long type_crc;
-    unsigned long chunk_crc;
-    unsigned long actual_crc;
+    arena->used = 0;
+    if(arena->blocks != NULL){
+        arena->blocks->used = 0;
+        return 1;
+    }
+    return arena->peak == 0 || reserveArena(arena, arena->peak);
+}
 
-    while(!compType(chunks[count].type, IEND_CHUNK))
-    {
-        type_crc = CRC32(0L, chunks[count].type, 4);
-        chunk_crc = CRC32(type_crc, chunks[count].data, chunks[count].length);
-        actual_crc = bytesToInt(chunks[count].crc[0], chunks[count].crc[1],
-                                chunks[count].crc[2], chunks[count].crc[3]);
+// Makes sure the newest block has room for size more bytes, chaining on a new block if it hasn't. Returns 0 if malloc fails
+int reserveArena(PNGArena* arena, size_t size)
+{
+    ArenaBlock* block = arena->blocks;
+    size += ARENA_ALIGN; // room to line the next allocation up
 
-        if(actual_crc != chunk_crc) return 0;
+    // counted as if it were all used, so the block a reset leaves has room for whatever was reserved as well
+    if(arena->used + size > arena->peak) arena->peak = arena->used + size;
+    if(block != NULL && block->size - block->used >= size) return 1;
 
-        count++;
-    }
+    size_t block_size = block != NULL ? block->size*2 : ARENA_MIN_BLOCK;
+    if(block_size < size) block_size = size;
+
+    ArenaBlock* grown = (ArenaBlock*) malloc(sizeof(ArenaBlock) + block_size);
+    if(grown == NULL) return 0;
 
+    grown->next = block;
+    grown->size = block_size;
+    grown->used = 0;
+    arena->blocks = grown;
     return 1;
 }
 
-PLTE getPaletteFromChunks(Chunk* chunks, int chunkCount)
+// size bytes from the arena, or from malloc if arena is NULL, so the same code can use either
+void* allocScratch(PNGArena* arena, size_t size)
 {
-    PLTE img_palette;
-
-    for(int chk = 0; chk < chunkCount; chk++){
-        if(compType(chunks[chk].type, PLTE_CHUNK)){
+    if(arena == NULL) return malloc(size);
 
-            img_palette.indexCount = chunks[chk].length/3;
-            img_palette.indexes = (Pix*) malloc(sizeof(Pix)*img_palette.indexCount);
-
-            for(int i = 0; i < img_palette.indexCount; i++){
-                img_palette.indexes[i].RGBA[0] = chunks[chk].data[(i*3)];
-                img_palette.indexes[i].RGBA[1] = chunks[chk].data[(i*3)+1];
-                img_palette.indexes[i].RGBA[2] = chunks[chk].data[(i*3)+2];
-                img_palette.indexes[i].RGBA[3] = 0;
-            }
-            break;
-        }
+    size = size == 0 ? ARENA_ALIGN : (size + ARENA_ALIGN-1) & ~(size_t) (ARENA_ALIGN-1);
+    if(!reserveArena(arena, size)) return NULL;
 
-        else if(compType(chunks[chk].type, IEND_CHUNK)){
-            img_palette.indexes = NULL;
-            img_palette.indexCount = 0;
-        }
-    }
+    ArenaBlock* block = arena->blocks;
+    unsigned char* data = (unsigned char*) (block+1);
+    size_t start = (((size_t) (data + block->used) + ARENA_ALIGN-1) & ~(size_t) (ARENA_ALIGN-1)) - (size_t) data;
 
-    return img_palette;
+    block->used = start + size;
+    arena->used += size;
+    if(arena->used > arena->peak) arena->peak = arena->used;
+    return data + start;
 }
 
-unsigned char* getImgFromChunks(Chunk* chunks, IHDR img_info)
+// realloc for scratch memory. The arena can't grow anything in place, so there it's a fresh copy
+void* growScratch(PNGArena* arena, void* old, size_t old_size, size_t size)
 {
-    int count = 0;
-    int type_count = 0;
-    int idat_count = 0;
-    uLongf compressed_size = 0;
-    uLongf uncompressed_size = img_info.height*(1+((img_info.bitd*img_info.channels*img_info.width+7)>>3));
-    unsigned char* compressed_idat;
-    unsigned char* uncompressed_idat = (unsigned char*) malloc(uncompressed_size);
+    if(arena == NULL) return realloc(old, size);
 
+    void* grown = allocScratch(arena, size);
+    if(grown != NULL && old != NULL) memcpy(grown, old, old_size);
+    return grown;
+}
 
-    while(1){
-        if (compType(chunks[count].type, IDAT_CHUNK)){
-            for(; compType(chunks[count+idat_count].type, IDAT_CHUNK); idat_count++){
-                compressed_size += chunks[count+idat_count].length;
-            }
+// free for scratch memory. Memory from the arena is only taken back by resetArena or releaseArena
+void freeScratch(PNGArena* arena, void* scratch)
+{
+    if(arena == NULL) free(scratch);
+}
 
-            compressed_idat = (unsigned char*) malloc(compressed_size);
-            for(int j = 0; j < idat_count; j++){
-                for(int i = 0; i < chunks[count+j].length; i++){
-                    compressed_idat[type_count] = chunks[count+j].data[i];
-                    type_count++;
-                }
-            }
-            break;
-        }
-        count++;
+// Remembers how much of the arena is in use, so releaseArena can hand back everything allocated after this
+ArenaMark markArena(PNGArena* arena)
+{
+    ArenaMark mark = {NULL, 0, 0};
+    if(arena != NULL && arena->blocks != NULL){
+        mark.block = arena->blocks;
+        mark.blockUsed = arena->blocks->used;
+        mark.used = arena->used;
     }
+    return mark;
+}
 
-    int ret = uncompress(uncompressed_idat, &uncompressed_size, compressed_idat, compressed_size);
-    free(compressed_idat);
+// If everything since the mark came out of the same block, it's free to use again straight away.
+// Otherwise it just waits for the next reset
+void releaseArena(PNGArena* arena, ArenaMark mark)
+{
+    if(arena == NULL || mark.block == NULL || arena->blocks != mark.block) return;
+    mark.block->used = mark.blockUsed;
+    arena->used = mark.used;
+}
 
-    return ret == 0 ? uncompressed_idat : '\0';
+// The decoder's arena if it was asked to use one, otherwise NULL (for malloc)
+PNGArena* getArena(PNGDecoder* decoder)
+{
+    return (decoder->flags & PNG_USE_ARENA) ? &decoder->arena : NULL;
 }
 
-int PaethPredictor(int a, int b, int c)
+// About how much decoding a PNG takes from the arena once its chunks are in: the palette, two rows of the widest
+// pixel format (for planar or interlaced output, or a row reader) and, for backends that can't stream, the whole
+// inflated image plus a copy of the IDAT run if it's in more than one chunk
+size_t decodeScratchSize(PNGDecoder* decoder, PNG* fpng)
 {
-    int pa = abs(b - c);
-    int pb = abs(a - c);
-    int pc = abs(a + b - (2*c));
+    IHDR img_info = fpng->iheader;
+    size_t row = (size_t) img_info.width*8 + ARENA_ALIGN;
+    size_t size = sizeof(Pix)*256 + 256*sizeof(unsigned int) + 256*2 + 2*ARENA_ALIGN + 2*row;
 
-    if(pa <= pb && pa <= pc) return a;
-    else if(pb <= pc) return b;
-    return c;
+    if(decoder->backend->start == NULL){
+        size += inflatedSize(img_info) + row + 16;
+        if(fpng->index.idatCount > 1) size += fpng->index.idatLength + ARENA_ALIGN;
+    }
+    return size;
+}
+// The simple way to read a PNG, for small programs: exits with a message if anything is wrong with it.
+// Use a PNGDecoder and decodePNG to get an error code back instead
+PNG getPNGFromPath(char* path)
+{
+    return getPNGFromPathWithFlags(path, 0);
 }
 
-Pix* getPixelsFromImg(unsigned char* img, IHDR img_info, PLTE color_indexes)
+PNG getPNGFromPathWithFlags(char* path, int flags)
 {
-    int stride = ((img_info.bitd * img_info.channels * img_info.width + 7) >> 3);
-    int* pixels = (int*) malloc(sizeof(int)*img_info.height*stride);
-    Pix* rgba_pixels = (Pix*) malloc(sizeof(Pix)*img_info.width*img_info.height);
+    PNGDecoder decoder;
+    PNG new_png;
 
-    int i = 0;
-    int current_pixel = 0;
-    int filter_type;
+    // the decoder doesn't outlive this call, so the PNG can't live in its arena
+    initDecoder(&decoder);
+    decoder.flags = flags & ~PNG_USE_ARENA;
 
-    int filt_a;
-    int filt_b;
-    int filt_c;
+    int status = decodePNG(&decoder, path, &new_png);
+    freeDecoder(&decoder);
 
-    int bpp = stride/img_info.width;
+    if(status != PNG_OK){
+        fprintf(stderr, "ERROR: %s\n\n", describeStatus(status));
+        exit(EXIT_FAILURE);
+    }
+    return new_png;
+}
 
-    for(int r = 0; r < img_info.height; r++){
-        filter_type = img[i];
-        i++;
-        for(int c = 0; c < stride; c++){
+/*
+A PNGDecoder holds everything a decode needs besides the PNG itself, so separate decoders never share
+anything and can run on separate threads at the same time. A single decoder does one decode at a time
+(a row reader borrows it until it's closed), and keeps its scratch memory between decodes.
+*/
+void initDecoder(PNGDecoder* decoder)
+{
+    decoder->flags = 0;
+    decoder->backend = getInflateBackend(PNG_INFLATE_BACKEND);
+    if(decoder->backend == NULL) decoder->backend = &INFLATE_BACKENDS[0];
+
+    decoder->rows = NULL;
+    decoder->rowsSize = 0;
+    decoder->inflateState = NULL;
+    decoder->wholeState = NULL;
+    initArena(&decoder->arena);
+    memset(&decoder->stats, 0, sizeof(PNGStats));
+    decoder->cache = NULL;
+}
+
+void freeDecoder(PNGDecoder* decoder)
+{
+    if(decoder->inflateState != NULL) decoder->backend->end(decoder->inflateState);
+    if(decoder->wholeState != NULL) decoder->backend->endWhole(decoder->wholeState);
+    free(decoder->rows);
+
+    decoder->inflateState = NULL;
+    decoder->wholeState = NULL;
+    decoder->rows = NULL;
+    decoder->rowsSize = 0;
+    freeArena(&decoder->arena);
+}
+
+// Switches the decoder to another inflate backend. Fails with PNG_ERROR_ARGUMENT if it wasn't built in
+int setDecoderBackend(PNGDecoder* decoder, char* name)
+{
+    InflateBackend* backend = getInflateBackend(name);
+    if(backend == NULL) return PNG_ERROR_ARGUMENT;
+
+    if(decoder->inflateState != NULL) decoder->backend->end(decoder->inflateState);
+    if(decoder->wholeState != NULL) decoder->backend->endWhole(decoder->wholeState);
+    decoder->inflateState = NULL;
+    decoder->wholeState = NULL;
+    decoder->backend = backend;
+
+    return PNG_OK;
+}
+
+char* describeStatus(int status)
+{
+    char* messages[] = {
+        "no error",
+        "could not open or read the file",
+        "PNG has an invalid signature",
+        "PNG is truncated, it ends before its IEND chunk",
+        "PNG is missing chunks or has them out of order",
+        "PNG has an invalid or unsupported IHDR",
+        "PNG has an invalid CRC",
+        "PNG has corrupt or missing IDAT data",
+        "ran out of memory",
+        "invalid argument",
+    };
+
+    if(status < 0 || status >= (int) (sizeof(messages)/sizeof(messages[0]))) return "unknown error";
+    return messages[status];
+}
+
+// Reads the file, its chunk list, header and palette, but doesn't decode the pixels (new_png->pixels is NULL).
+// On failure new_png is left empty and doesn't need to be freed. With PNG_USE_ARENA the PNG this decoder read
+// last is gone once this is called, though its pixels are still the caller's
+int readPNG(PNGDecoder* decoder, char* path, PNG* new_png)
+{
+    int status;
+    PNGArena* arena = getArena(decoder);
+    memset(new_png, 0, sizeof(PNG));
+    statsClock(since);
+
+    // with an arena the file is read into it rather than mapped, since mapping and unmapping a small file costs more than reading it
+    if(arena != NULL){
+        if(!resetArena(arena)) return PNG_ERROR_MEMORY;
+        new_png->arena = arena;
+        status = readBytesIntoArena(path, arena, &new_png->byteCount, &new_png->bytes);
+        if(status != PNG_OK) return status;
+    }
+    else{
+        new_png->mapped = mapBytesFromPath(path, &new_png->byteCount, &new_png->bytes);
+        if(!new_png->mapped){
+            status = getBytesFromPath(path, &new_png->byteCount, &new_png->bytes);
+            if(status != PNG_OK) return status;
+        }
+    }
+
+    statsStage(&decoder->stats, STAGE_READ, since, new_png->byteCount);
+
+    if(new_png->byteCount < 8 || !hasValidSignature(new_png->bytes)) status = PNG_ERROR_SIGNATURE;
+    else status = getChunksFromBytes(new_png->bytes, new_png->byteCount, decoder->flags, arena, &new_png->chunks, &new_png->chunkCount, &new_png->index);
+
+    if(status == PNG_OK) status = getHeaderFromChunks(new_png);
+    statsStage(&decoder->stats, STAGE_PARSE, since, new_png->byteCount);
+
+    if(status == PNG_OK && !hasValidCRC(new_png->chunks, new_png->chunkCount, decoder->flags)) status = PNG_ERROR_CRC;
+    statsStage(&decoder->stats, STAGE_CRC, since, new_png->byteCount);
+
+    // now the header's in, the rest of the decode's scratch can be set aside in one go
+    if(status == PNG_OK && arena != NULL && !reserveArena(arena, decodeScratchSize(decoder, new_png))) status = PNG_ERROR_MEMORY;
+
+    // truecolor images can carry a PLTE too, but it's only a suggestion for displays that can't show them
+    if(status == PNG_OK && new_png->iheader.colort == 3){
+        new_png->palette = getPaletteFromChunks(new_png->chunks, new_png->index, arena);
+        if(new_png->palette.indexCount == 0) status = PNG_ERROR_LAYOUT;
+    }
+    if(status == PNG_OK){
+        new_png->transparency = getTransparencyFromChunks(new_png->chunks, new_png->index, new_png->iheader, &new_png->palette);
+        if(new_png->palette.indexCount != 0) status = packPalette(&new_png->palette, arena);
+    }
+
+    if(status != PNG_OK){
+        freePNG(*new_png);
+        memset(new_png, 0, sizeof(PNG));
+    }
+    return status;
+}
+
+// readPNG, and then decodes the pixels into new_png->pixels
+int decodePNG(PNGDecoder* decoder, char* path, PNG* new_png)
+{
+    int status = readPNG(decoder, path, new_png);
+    if(status != PNG_OK) return status;
+
+    status = decodePixelsAs(decoder, new_png, PIX_FORMAT_PIX, (unsigned char**) &new_png->pixels);
+    if(status != PNG_OK){
+        freePNG(*new_png);
+        memset(new_png, 0, sizeof(PNG));
+    }
+    return status;
+}
+
+// Fills in PNG.iheader from the IHDR chunk and makes sure it describes an image we can decode
+int getHeaderFromChunks(PNG* new_png)
+{
+    if(new_png->index.ihdr != 0 || new_png->chunks[0].length < 13 || new_png->index.idatFirst < 0) return PNG_ERROR_LAYOUT;
+    return getHeaderFromBytes(new_png->chunks[new_png->index.ihdr].data, &new_png->iheader);
+}
+
+// Parses the 13 bytes of an IHDR chunk
+int getHeaderFromBytes(unsigned char* ihdr, IHDR* img_info)
+{
+    int channels[7] = {1, 0, 3, 1, 2, 0, 4};
+
+    unsigned long width = bytesToInt(ihdr[0], ihdr[1], ihdr[2], ihdr[3]);
+    unsigned long height = bytesToInt(ihdr[4], ihdr[5], ihdr[6], ihdr[7]);
+    if(width == 0 || height == 0 || width > 0x7fffffffUL || height > 0x7fffffffUL) return PNG_ERROR_HEADER;
+
+    img_info->width = (int) width;
+    img_info->height = (int) height;
+
+    img_info->bitd = ihdr[8];
+    img_info->colort = ihdr[9];
+    img_info->compm = ihdr[10];
+
+    img_info->filterm = ihdr[11];
+    img_info->interlacem = ihdr[12];
+    img_info->channels = img_info->colort < 7 ? channels[img_info->colort] : 0;
+
+    if(!hasValidBitDepth(img_info->bitd, img_info->colort)) return PNG_ERROR_HEADER;
+    if(img_info->compm != 0 || img_info->filterm != 0 || img_info->interlacem > 1) return PNG_ERROR_HEADER;
+
+    return PNG_OK;
+}
+
+/*
+Probing:
+Everything that describes a PNG (its header, palette, resolution, color profile, text...) has to come before
+the first IDAT, so probePNG reads the file a chunk at a time and stops as soon as it gets there, seeking
+straight past any chunk it has no use for. It never looks at the image data, or reads past the start of it.
+*/
+// Fills in info from the chunks in front of the first IDAT. On failure info is left empty and doesn't need to be freed
+int probePNG(PNGDecoder* decoder, char* path, PNGInfo* info)
+{
+    unsigned char head[8];
+    unsigned char* data = NULL;
+    long int capacity = 0;
+    int chunks = 0;
+    int status = PNG_OK;
+
+    memset(info, 0, sizeof(PNGInfo));
+    FILE* fp = fopen(path, "rb");
+    if(fp == NULL) return PNG_ERROR_IO;
+
+    if(fread(head, 1, 8, fp) != 8 || !hasValidSignature(head)) status = PNG_ERROR_SIGNATURE;
+    info->bytesRead = 8;
+
+    while(status == PNG_OK){
+        Chunk chunk;
+
+        if(fread(head, 1, 8, fp) != 8){
+            status = PNG_ERROR_TRUNCATED;
+            break;
+        }
+        info->bytesRead += 8;
+
+        unsigned long length = bytesToInt(head[0], head[1], head[2], head[3]);
+        memcpy(chunk.type, head+4, 4);
+        if(length > 0x7fffffffUL - 4) status = PNG_ERROR_TRUNCATED;
+        else if(chunks++ == 0 && !compType(chunk.type, IHDR_CHUNK)) status = PNG_ERROR_LAYOUT;
+        else if(compType(chunk.type, IEND_CHUNK)) status = PNG_ERROR_LAYOUT;
+        if(status != PNG_OK || compType(chunk.type, IDAT_CHUNK)) break;
+
+        int wanted = compType(chunk.type, IHDR_CHUNK) || compType(chunk.type, PLTE_CHUNK) || compType(chunk.type, TRNS_CHUNK) ||
+                     compType(chunk.type, PHYS_CHUNK) || compType(chunk.type, TIME_CHUNK) || compType(chunk.type, ICCP_CHUNK) ||
+                     compType(chunk.type, TEXT_CHUNK) || compType(chunk.type, ZTXT_CHUNK);
+        if(!wanted){
+            if(fseek(fp, (long) length + 4, SEEK_CUR) != 0) status = PNG_ERROR_IO;
+            info->bytesRead += (long int) length + 4;
+            continue;
+        }
+
+        // the chunk's data and its CRC right behind it
+        if((long int) length + 4 > capacity){
+            free(data);
+            capacity = (long int) length + 4;
+            data = (unsigned char*) malloc(capacity);
+            if(data == NULL){
+                status = PNG_ERROR_MEMORY;
+                break;
+            }
+        }
+        if(fread(data, 1, length + 4, fp) != length + 4){
+            status = PNG_ERROR_TRUNCATED;
+            break;
+        }
+        info->bytesRead += (long int) length + 4;
+
+        chunk.length = (int) length;
+        chunk.data = data;
+        memcpy(chunk.crc, data + length, 4);
+
+        if(!hasValidCRC(&chunk, 1, decoder->flags)) status = PNG_ERROR_CRC;
+        else status = getInfoFromChunk(&chunk, info);
+    }
+
+    fclose(fp);
+    free(data);
+    if(status != PNG_OK){
+        freePNGInfo(info);
+        memset(info, 0, sizeof(PNGInfo));
+    }
+    return status;
+}
+
+void freePNGInfo(PNGInfo* info)
+{
+    free(info->iccProfile);
+    for(int i = 0; i < info->textCount; i++) free(info->texts[i].text);
+    free(info->texts);
+}
+
+// Adds what one chunk says to info. Ancillary chunks that are broken are left out rather than failing the probe
+int getInfoFromChunk(Chunk* chunk, PNGInfo* info)
+{
+    unsigned char* data = chunk->data;
+
+    if(compType(chunk->type, IHDR_CHUNK)){
+        if(chunk->length < 13) return PNG_ERROR_LAYOUT;
+        return getHeaderFromBytes(data, &info->iheader);
+    }
+    if(compType(chunk->type, PLTE_CHUNK)) info->paletteCount = chunk->length/3;
+    else if(compType(chunk->type, TRNS_CHUNK)) info->transparent = 1;
+
+    else if(compType(chunk->type, PHYS_CHUNK) && chunk->length >= 9){
+        info->hasPhys = 1;
+        info->pixelsPerUnitX = bytesToInt(data[0], data[1], data[2], data[3]);
+        info->pixelsPerUnitY = bytesToInt(data[4], data[5], data[6], data[7]);
+        info->unit = data[8];
+    }
+    else if(compType(chunk->type, TIME_CHUNK) && chunk->length >= 7){
+        info->hasTime = 1;
+        info->year = data[0] << 8 | data[1];
+        info->month = data[2];
+        info->day = data[3];
+        info->hour = data[4];
+        info->minute = data[5];
+        info->second = data[6];
+    }
+
+    // iCCP and zTXt are a keyword, a compression method (0 for zlib, the only one there is) and a zlib stream
+    else if(compType(chunk->type, ICCP_CHUNK) && info->iccProfile == NULL){
+        int start = getKeyword(chunk, info->iccName);
+        if(start < 0 || start >= chunk->length || data[start] != 0) return PNG_OK;
+
+        int status = inflateMetadata(data + start+1, chunk->length - start-1, &info->iccProfile, &info->iccLength);
+        return status == PNG_ERROR_MEMORY ? status : PNG_OK;
+    }
+    else if(compType(chunk->type, TEXT_CHUNK) || compType(chunk->type, ZTXT_CHUNK)){
+        PNGText text;
+        int start = getKeyword(chunk, text.keyword);
+        if(start < 0) return PNG_OK;
+
+        if(compType(chunk->type, TEXT_CHUNK)){
+            text.text = (char*) malloc(chunk->length - start + 1);
+            if(text.text == NULL) return PNG_ERROR_MEMORY;
+            memcpy(text.text, data + start, chunk->length - start);
+            text.text[chunk->length - start] = '\0';
+        }
+        else{
+            long int length;
+            if(start >= chunk->length || data[start] != 0) return PNG_OK;
+
+            int status = inflateMetadata(data + start+1, chunk->length - start-1, (unsigned char**) &text.text, &length);
+            if(status != PNG_OK) return status == PNG_ERROR_MEMORY ? status : PNG_OK;
+        }
+
+        PNGText* texts = (PNGText*) realloc(info->texts, sizeof(PNGText)*(info->textCount+1));
+        if(texts == NULL){
+            free(text.text);
+            return PNG_ERROR_MEMORY;
+        }
+        info->texts = texts;
+        info->texts[info->textCount++] = text;
+    }
+
+    return PNG_OK;
+}
+
+// Copies the 1-79 character keyword at the start of a chunk into keyword (which has room for 80).
+// Returns where the rest of the chunk starts, past the keyword's NUL, or -1 if there's no proper keyword
+int getKeyword(Chunk* chunk, char* keyword)
+{
+    int end = 0;
+    while(end < chunk->length && end < 80 && chunk->data[end] != 0) end++;
+    if(end == 0 || end == 80 || end == chunk->length) return -1;
+
+    memcpy(keyword, chunk->data, end+1);
+    return end+1;
+}
+
+// Inflates a whole (small) zlib stream into a new buffer with a NUL after it, up to PROBE_INFLATE_LIMIT bytes
+int inflateMetadata(unsigned char* in, long int length, unsigned char** out, long int* out_length)
+{
+    z_stream stream;
+    long int capacity = 4096;
+    int ret = Z_OK;
+
+    memset(&stream, 0, sizeof(z_stream));
+    if(inflateInit(&stream) != Z_OK) return PNG_ERROR_MEMORY;
+
+    *out = (unsigned char*) malloc(capacity);
+    stream.next_in = in;
+    stream.avail_in = (unsigned int) length;
+    stream.next_out = *out;
+    stream.avail_out = (unsigned int) capacity-1;
+
+    while(*out != NULL && ret == Z_OK){
+        ret = inflate(&stream, Z_NO_FLUSH);
+
+        if(ret == Z_OK && stream.avail_out == 0){
+            if(capacity*2 > PROBE_INFLATE_LIMIT){
+                ret = Z_DATA_ERROR;
+                break;
+            }
+            unsigned char* grown = (unsigned char*) realloc(*out, capacity*2);
+            if(grown == NULL){
+                free(*out);
+                *out = NULL;
+                break;
+            }
+            *out = grown;
+            stream.next_out = grown + capacity-1;
+            stream.avail_out = (unsigned int) capacity;
+            capacity *= 2;
+        }
+    }
+
+    *out_length = (long int) stream.total_out;
+    inflateEnd(&stream);
+
+    if(*out == NULL) return PNG_ERROR_MEMORY;
+    if(ret != Z_STREAM_END){
+        free(*out);
+        *out = NULL;
+        return PNG_ERROR_DATA;
+    }
+    (*out)[*out_length] = 0;
+    return PNG_OK;
+}
+
+// ImageWrite --probe path... prints what probePNG finds in each file
+int probeFromArgs(PNGDecoder* decoder, int argc, char* argv[])
+{
+    char* colors[7] = {"gray", "?", "RGB", "palette", "gray+alpha", "?", "RGBA"};
+    int failed = 0;
+
+    for(int i = 0; i < argc; i++){
+        PNGInfo info;
+        int status = probePNG(decoder, argv[i], &info);
+
+        if(status != PNG_OK){
+            printf("%s: ERROR: %s\n", argv[i], describeStatus(status));
+            failed++;
+            continue;
+        }
+
+        // probePNG only lets through the color types in the table, but the number is all there is for anything else
+        int colort = info.iheader.colort;
+        char unknown[24];
+        snprintf(unknown, sizeof(unknown), "color type %d", colort);
+
+        printf("%s: %dx%d, %s, bit depth %d%s (read %ld bytes)\n", argv[i], info.iheader.width, info.iheader.height,
+               colort >= 0 && colort < 7 && strcmp(colors[colort], "?") != 0 ? colors[colort] : unknown, info.iheader.bitd,
+               info.iheader.interlacem ? ", interlaced" : "", info.bytesRead);
+        if(info.paletteCount != 0) printf("  palette: %d colors%s\n", info.paletteCount, info.transparent ? " with alpha" : "");
+        else if(info.transparent) printf("  transparent color key\n");
+        if(info.hasPhys) printf("  pixels per %s: %lu x %lu\n", info.unit == 1 ? "meter" : "unit", info.pixelsPerUnitX, info.pixelsPerUnitY);
+        if(info.hasTime) printf("  modified: %04d-%02d-%02d %02d:%02d:%02d UTC\n", info.year, info.month, info.day, info.hour, info.minute, info.second);
+        if(info.iccProfile != NULL) printf("  ICC profile: \"%s\", %ld bytes\n", info.iccName, info.iccLength);
+        for(int t = 0; t < info.textCount; t++) printf("  %s: %s\n", info.texts[t].keyword, info.texts[t].text);
+
+        freePNGInfo(&info);
+    }
+
+    return failed == 0 ? 0 : EXIT_FAILURE;
+}
+// Walks the chunk list exactly once, checking every chunk against the end of the file as it goes,
+// and remembers where the chunks the decoder cares about are so nothing has to search for them later
+int getChunksFromBytes(unsigned char* bytes, long int byteCount, int flags, PNGArena* arena, Chunk** chunk_out, int* chunkCount, ChunkIndex* index)
+{
+    long int next_seg = 8;
+    int chunks = 0;
+    int capacity = 16;
+    int status = PNG_OK;
+    Chunk* chunk_array = (Chunk*) allocScratch(arena, sizeof(Chunk)*capacity);
+    Chunk* current;
+
+    index->ihdr = index->plte = index->trns = index->idatFirst = -1;
+    index->idatCount = 0;
+    index->idatLength = 0;
+    if(chunk_array == NULL) return PNG_ERROR_MEMORY;
+
+    while(1){
+        if(byteCount - next_seg < 12){
+            status = PNG_ERROR_TRUNCATED;
+            break;
+        }
+
+        if(chunks == capacity){
+            Chunk* grown = (Chunk*) growScratch(arena, chunk_array, sizeof(Chunk)*capacity, sizeof(Chunk)*capacity*2);
+            if(grown == NULL){
+                status = PNG_ERROR_MEMORY;
+                break;
+            }
+            chunk_array = grown;
+            capacity *= 2;
+        }
+        current = &chunk_array[chunks];
+
+        unsigned long length = bytesToInt(bytes[next_seg], bytes[next_seg+1], bytes[next_seg+2], bytes[next_seg+3]);
+        if(length > 0x7fffffffUL || (long int) length > byteCount - next_seg - 12){
+            status = PNG_ERROR_TRUNCATED;
+            break;
+        }
+
+        current->length = (int) length;
+        memcpy(current->type, bytes+next_seg+4, 4);
+        memcpy(current->crc, bytes+next_seg+8+length, 4);
+
+        // by default the chunk is just a view into the file; only copy it out if the caller asked for that
+        current->offset = next_seg+8;
+        current->owned = flags & PNG_COPY_CHUNKS;
+
+        if(current->owned){
+            current->data = (unsigned char*) allocScratch(arena, current->length+1);
+            if(current->data == NULL){
+                status = PNG_ERROR_MEMORY;
+                break;
+            }
+            memcpy(current->data, bytes+current->offset, current->length);
+        }
+        else current->data = bytes+current->offset;
+        chunks++;
+
+        if(compType(current->type, IDAT_CHUNK)){
+            if(index->idatFirst < 0) index->idatFirst = chunks-1;
+            if(index->idatFirst + index->idatCount != chunks-1){
+                status = PNG_ERROR_LAYOUT;
+                break;
+            }
+
+            index->idatCount++;
+            index->idatLength += current->length;
+        }
+        else if(compType(current->type, IHDR_CHUNK) && index->ihdr < 0) index->ihdr = chunks-1;
+        else if(compType(current->type, PLTE_CHUNK) && index->plte < 0) index->plte = chunks-1;
+        else if(compType(current->type, TRNS_CHUNK) && index->trns < 0) index->trns = chunks-1;
+
+        next_seg += current->length+12;
+
+        if(compType(current->type, IEND_CHUNK)) break;
+    }
+
+    if(status != PNG_OK){
+        for(int i = 0; i < chunks; i++){
+            if(chunk_array[i].owned) freeScratch(arena, chunk_array[i].data);
+        }
+        freeScratch(arena, chunk_array);
+        return status;
+    }
+
+    *chunk_out = chunk_array;
+    *chunkCount = chunks;
+    return PNG_OK;
+}
+
+// CRC32 of len bytes of buf, continuing on from crc (pass 0 to start a new one). Big buffers are folded
+// 64 bytes at a time with carry-less multiplies when the CPU has them, everything else goes through the tables
+unsigned long CRC32(unsigned long crc, unsigned char *buf, int len){
+    unsigned int c = (unsigned int) crc ^ 0xffffffffU;
+
+#ifdef PNG_SIMD_X86_DISPATCH
+    if(len >= 64 && __builtin_cpu_supports("pclmul")){
+        int folded = len & ~15;
+        c = foldCRC32(c, buf, folded);
+        buf += folded;
+        len -= folded;
+    }
+#endif
+
+    // slicing-by-8: eight table lookups per 8 bytes instead of one per byte
+    while(len >= 8){
+        unsigned int one = (buf[0] | buf[1] << 8 | buf[2] << 16 | (unsigned int) buf[3] << 24) ^ c;
+        unsigned int two = buf[4] | buf[5] << 8 | buf[6] << 16 | (unsigned int) buf[7] << 24;
+
+        c = CRC_TABLE[7][one & 0xff] ^ CRC_TABLE[6][(one >> 8) & 0xff] ^
+            CRC_TABLE[5][(one >> 16) & 0xff] ^ CRC_TABLE[4][one >> 24] ^
+            CRC_TABLE[3][two & 0xff] ^ CRC_TABLE[2][(two >> 8) & 0xff] ^
+            CRC_TABLE[1][(two >> 16) & 0xff] ^ CRC_TABLE[0][two >> 24];
+
+        buf += 8;
+        len -= 8;
+    }
+
+    for (int n = 0; n < len; n++) {
+        c = CRC_TABLE[0][(c ^ buf[n]) & 0xff] ^ (c >> 8);
+    }
+
+    return c ^ 0xffffffffU;
+}
+
+#ifdef PNG_SIMD_X86_DISPATCH
+/*
+Folds len bytes (at least 64, and a multiple of 16) into a running CRC using PCLMULQDQ, following Intel's
+"Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction". crc is passed and returned
+without the final inversion. The constants are powers of x mod the (bit-reflected) PNG polynomial.
+*/
+__attribute__((target("sse2,pclmul")))
+unsigned int foldCRC32(unsigned int crc, unsigned char* buf, int len)
+{
+    __m128i k1k2 = _mm_set_epi64x(0x01c6e41596LL, 0x0154442bd4LL);
+    __m128i k3k4 = _mm_set_epi64x(0x00ccaa009eLL, 0x01751997d0LL);
+    __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124LL);
+    __m128i poly = _mm_set_epi64x(0x01f7011641LL, 0x01db710641LL);
+    __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+    x1 = _mm_xor_si128(_mm_loadu_si128((__m128i*) (buf + 0x00)), _mm_cvtsi32_si128(crc));
+    x2 = _mm_loadu_si128((__m128i*) (buf + 0x10));
+    x3 = _mm_loadu_si128((__m128i*) (buf + 0x20));
+    x4 = _mm_loadu_si128((__m128i*) (buf + 0x30));
+    buf += 64;
+    len -= 64;
+
+    // four 128 bit lanes folded in parallel, 64 bytes per step
+    while(len >= 64){
+        x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+
+        x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((__m128i*) (buf + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((__m128i*) (buf + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((__m128i*) (buf + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((__m128i*) (buf + 0x30)));
+
+        buf += 64;
+        len -= 64;
+    }
+
+    // fold the four lanes into one
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x4), x5);
+
+    // then any 16 byte blocks that are left
+    while(len >= 16){
+        x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), _mm_loadu_si128((__m128i*) buf)), x5);
+        buf += 16;
+        len -= 16;
+    }
+
+    // 128 bits down to 64
+    x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask);
+    x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, k5k0, 0x00), x2);
+
+    // and a Barrett reduction down to 32
+    x0 = _mm_and_si128(x1, mask);
+    x0 = _mm_clmulepi64_si128(x0, poly, 0x10);
+    x0 = _mm_and_si128(x0, mask);
+    x0 = _mm_clmulepi64_si128(x0, poly, 0x00);
+    x1 = _mm_xor_si128(x1, x0);
+
+    return (unsigned int) _mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+}
+#endif
+
+
+int hasValidSignature(unsigned char* bytes)
+{
+    int equal = 1;
+    for(int i = 0; i < 8; i++) equal = bytes[i] == SIGNATURE[i] ? equal : 0;
+    return equal;
+}
+
+// Whether bitd is allowed for colort, which also rules out the color types PNG doesn't define (1, 5 and 7 up)
+int hasValidBitDepth(int bitd, int colort)
+{
+    switch(colort){
+        case 0:
+            return bitd == 1 || bitd == 2 || bitd == 4 || bitd == 8 || bitd == 16;
+        case 3:
+            return bitd == 1 || bitd == 2 || bitd == 4 || bitd == 8;
+        case 2:
+        case 4:
+        case 6:
+            return bitd == 8 || bitd == 16;
+        default:
+            return 0;
+    }
+}
+
+int hasValidCRC(Chunk* chunks, int chunkCount, int flags)
+{
+    unsigned long type_crc;
+    unsigned long chunk_crc;
+    unsigned long actual_crc;
+
+    if(flags & PNG_SKIP_CRC) return 1;
+
+    for(int count = 0; count < chunkCount; count++)
+    {
+        // a lowercase first letter (bit 5 set) marks an ancillary chunk
+        if((flags & PNG_CRC_CRITICAL) && (chunks[count].type[0] & 0x20)) continue;
+
+        type_crc = CRC32(0L, chunks[count].type, 4);
+        chunk_crc = CRC32(type_crc, chunks[count].data, chunks[count].length);
+        actual_crc = bytesToInt(chunks[count].crc[0], chunks[count].crc[1],
+                                chunks[count].crc[2], chunks[count].crc[3]);
+
+        if(actual_crc != chunk_crc) return 0;
+    }
+
+    return 1;
+}
+
+PLTE getPaletteFromChunks(Chunk* chunks, ChunkIndex index, PNGArena* arena)
+{
+    PLTE img_palette;
+    memset(&img_palette, 0, sizeof(PLTE));
+
+    if(index.plte < 0) return img_palette;
+    Chunk* plte = &chunks[index.plte];
+
+    img_palette.indexCount = plte->length/3;
+    img_palette.indexes = (Pix*) allocScratch(arena, sizeof(Pix)*img_palette.indexCount);
+    if(img_palette.indexes == NULL) img_palette.indexCount = 0;
+
+    for(int i = 0; i < img_palette.indexCount; i++){
+        img_palette.indexes[i].RGBA[0] = plte->data[(i*3)];
+        img_palette.indexes[i].RGBA[1] = plte->data[(i*3)+1];
+        img_palette.indexes[i].RGBA[2] = plte->data[(i*3)+2];
+        img_palette.indexes[i].RGBA[3] = 0xff;
+    }
+
+    return img_palette;
+}
+
+// Applies the tRNS chunk: a palette image's goes straight into the palette's alphas, and a grayscale or RGB
+// image's is the color key that comes back. Images with an alpha channel can't have one, so theirs is ignored
+TRNS getTransparencyFromChunks(Chunk* chunks, ChunkIndex index, IHDR img_info, PLTE* palette)
+{
+    TRNS transparency;
+    memset(&transparency, 0, sizeof(TRNS));
+
+    if(index.trns < 0) return transparency;
+    Chunk* trns = &chunks[index.trns];
+
+    if(img_info.colort == 3){
+        for(int i = 0; i < trns->length && i < palette->indexCount; i++) palette->indexes[i].RGBA[3] = trns->data[i];
+    }
+    else if((img_info.colort == 0 && trns->length >= 2) || (img_info.colort == 2 && trns->length >= 6)){
+        int mask = (1 << img_info.bitd) - 1;
+        for(int chnl = 0; chnl < img_info.channels; chnl++){
+            transparency.key[chnl] = (trns->data[2*chnl] << 8 | trns->data[2*chnl+1]) & mask;
+        }
+        transparency.present = 1;
+    }
+
+    return transparency;
+}
+
+// Builds the palette's packed tables, once its alphas are in
+int packPalette(PLTE* palette, PNGArena* arena)
+{
+    palette->packed = (unsigned int*) allocScratch(arena, 256*sizeof(unsigned int) + 256*2);
+    if(palette->packed == NULL) return PNG_ERROR_MEMORY;
+    palette->gray = (unsigned char*) (palette->packed + 256);
+
+    for(int i = 0; i < 256; i++){
+        int rgba[4] = {0, 0, 0, 0xff};
+        unsigned char* color = (unsigned char*) &palette->packed[i];
+
+        if(i < palette->indexCount) memcpy(rgba, palette->indexes[i].RGBA, sizeof(rgba));
+        for(int chnl = 0; chnl < 4; chnl++) color[chnl] = (unsigned char) rgba[chnl];
+
+        palette->gray[2*i] = (unsigned char) ((rgba[0]*77 + rgba[1]*150 + rgba[2]*29 + 128) >> 8);
+        palette->gray[2*i+1] = (unsigned char) rgba[3];
+    }
+    return PNG_OK;
+}
+
+// Sets up a streaming decode of the IDAT run using the decoder's scratch memory and inflate backend.
+// Nothing is inflated until rows are asked for (unless the backend can only inflate everything at once)
+int startRowDecoder(RowDecoder* rd, PNGDecoder* decoder, Chunk* chunks, ChunkIndex index, IHDR img_info)
+{
+    rd->chunks = chunks;
+    rd->index = index;
+    rd->nextIdat = index.idatFirst;
+    rd->image = img_info;
+    rd->info = img_info;
+    rd->row = 0;
+    rd->offset = 0;
+    rd->backend = decoder->backend;
+    rd->state = NULL;
+    rd->next_in = NULL;
+    rd->avail_in = 0;
+    rd->inflated = NULL;
+    rd->arena = getArena(decoder);
+    rd->stats = &decoder->stats;
+
+    long int stride = ((long int) img_info.bitd * img_info.channels * img_info.width + 7) >> 3;
+    long int samples = (long int) img_info.width*img_info.channels;
+    if(stride > 0x7fffffffL - 64 || samples > 0x7fffffffL - 64) return PNG_ERROR_MEMORY;
+
+    rd->stride = (int) stride;
+    rd->bpp = (img_info.bitd * img_info.channels) >> 3;
+    if(rd->bpp == 0) rd->bpp = 1;
+
+    // rows are padded out to one byte per sample, so expanding them can never read past the end,
+    // plus another 16 bytes for the SIMD kernels to read (but not write) past the end
+    int row_size = rd->stride > samples ? rd->stride : (int) samples;
+    long int rows_size = 2*((long int) row_size+1+16);
+
+    if(decoder->rowsSize < rows_size){
+        free(decoder->rows);
+        decoder->rows = (unsigned char*) malloc(rows_size);
+        decoder->rowsSize = decoder->rows == NULL ? 0 : rows_size;
+        if(decoder->rows == NULL) return PNG_ERROR_MEMORY;
+    }
+    memset(decoder->rows, 0, rows_size);
+
+    rd->rows = decoder->rows;
+    rd->previous = rd->rows;
+    rd->current = rd->rows + row_size + 1 + 16;
+
+    selectUnfilterKernels(rd->bpp, rd->unfilters);
+
+    if(rd->backend->start != NULL){
+        // the inflate state lives on in the decoder, so after the first image it's only ever reset
+        if(decoder->inflateState != NULL && !rd->backend->reset(decoder->inflateState)){
+            rd->backend->end(decoder->inflateState);
+            decoder->inflateState = NULL;
+        }
+        if(decoder->inflateState == NULL) decoder->inflateState = rd->backend->start();
+        if(decoder->inflateState == NULL) return PNG_ERROR_MEMORY;
+
+        rd->state = decoder->inflateState;
+        return PNG_OK;
+    }
+
+    // this backend can only do the whole thing at once, so inflate everything now and unfilter it in place later
+    int copied;
+    long int inflated_size = inflatedSize(img_info);
+    unsigned char* compressed = gatherIDAT(chunks, index, &copied, rd->arena);
+    if(compressed == NULL) return PNG_ERROR_MEMORY;
+
+    rd->inflated = (unsigned char*) allocScratch(rd->arena, inflated_size + row_size - rd->stride + 16);
+    statsClock(since);
+    int ok = rd->inflated != NULL && rd->backend->whole(&decoder->wholeState, compressed, index.idatLength, rd->inflated, inflated_size);
+    statsStage(rd->stats, STAGE_INFLATE, since, inflated_size);
+
+    if(copied) freeScratch(rd->arena, compressed);
+    if(!ok){
+        int status = rd->inflated == NULL ? PNG_ERROR_MEMORY : PNG_ERROR_DATA;
+        freeScratch(rd->arena, rd->inflated);
+        rd->inflated = NULL;
+        return status;
+    }
+    return PNG_OK;
+}
+
+// The scratch memory belongs to the PNGDecoder, so this only has to free what the row decoder made itself
+void endRowDecoder(RowDecoder* decoder)
+{
+    freeScratch(decoder->arena, decoder->inflated);
+    decoder->inflated = NULL;
+}
+
+// Points the row decoder at one of the seven passes (0-6) of an interlaced image, which is filtered as a small
+// image of its own and whose rows carry straight on from the last pass's in the IDAT stream.
+// Returns 0 if the pass is empty, which small images can have
+int startPass(RowDecoder* rd, int pass)
+{
+    rd->info.width = passSize(rd->image.width, ADAM7[pass].x, ADAM7[pass].dx);
+    rd->info.height = passSize(rd->image.height, ADAM7[pass].y, ADAM7[pass].dy);
+    rd->stride = (int) (((long int) rd->info.bitd * rd->info.channels * rd->info.width + 7) >> 3);
+    rd->row = 0;
+
+    return rd->info.width > 0 && rd->info.height > 0;
+}
+
+// How many of size pixels a pass has along one side, if it starts at first and takes every step'th one
+int passSize(int size, int first, int step)
+{
+    return size > first ? (size - first + step - 1)/step : 0;
+}
+
+// How many bytes the IDAT run inflates to: every scanline and its filter byte, in every pass
+long int inflatedSize(IHDR img_info)
+{
+    if(!img_info.interlacem) return (long int) img_info.height*((((long int) img_info.bitd*img_info.channels*img_info.width + 7) >> 3) + 1);
+
+    long int size = 0;
+    for(int pass = 0; pass < 7; pass++){
+        long int width = passSize(img_info.width, ADAM7[pass].x, ADAM7[pass].dx);
+        long int height = passSize(img_info.height, ADAM7[pass].y, ADAM7[pass].dy);
+        if(width > 0) size += height*((((long int) img_info.bitd*img_info.channels*width + 7) >> 3) + 1);
+    }
+    return size;
+}
+
+// Inflates just enough of the IDAT run to fill the next scanline, then unfilters it against the row
+// before it. Returns the unfiltered row (without its filter byte), or NULL once every row has been read
+// or if the data is broken
+unsigned char* decodeNextRow(RowDecoder* decoder)
+{
+    if(decoder->row >= decoder->info.height) return NULL;
+    statsClock(since);
+
+    if(decoder->inflated != NULL){
+        // everything was inflated up front; the first row's "previous" row is the zeroed row buffer
+        decoder->previous = decoder->row == 0 ? decoder->rows : decoder->current;
+        decoder->current = decoder->inflated + decoder->offset;
+        decoder->offset += decoder->stride+1;
+    }
+    else{
+        unsigned char* swap = decoder->previous;
+        decoder->previous = decoder->current;
+        decoder->current = swap;
+
+        // each pass of an interlaced image starts over with nothing above its first row
+        if(decoder->row == 0) memset(decoder->previous, 0, decoder->stride+1);
+        if(!inflateBytes(decoder, decoder->current, decoder->stride+1)) return NULL;
+        statsStage(decoder->stats, STAGE_INFLATE, since, decoder->stride+1);
+    }
+
+    if(decoder->current[0] > 4) return NULL;
+    decoder->unfilters[decoder->current[0]](decoder->current+1, decoder->previous+1, decoder->stride, decoder->bpp);
+    statsStage(decoder->stats, STAGE_UNFILTER, since, decoder->stride);
+    statsFilter(decoder->stats, decoder->current[0]);
+
+    decoder->row++;
+    return decoder->current+1;
+}
+
+// Moves past the next scanline without unfiltering it, for when nothing after it in the pass is needed.
+// Returns 0 if there are no rows left or the data is broken
+int skipNextRow(RowDecoder* decoder)
+{
+    if(decoder->row >= decoder->info.height) return 0;
+
+    if(decoder->inflated != NULL) decoder->offset += decoder->stride+1;
+    else if(!inflateBytes(decoder, decoder->current, decoder->stride+1)) return 0;
+
+    decoder->row++;
+    return 1;
+}
+
+// Inflates exactly size more bytes of the IDAT run into out, feeding it one IDAT chunk at a time.
+// Returns 0 if the stream is broken or ends too soon
+int inflateBytes(RowDecoder* decoder, unsigned char* out, unsigned int size)
+{
+    unsigned char* next_out = out;
+    unsigned int avail_out = size;
+
+    while(avail_out > 0){
+        if(decoder->avail_in == 0){
+            if(decoder->nextIdat >= decoder->index.idatFirst+decoder->index.idatCount) return 0;
+
+            decoder->next_in = decoder->chunks[decoder->nextIdat].data;
+            decoder->avail_in = decoder->chunks[decoder->nextIdat].length;
+            decoder->nextIdat++;
+            continue;
+        }
+
+        int ret = decoder->backend->run(decoder->state, &decoder->next_in, &decoder->avail_in, &next_out, &avail_out);
+        if(ret == INFLATE_DONE && avail_out == 0) break;
+        if(ret != INFLATE_OK) return 0;
+    }
+    return 1;
+}
+
+int PaethPredictor(int a, int b, int c)
+{
+    int pa = abs(b - c);
+    int pb = abs(a - c);
+    int pc = abs(a + b - (2*c));
+
+    if(pa <= pb && pa <= pc) return a;
+    else if(pb <= pc) return b;
+    return c;
+}
+
+// Undoes one scanline's filter in place. prev is the already unfiltered row above it (all zeros for the first row).
+// This is the plain C version that every faster kernel has to agree with
+void unfilterRow(unsigned char* row, unsigned char* prev, int stride, int bpp, int filter_type)
+{
+    switch(filter_type){
+        case 1: unfilterSub(row, prev, stride, bpp); break;
+        case 2: unfilterUp(row, prev, stride, bpp); break;
+        case 3: unfilterAverage(row, prev, stride, bpp); break;
+        case 4: unfilterPaeth(row, prev, stride, bpp); break;
+    }
+}
+
+void unfilterNone(unsigned char* row, unsigned char* prev, int stride, int bpp)
+{
+    (void) row; (void) prev; (void) stride; (void) bpp;
+}
+
+void unfilterSub(unsigned char* row, unsigned char* prev, int stride, int bpp)
+{
+    (void) prev;
+    for(int c = bpp; c < stride; c++) row[c] += row[c - bpp];
+}
+
+void unfilterUp(unsigned char* row, unsigned char* prev, int stride, int bpp)
+{
+    (void) bpp;
+    for(int c = 0; c < stride; c++) row[c] += prev[c];
+}
+
+void unfilterAverage(unsigned char* row, unsigned char* prev, int stride, int bpp)
+{
+    int c;
+    for(c = 0; c < bpp; c++) row[c] += prev[c] >> 1;
+    for(; c < stride; c++) row[c] += (row[c - bpp] + prev[c]) >> 1;
+}
+
+void unfilterPaeth(unsigned char* row, unsigned char* prev, int stride, int bpp)
+{
+    int c;
+    for(c = 0; c < bpp; c++) row[c] += prev[c];
+    for(; c < stride; c++) row[c] += PaethPredictor(row[c - bpp], prev[c], prev[c - bpp]);
+}
+
+/*
+SIMD kernels:
+Up has no dependency between bytes, so it's done 16 (or 32) bytes at a time.
+Sub is a running sum, which for 1, 2, 4 and 8 byte pixels can be done on a whole 16 byte block
+by adding the block to shifted copies of itself, and carrying the last pixel into the next block.
+Average and Paeth depend on the pixel just decoded, so the best we can do is one whole pixel per step.
+For 1 and 2 byte pixels that's no better than plain C, so those stay scalar.
+The NEON ones load 8 bytes at a time, which can read past the end of a row; startRowDecoder leaves room for that.
+None of them ever write past the end of a row.
+*/
+#ifdef PNG_SIMD_SSE2
+// Pixels are moved with loads and stores of exactly bpp bytes, so a load never straddles the store before it.
+// The per-pixel kernels are always inlined with a constant bpp, so these switches disappear
+static inline __m128i loadPixelSSE2(unsigned char* p, int bpp)
+{
+    unsigned int lo = 0;
+    unsigned short hi;
+
+    switch(bpp){
+        case 3:
+            return _mm_cvtsi32_si128(p[0] | p[1] << 8 | p[2] << 16);
+        case 4:
+            memcpy(&lo, p, 4);
+            return _mm_cvtsi32_si128(lo);
+        case 6:
+            memcpy(&lo, p, 4);
+            memcpy(&hi, p+4, 2);
+            return _mm_unpacklo_epi32(_mm_cvtsi32_si128(lo), _mm_cvtsi32_si128(hi));
+        default:
+            return _mm_loadl_epi64((__m128i*) p);
+    }
+}
+
+static inline void storePixelSSE2(unsigned char* p, __m128i x, int bpp)
+{
+    unsigned int lo = _mm_cvtsi128_si32(x);
+    unsigned short hi;
+
+    switch(bpp){
+        case 3:
+            p[0] = lo;
+            p[1] = lo >> 8;
+            p[2] = lo >> 16;
+            break;
+        case 4:
+            memcpy(p, &lo, 4);
+            break;
+        case 6:
+            hi = _mm_cvtsi128_si32(_mm_srli_si128(x, 4));
+            memcpy(p, &lo, 4);
+            memcpy(p+4, &hi, 2);
+            break;
+        default:
+            _mm_storel_epi64((__m128i*) p, x);
+    }
+}
+
+#define dispatchWholePixels(kernel, row, prev, stride, bpp) \
+    switch(bpp){ \
+        case 3: kernel(row, prev, stride, 3); break; \
+        case 4: kernel(row, prev, stride, 4); break; \
+        case 6: kernel(row, prev, stride, 6); break; \
+        case 8: kernel(row, prev, stride, 8); break; \
+    }
+
+void unfilterUpSSE2(unsigned char* row, unsigned char* prev, int stride, int bpp)
+{
+    int c = 0;
+    for(; c + 16 <= stride; c += 16){
+        __m128i x = _mm_loadu_si128((__m128i*) (row+c));
+        _mm_storeu_si128((__m128i*) (row+c), _mm_add_epi8(x, _mm_loadu_si128((__m128i*) (prev+c))));
+    }
+    unfilterUp(row+c, prev+c, stride-c, bpp);
+}
+
+// Sub for bpp 1, 2, 4 and 8
+void unfilterSubPrefixSSE2(unsigned char* row, unsigned char* prev, int stride, int bpp)
+{
+    __m128i carry = _mm_setzero_si128();
+    int c = 0;
+
+    for(; c + 16 <= stride; c += 16){
+        __m128i x = _mm_loadu_si128((__m128i*) (row+c));
+        switch(bpp){
+            case 1: x = _mm_add_epi8(x, _mm_slli_si128(x, 1)); // fall through
+            case 2: x = _mm_add_epi8(x, _mm_slli_si128(x, 2)); // fall through
+            case 4: x = _mm_add_epi8(x, _mm_slli_si128(x, 4)); // fall through
+            case 8: x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+        }
+        x = _mm_add_epi8(x, carry);
+        _mm_storeu_si128((__m128i*) (row+c), x);
+
+        // spread the last pixel of this block across the whole register for the next one
+        switch(bpp){
+            case 1:
+                carry = _mm_unpackhi_epi8(x, x);
+                carry = _mm_shufflehi_epi16(carry, 0xff);
+                carry = _mm_unpackhi_epi64(carry, carry);
+                break;
+            case 2:
+                carry = _mm_shufflehi_epi16(x, 0xff);
+                carry = _mm_unpackhi_epi64(carry, carry);
+                break;
+            case 4:
+                carry = _mm_shuffle_epi32(x, 0xff);
+                break;
+            case 8:
+                carry = _mm_unpackhi_epi64(x, x);
+                break;
+        }
+    }
+
+    // finish the tail with the scalar loop, which picks the running sum up from the bytes just written
+    if(c == 0) unfilterSub(row, prev, stride, bpp);
+    else for(; c < stride; c++) row[c] += row[c - bpp];
+}
+
+static inline __attribute__((always_inline)) void subPixelsSSE2(unsigned char* row, unsigned char* prev, int stride, int bpp)
+{
+    (void) prev;
+    __m128i a = _mm_setzero_si128();
+
+    for(int c = 0; c < stride; c += bpp){
+        a = _mm_add_epi8(loadPixelSSE2(row+c, bpp), a);
+        storePixelSSE2(row+c, a, bpp);
+    }
+}
+
+// Sub for bpp 3 and 6
+void unfilterSubSSE2(unsigned char* row, unsigned char* prev, int stride, int bpp)
+{
+    dispatchWholePixels(subPixelsSSE2, row, prev, stride, bpp);
+}
+
+static inline __attribute__((always_inline)) void averagePixelsSSE2(unsigned char* row, unsigned char* prev, int stride, int bpp)
+{
+    __m128i a = _mm_setzero_si128();
+    __m128i one = _mm_set1_epi8(1);
+
+    for(int c = 0; c < stride; c += bpp){
+        __m128i b = loadPixelSSE2(prev+c, bpp);
+        // _mm_avg_epu8 rounds up, PNG rounds down
+        __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+
+        a = _mm_add_epi8(loadPixelSSE2(row+c, bpp), avg);
+        storePixelSSE2(row+c, a, bpp);
+    }
+}
+
+void unfilterAverageSSE2(unsigned char* row, unsigned char* prev, int stride, int bpp)
+{
+    dispatchWholePixels(averagePixelsSSE2, row, prev, stride, bpp);
+}
+
+// Paeth works on 16 bit lanes so the predictor's differences can't overflow
+static inline __m128i paethSSE2(__m128i a, __m128i b, __m128i c, __m128i pa, __m128i pb, __m128i pc)
+{
+    __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+    __m128i use_b = _mm_cmpeq_epi16(smallest, pb);
+    __m128i use_a = _mm_cmpeq_epi16(smallest, pa);
+
+    __m128i nearest = _mm_or_si128(_mm_and_si128(use_b, b), _mm_andnot_si128(use_b, c));
+    return _mm_or_si128(_mm_and_si128(use_a, a), _mm_andnot_si128(use_a, nearest));
+}
+
+static inline __m128i absSSE2(__m128i x)
+{
+    return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+static inline __attribute__((always_inline)) void paethPixelsSSE2(unsigned char* row, unsigned char* prev, int stride, int bpp)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i a = zero;
+    __m128i c = zero;
+
+    for(int i = 0; i < stride; i += bpp){
+        __m128i b = _mm_unpacklo_epi8(loadPixelSSE2(prev+i, bpp), zero);
+        __m128i x = _mm_unpacklo_epi8(loadPixelSSE2(row+i, bpp), zero);
+
+        __m128i pa = _mm_sub_epi16(b, c);
+        __m128i pb = _mm_sub_epi16(a, c);
+        __m128i pc = absSSE2(_mm_add_epi16(pa, pb));
+
+        x = _mm_add_epi16(x, paethSSE2(a, b, c, absSSE2(pa), absSSE2(pb), pc));
+        a = _mm_and_si128(x, _mm_set1_epi16(0xff));
+        c = b;
+        storePixelSSE2(row+i, _mm_packus_epi16(a, a), bpp);
+    }
+}
+
+void unfilterPaethSSE2(unsigned char* row, unsigned char* prev, int stride, int bpp)
+{
+    dispatchWholePixels(paethPixelsSSE2, row, prev, stride, bpp);
+}
+#endif
+
+#ifdef PNG_SIMD_X86_DISPATCH
+static inline __attribute__((always_inline, target("ssse3"))) void paethPixelsSSSE3(unsigned char* row, unsigned char* prev, int stride, int bpp)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i a = zero;
+    __m128i c = zero;
+
+    for(int i = 0; i < stride; i += bpp){
+        __m128i b = _mm_unpacklo_epi8(loadPixelSSE2(prev+i, bpp), zero);
+        __m128i x = _mm_unpacklo_epi8(loadPixelSSE2(row+i, bpp), zero);
+
+        __m128i pa = _mm_sub_epi16(b, c);
+        __m128i pb = _mm_sub_epi16(a, c);
+        __m128i pc = _mm_abs_epi16(_mm_add_epi16(pa, pb));
+
+        x = _mm_add_epi16(x, paethSSE2(a, b, c, _mm_abs_epi16(pa), _mm_abs_epi16(pb), pc));
+        a = _mm_and_si128(x, _mm_set1_epi16(0xff));
+        c = b;
+        storePixelSSE2(row+i, _mm_packus_epi16(a, a), bpp);
+    }
+}
+
+__attribute__((target("ssse3")))
+void unfilterPaethSSSE3(unsigned char* row, unsigned char* prev, int stride, int bpp)
+{
+    dispatchWholePixels(paethPixelsSSSE3, row, prev, stride, bpp);
+}
+
+__attribute__((target("avx2")))
+void unfilterUpAVX2(unsigned char* row, unsigned char* prev, int stride, int bpp)
+{
+    int c = 0;
+    for(; c + 32 <= stride; c += 32){
+        __m256i x = _mm256_loadu_si256((__m256i*) (row+c));
+        _mm256_storeu_si256((__m256i*) (row+c), _mm256_add_epi8(x, _mm256_loadu_si256((__m256i*) (prev+c))));
+    }
+    unfilterUp(row+c, prev+c, stride-c, bpp);
+}
+#endif
+
+#ifdef PNG_SIMD_NEON
+static inline void storePixelNEON(unsigned char* p, uint8x8_t v, int bpp)
+{
+    unsigned char tmp[8];
+    vst1_u8(tmp, v);
+    memcpy(p, tmp, bpp);
+}
+
+void unfilterUpNEON(unsigned char* row, unsigned char* prev, int stride, int bpp)
+{
+    int c = 0;
+    for(; c + 16 <= stride; c += 16) vst1q_u8(row+c, vaddq_u8(vld1q_u8(row+c), vld1q_u8(prev+c)));
+    unfilterUp(row+c, prev+c, stride-c, bpp);
+}
+
+void unfilterSubNEON(unsigned char* row, unsigned char* prev, int stride, int bpp)
+{
+    (void) prev;
+    uint8x8_t a = vdup_n_u8(0);
+
+    for(int c = 0; c < stride; c += bpp){
+        a = vadd_u8(vld1_u8(row+c), a);
+        storePixelNEON(row+c, a, bpp);
+    }
+}
+
+void unfilterAverageNEON(unsigned char* row, unsigned char* prev, int stride, int bpp)
+{
+    uint8x8_t a = vdup_n_u8(0);
+
+    for(int c = 0; c < stride; c += bpp){
+        // vhadd rounds down, same as PNG
+        a = vadd_u8(vld1_u8(row+c), vhadd_u8(a, vld1_u8(prev+c)));
+        storePixelNEON(row+c, a, bpp);
+    }
+}
+
+void unfilterPaethNEON(unsigned char* row, unsigned char* prev, int stride, int bpp)
+{
+    uint8x8_t a = vdup_n_u8(0);
+    uint8x8_t c = vdup_n_u8(0);
+
+    for(int i = 0; i < stride; i += bpp){
+        uint8x8_t b = vld1_u8(prev+i);
+
+        uint16x8_t pa = vabdl_u8(b, c);
+        uint16x8_t pb = vabdl_u8(a, c);
+        uint16x8_t pc = vabdq_u16(vaddl_u8(a, b), vaddl_u8(c, c));
+
+        uint8x8_t use_a = vmovn_u16(vandq_u16(vcleq_u16(pa, pb), vcleq_u16(pa, pc)));
+        uint8x8_t use_b = vmovn_u16(vcleq_u16(pb, pc));
+        uint8x8_t nearest = vbsl_u8(use_a, a, vbsl_u8(use_b, b, c));
+
+        a = vadd_u8(vld1_u8(row+i), nearest);
+        c = b;
+        storePixelNEON(row+i, a, bpp);
+    }
+}
+#endif
+
+// Picks the fastest kernel for each filter type for this pixel size and CPU. Done once per image,
+// so the row loop only has to index into the table with the filter byte
+void selectUnfilterKernels(int bpp, UnfilterKernel* kernels)
+{
+    kernels[0] = unfilterNone;
+    kernels[1] = unfilterSub;
+    kernels[2] = unfilterUp;
+    kernels[3] = unfilterAverage;
+    kernels[4] = unfilterPaeth;
+
+#if defined(PNG_SIMD_SSE2) || defined(PNG_SIMD_NEON)
+    int whole_pixels = bpp == 3 || bpp == 4 || bpp == 6 || bpp == 8;
+#else
+    (void) bpp;
+#endif
+
+#ifdef PNG_SIMD_SSE2
+    kernels[2] = unfilterUpSSE2;
+    if(bpp == 1 || bpp == 2 || bpp == 4 || bpp == 8) kernels[1] = unfilterSubPrefixSSE2;
+    else if(whole_pixels) kernels[1] = unfilterSubSSE2;
+
+    if(whole_pixels){
+        kernels[3] = unfilterAverageSSE2;
+        kernels[4] = unfilterPaethSSE2;
+    }
+#endif
+#ifdef PNG_SIMD_X86_DISPATCH
+    if(__builtin_cpu_supports("avx2")) kernels[2] = unfilterUpAVX2;
+    if(whole_pixels && __builtin_cpu_supports("ssse3")) kernels[4] = unfilterPaethSSSE3;
+#endif
+#ifdef PNG_SIMD_NEON
+    kernels[2] = unfilterUpNEON;
+    if(whole_pixels){
+        kernels[1] = unfilterSubNEON;
+        kernels[3] = unfilterAverageNEON;
+        kernels[4] = unfilterPaethNEON;
+    }
+#endif
+}
+
+// Turns one unfiltered scanline into width Pix values, holding the samples at the image's own bit depth
+// (or the palette's colors and alphas)
+void expandRow(unsigned char* row, Pix* out, IHDR img_info, PLTE color_indexes)
+{
+    // samples smaller than a byte are unpacked into the end of out first, the same as in convertRow
+    if(img_info.bitd < 8){
+        unsigned char* unpacked = (unsigned char*) out + (long int) img_info.width*(sizeof(Pix)-1);
+        unpackRow(row, unpacked, img_info.width, img_info.bitd, 0);
+        row = unpacked;
+    }
+
+    for(int pixl = 0; pixl < img_info.width; pixl++){
+        int rgba[4] = {0, 0, 0, 0};
+
+        if(color_indexes.indexCount == 0){
+            for(int chnl = 0; chnl < img_info.channels; chnl++){
+                int k = pixl*img_info.channels + chnl;
+                rgba[chnl] = img_info.bitd == 16 ? row[2*k] << 8 | row[2*k+1] : row[k];
+            }
+        }
+        else if(row[pixl] < color_indexes.indexCount){
+            memcpy(rgba, color_indexes.indexes[row[pixl]].RGBA, sizeof(rgba));
+        }
+
+        memcpy(out[pixl].RGBA, rgba, sizeof(rgba));
+    }
+}
+
+// Unpacks width samples of 1, 2 or 4 bits into a byte each, a whole packed byte at a time, either as they are
+// or stretched out to 0-255 (see UNPACK_1BIT)
+void unpackRow(unsigned char* row, unsigned char* out, int width, int bitd, int scale)
+{
+    int per_byte = 8/bitd;
+    int whole = width/per_byte;
+
+    switch(bitd){
+        case 1:
+            for(int i = 0; i < whole; i++) memcpy(out + 8*i, UNPACK_1BIT[scale][row[i]], 8);
+            break;
+        case 2:
+            for(int i = 0; i < whole; i++) memcpy(out + 4*i, UNPACK_2BIT[scale][row[i]], 4);
+            break;
+        case 4:
+            for(int i = 0; i < whole; i++) memcpy(out + 2*i, UNPACK_4BIT[scale][row[i]], 2);
+            break;
+    }
+
+    // the last byte can be partly padding
+    int left = width - whole*per_byte;
+    if(left > 0){
+        const unsigned char* last = bitd == 1 ? UNPACK_1BIT[scale][row[whole]] :
+                                    bitd == 2 ? UNPACK_2BIT[scale][row[whole]] : UNPACK_4BIT[scale][row[whole]];
+        memcpy(out + whole*per_byte, last, left);
+    }
+}
+
+// Expands width palette indexes into 8 bit pixels of channels (1 to 4) bytes each, one table load per pixel.
+// Like unpackRow's output, indexes can be the tail end of out itself (see convertRow)
+void expandPalette(unsigned char* indexes, unsigned char* out, int width, int channels, PLTE* palette)
+{
+    int i = 0;
+
+    switch(channels){
+        case 1:
+            for(; i < width; i++) out[i] = palette->gray[2*indexes[i]];
+            break;
+        case 2:
+            for(; i < width; i++) memcpy(out + 2*i, palette->gray + 2*indexes[i], 2);
+            break;
+        case 3:
+#ifdef PNG_SIMD_X86_DISPATCH
+            if(__builtin_cpu_supports("avx2")) i = expandPaletteRGBAVX2(indexes, out, width, palette->packed);
+#endif
+            // each pixel is stored as 4 bytes and the next one overwrites the spare byte, except for the last
+            for(; i < width-1; i++) memcpy(out + 3*i, &palette->packed[indexes[i]], 4);
+            if(i < width) memcpy(out + 3*i, &palette->packed[indexes[i]], 3);
+            break;
+        case 4:
+#ifdef PNG_SIMD_X86_DISPATCH
+            if(__builtin_cpu_supports("avx2")) i = expandPaletteRGBAAVX2(indexes, out, width, palette->packed);
+#endif
+            for(; i < width; i++) memcpy(out + 4*i, &palette->packed[indexes[i]], 4);
+            break;
+    }
+}
+
+#ifdef PNG_SIMD_X86_DISPATCH
+// Gathers 8 colors at a time out of the packed palette. Returns how many pixels it did, leaving the rest
+__attribute__((target("avx2")))
+int expandPaletteRGBAAVX2(unsigned char* indexes, unsigned char* out, int width, unsigned int* packed)
+{
+    int i = 0;
+    for(; i + 8 <= width; i += 8){
+        __m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i*) (indexes+i)));
+        _mm256_storeu_si256((__m256i*) (out + 4*i), _mm256_i32gather_epi32((const int*) packed, index, 4));
+    }
+    return i;
+}
+
+// The same, then shuffles the alphas out of each half. Every store writes 4 spare bytes past its 12, which the
+// next one overwrites, so this stops far enough from the end not to write past it or over indexes it hasn't read
+__attribute__((target("avx2")))
+int expandPaletteRGBAVX2(unsigned char* indexes, unsigned char* out, int width, unsigned int* packed)
+{
+    __m256i drop_alpha = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                                          0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    int i = 0;
+    for(; i + 12 <= width; i += 8){
+        __m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i*) (indexes+i)));
+        __m256i rgb = _mm256_shuffle_epi8(_mm256_i32gather_epi32((const int*) packed, index, 4), drop_alpha);
+        _mm_storeu_si128((__m128i*) (out + 3*i), _mm256_castsi256_si128(rgb));
+        _mm_storeu_si128((__m128i*) (out + 3*i + 12), _mm256_extracti128_si256(rgb, 1));
+    }
+    return i;
+}
+#endif
+
+int channelsInFormat(int format)
+{
+    int channels[9] = {4, 1, 2, 3, 4, 1, 2, 3, 4};
+    return channels[format & ~PIX_PLANAR];
+}
+
+int bytesPerPixel(int format)
+{
+    format &= ~PIX_PLANAR;
+    if(format == PIX_FORMAT_PIX) return sizeof(Pix);
+    return channelsInFormat(format) * (format >= PIX_FORMAT_GRAY16 ? 2 : 1);
+}
+
+// Converts one unfiltered scanline into width pixels of the given format.
+// Layouts that match the PNG's own are copied straight across, everything else goes through RGBA
+void convertRow(unsigned char* row, unsigned char* out, int format, PNG* fpng)
+{
+    IHDR img_info = fpng->iheader;
+    PLTE color_indexes = fpng->palette;
+    TRNS transparency = fpng->transparency;
+
+    format &= ~PIX_PLANAR;
+    if(format == PIX_FORMAT_PIX){
+        expandRow(row, (Pix*) out, img_info, color_indexes);
+        return;
+    }
+
+    // samples smaller than a byte are unpacked into the end of out, which always has room for a byte per pixel,
+    // and then converted like any other 8 bit row. Converting runs front to back and never writes past the
+    // pixel it's reading, so it can't overwrite samples it hasn't read yet
+    if(img_info.bitd < 8){
+        unsigned char* unpacked = out + (long int) img_info.width*(bytesPerPixel(format)-1);
+        int gray = color_indexes.indexCount == 0;
+
+        unpackRow(row, unpacked, img_info.width, img_info.bitd, gray);
+        if(gray) transparency.key[0] = transparency.key[0]*255/((1 << img_info.bitd) - 1);
+        img_info.bitd = 8;
+        row = unpacked;
+    }
+
+    int wide = format >= PIX_FORMAT_GRAY16;
+    int out_channels = channelsInFormat(format);
+    int samples = img_info.width*img_info.channels;
+    unsigned short* out16 = (unsigned short*) out;
+
+    if(color_indexes.packed != NULL && !wide){
+        expandPalette(row, out, img_info.width, out_channels, &color_indexes);
+        return;
+    }
+
+    if(color_indexes.indexCount == 0 && out_channels == img_info.channels){
+        if(img_info.bitd == 8 && !wide){
+            if(out != row) memcpy(out, row, samples);
+            return;
+        }
+        if(img_info.bitd == 16 && wide){
+            for(int i = 0; i < samples; i++) out16[i] = (unsigned short) (row[2*i] << 8 | row[2*i+1]);
+            return;
+        }
+        if(img_info.bitd == 16){
+            for(int i = 0; i < samples; i++) out[i] = row[2*i];
+            return;
+        }
+    }
+
+    int src16 = img_info.bitd == 16 && color_indexes.indexCount == 0;
+    int opaque = src16 ? 0xffff : 0xff;
+    int rgba[4];
+    int src[4] = {0, 0, 0, 0};
+
+    for(int pixl = 0; pixl < img_info.width; pixl++){
+        if(color_indexes.indexCount != 0){
+            int idx = row[pixl] < color_indexes.indexCount ? row[pixl] : -1;
+            for(int chnl = 0; chnl < 4; chnl++) rgba[chnl] = idx < 0 ? 0 : color_indexes.indexes[idx].RGBA[chnl];
+            if(idx < 0) rgba[3] = 0xff;
+        }
+        else{
+            for(int chnl = 0; chnl < img_info.channels; chnl++){
+                int k = pixl*img_info.channels + chnl;
+                src[chnl] = src16 ? row[2*k] << 8 | row[2*k+1] : row[k];
+            }
+
+            if(img_info.channels <= 2){
+                rgba[0] = rgba[1] = rgba[2] = src[0];
+                rgba[3] = img_info.channels == 2 ? src[1] : opaque;
+                if(transparency.present && src[0] == transparency.key[0]) rgba[3] = 0;
+            }
+            else{
+                for(int chnl = 0; chnl < 3; chnl++) rgba[chnl] = src[chnl];
+                rgba[3] = img_info.channels == 4 ? src[3] : opaque;
+                if(transparency.present && src[0] == transparency.key[0] && src[1] == transparency.key[1] && src[2] == transparency.key[2]) rgba[3] = 0;
+            }
+        }
+
+        // widening an 8 bit sample is repeating the byte, narrowing a 16 bit one is keeping its high byte
+        for(int chnl = 0; chnl < 4; chnl++){
+            if(wide && !src16) rgba[chnl] *= 0x101;
+            else if(!wide && src16) rgba[chnl] >>= 8;
+        }
+
+        if(out_channels <= 2){
+            rgba[0] = (rgba[0]*77 + rgba[1]*150 + rgba[2]*29 + 128) >> 8;
+            rgba[1] = rgba[3];
+        }
+
+        for(int chnl = 0; chnl < out_channels; chnl++){
+            if(wide) out16[pixl*out_channels + chnl] = (unsigned short) rgba[chnl];
+            else out[pixl*out_channels + chnl] = (unsigned char) rgba[chnl];
+        }
+    }
+}
+
+// Splits one row of interleaved samples into the channel planes, plane_stride bytes apart
+void scatterToPlanes(unsigned char* interleaved, unsigned char* out, int width, int format, long int plane_stride)
+{
+    int channels = channelsInFormat(format);
+    int size = bytesPerPixel(format)/channels;
+
+    for(int chnl = 0; chnl < channels; chnl++){
+        unsigned char* plane = out + chnl*plane_stride;
+        for(int pixl = 0; pixl < width; pixl++){
+            memcpy(plane + pixl*size, interleaved + (pixl*channels + chnl)*size, size);
+        }
+    }
+}
+
+// Decodes the whole image in the given format into *out, allocating *out first if it's NULL.
+// Interleaved images are width*height*bytesPerPixel(format) bytes, row after row;
+// planar ones hold the same bytes as one width*height plane per channel
+int decodePixelsAs(PNGDecoder* decoder, PNG* fpng, int format, unsigned char** out)
+{
+    return decodeProgressive(decoder, fpng, format, out, NULL, NULL);
+}
+
+// decodePixelsAs, calling back after every pass of an interlaced image with a preview of the whole image so far,
+// where each pixel that's been decoded is stretched over the block of pixels it stands in for. Stopping after the
+// first pass or two only has to inflate and unfilter a small fraction of the image, and still returns PNG_OK.
+// Images that aren't interlaced only call back once, as pass 7, when they're done
+int decodeProgressive(PNGDecoder* decoder, PNG* fpng, int format, unsigned char** out, PassCallback callback, void* user)
+{
+    RowDecoder rd;
+    IHDR img_info = fpng->iheader;
+    long int row_bytes = (long int) img_info.width*bytesPerPixel(format);
+    unsigned char* row;
+    unsigned char* scratch_row = NULL;
+    unsigned char* allocated = NULL;
+    PNGArena* arena = getArena(decoder);
+    ArenaMark mark = markArena(arena);
+    statsClock(start);
+
+    if((double) row_bytes*img_info.height > (double) ((size_t) -1 >> 1)) return PNG_ERROR_MEMORY;
+
+    if(*out == NULL){
+        allocated = *out = (unsigned char*) malloc((size_t) row_bytes*img_info.height);
+        if(allocated == NULL) return PNG_ERROR_MEMORY;
+    }
+
+    // planar rows are converted here before they're split into planes, and interlaced ones before they're scattered
+    int status = startRowDecoder(&rd, decoder, fpng->chunks, fpng->index, img_info);
+    if(status == PNG_OK && ((format & PIX_PLANAR) || img_info.interlacem)){
+        scratch_row = (unsigned char*) allocScratch(arena, row_bytes);
+        if(scratch_row == NULL) status = PNG_ERROR_MEMORY;
+    }
+
+    if(status == PNG_OK && img_info.interlacem) status = decodePasses(&rd, fpng, format, *out, scratch_row, callback, user);
+    else if(status == PNG_OK){
+        for(int r = 0; r < img_info.height; r++){
+            row = decodeNextRow(&rd);
+            if(row == NULL){
+                status = PNG_ERROR_DATA;
+                break;
+            }
+
+            statsClock(since);
+            storeRow(row, r, fpng, format, *out, scratch_row);
+            statsStage(rd.stats, STAGE_EXPAND, since, row_bytes);
+        }
+        if(status == PNG_OK && callback != NULL) callback(7, *out, img_info, user);
+    }
+
+#ifdef PNG_STATS
+    // the row buffers, the conversion row and whatever inflated or arena space the decode needed on top
+    long long scratch = (long long) decoder->rowsSize + (scratch_row != NULL ? row_bytes : 0);
+    scratch += arena != NULL ? (long long) arena->peak : (rd.inflated != NULL ? inflatedSize(img_info) : 0);
+    if(scratch > decoder->stats.peakScratch) decoder->stats.peakScratch = scratch;
+#endif
+    endRowDecoder(&rd);
+    freeScratch(arena, scratch_row);
+    releaseArena(arena, mark);
+
+    if(status == PNG_OK){
+        statsStage(&decoder->stats, STAGE_DECODE, start, row_bytes*img_info.height);
+        decoder->stats.images++;
+    }
+    if(status != PNG_OK && allocated != NULL){
+        free(allocated);
+        *out = NULL;
+    }
+    return status;
+}
+
+// Decodes the passes of an interlaced image one after the other, converting each row of a pass into pass_row
+// and scattering it straight across its row of out, so out is filled in one row at a time rather than a pixel
+// here and there. With a callback each pixel is also copied over its block, to make the preview
+int decodePasses(RowDecoder* rd, PNG* fpng, int format, unsigned char* out, unsigned char* pass_row, PassCallback callback, void* user)
+{
+    PNG pass_png = *fpng; // the same, but as wide as the pass, which is all convertRow needs to know
+
+    for(int pass = 0; pass < 7; pass++){
+        if(!startPass(rd, pass)) continue;
+        pass_png.iheader.width = rd->info.width;
+
+        for(int r = 0; r < rd->info.height; r++){
+            unsigned char* row = decodeNextRow(rd);
+            if(row == NULL) return PNG_ERROR_DATA;
+
+            statsClock(since);
+            convertRow(row, pass_row, format, &pass_png);
+            scatterPassRow(pass_row, out, format, fpng->iheader, pass, r, callback != NULL);
+            statsStage(rd->stats, STAGE_EXPAND, since, (long long) rd->info.width*bytesPerPixel(format));
+        }
+
+        if(callback != NULL && callback(pass+1, out, fpng->iheader, user)) break;
+    }
+    return PNG_OK;
+}
+
+// Copies row r of a pass, already converted to format, to where its pixels go in out. With fill, each pixel
+// is copied over the rest of its block too
+void scatterPassRow(unsigned char* pass_row, unsigned char* out, int format, IHDR img_info, int pass, int r, int fill)
+{
+    Adam7Pass p = ADAM7[pass];
+    int pixel = bytesPerPixel(format);
+    int planes = (format & PIX_PLANAR) ? channelsInFormat(format) : 1;
+    int size = pixel/planes;                         // bytes per pixel in one plane
+    long int line = (long int) img_info.width*size;  // bytes per row of one plane
+    int y = p.y + r*p.dy;
+    int width = fill ? p.blockWidth : 1;
+    int height = fill ? (y + p.blockHeight > img_info.height ? img_info.height - y : p.blockHeight) : 1;
+
+    for(int plane = 0; plane < planes; plane++){
+        unsigned char* dest = out + plane*line*img_info.height + y*line;
+        unsigned char* src = pass_row + plane*size;
+
+        // the last pass has every pixel of its rows
+        if(p.dx == 1 && planes == 1) memcpy(dest, src, line);
+        else{
+            for(int x = p.x; x < img_info.width; x += p.dx, src += pixel){
+                int count = x + width > img_info.width ? img_info.width - x : width;
+                for(int k = 0; k < count; k++) memcpy(dest + (long int) (x+k)*size, src, size);
+            }
+        }
+
+        // before this pass the rows of its blocks only differ where earlier passes' blocks are, which are all
+        // at least as tall, so copying whole rows down is the same as copying each block down
+        for(int k = 1; k < height; k++) memcpy(dest + k*line, dest, line);
+    }
+}
+
+// A PassCallback that stops once *(int*) user passes are done
+int stopAfterPass(int pass, unsigned char* pixels, IHDR info, void* user)
+{
+    (void) pixels;
+    (void) info;
+    return pass >= *(int*) user;
+}
+
+// Converts unfiltered row r into its place in out, going through planar_row first for planar formats
+void storeRow(unsigned char* row, int r, PNG* fpng, int format, unsigned char* out, unsigned char* planar_row)
+{
+    IHDR img_info = fpng->iheader;
+    long int row_bytes = (long int) img_info.width*bytesPerPixel(format);
+
+    if(!(format & PIX_PLANAR)) convertRow(row, out + r*row_bytes, format, fpng);
+    else{
+        long int plane_row = row_bytes/channelsInFormat(format);
+
+        convertRow(row, planar_row, format, fpng);
+        scatterToPlanes(planar_row, out + r*plane_row, img_info.width, format, plane_row*img_info.height);
+    }
+}
+
+/* Region Decoding
+
+   decodeRegion decodes one rectangle of an image, optionally shrunk by 2, 4 or 8 with a box filter, for crops
+   and thumbnails that shouldn't cost as much as the whole image. Every row down to the bottom of the rectangle
+   still has to be inflated and unfiltered, since Up, Average and Paeth need the row above, but only the
+   rectangle's columns are converted and nothing below its last row is inflated at all. Boxes are summed as
+   the rows come in, so besides the output it only needs a couple of rows of memory.
+
+   Interlaced images are the exception: their rows are spread over all seven passes, so the rectangle is
+   gathered at full size first and only then shrunk, and only the last pass can stop early. Backends that
+   inflate the whole IDAT run at once (libdeflate) can't stop early either. */
+
+// Decodes region of the image in the given format (not PIX_FORMAT_PIX) into *out, allocating it first if it's NULL.
+// The output is *outWidth x *outHeight pixels: the region's size divided by its scale, rounded up, laid out like
+// decodePixelsAs's. Fails with PNG_ERROR_ARGUMENT if the region isn't inside the image or the scale isn't 1, 2, 4 or 8
+int decodeRegion(PNGDecoder* decoder, PNG* fpng, PNGRegion* region, int format, unsigned char** out, int* outWidth, int* outHeight)
+{
+    IHDR img_info = fpng->iheader;
+    RegionDecode rgn;
+    RowDecoder rd;
+    unsigned char* allocated = NULL;
+    unsigned char* gathered = NULL;
+    PNGArena* arena = getArena(decoder);
+    ArenaMark mark = markArena(arena);
+    statsClock(start);
+
+    int scale = region->scale;
+    if(region->x < 0 || region->y < 0 || region->x >= img_info.width || region->y >= img_info.height) return PNG_ERROR_ARGUMENT;
+    if(region->width < 0 || region->height < 0 || (scale != 1 && scale != 2 && scale != 4 && scale != 8)) return PNG_ERROR_ARGUMENT;
+    if((format & ~PIX_PLANAR) <= PIX_FORMAT_PIX || (format & ~PIX_PLANAR) > PIX_FORMAT_RGBA16) return PNG_ERROR_ARGUMENT;
+
+    memset(&rgn, 0, sizeof(RegionDecode));
+    rgn.png = fpng;
+    rgn.region = *region;
+    if(rgn.region.width == 0 || rgn.region.width > img_info.width - region->x) rgn.region.width = img_info.width - region->x;
+    if(rgn.region.height == 0 || rgn.region.height > img_info.height - region->y) rgn.region.height = img_info.height - region->y;
+    rgn.format = format & ~PIX_PLANAR;
+    rgn.planar = (format & PIX_PLANAR) != 0;
+    rgn.outWidth = (rgn.region.width + scale - 1)/scale;
+    rgn.outHeight = (rgn.region.height + scale - 1)/scale;
+
+    int pixel = bytesPerPixel(format);
+    long int row_bytes = (long int) rgn.outWidth*pixel;
+    if((double) row_bytes*rgn.outHeight > (double) ((size_t) -1 >> 1)) return PNG_ERROR_MEMORY;
+
+    if(*out == NULL){
+        allocated = *out = (unsigned char*) malloc((size_t) row_bytes*rgn.outHeight);
+        if(allocated == NULL) return PNG_ERROR_MEMORY;
+    }
+    rgn.out = *out;
+
+    // the span has room for the pixels in front of the region that share its first byte, at low bit depths
+    int status = startRowDecoder(&rd, decoder, fpng->chunks, fpng->index, img_info);
+    if(status == PNG_OK){
+        rgn.span = (unsigned char*) allocScratch(arena, (size_t) (rgn.region.width + 8)*pixel);
+        rgn.outRow = (unsigned char*) allocScratch(arena, row_bytes);
+        rgn.sums = (unsigned int*) allocScratch(arena, (size_t) rgn.outWidth*channelsInFormat(format)*sizeof(unsigned int));
+        if(rgn.span == NULL || rgn.outRow == NULL || rgn.sums == NULL) status = PNG_ERROR_MEMORY;
+        else memset(rgn.sums, 0, (size_t) rgn.outWidth*channelsInFormat(format)*sizeof(unsigned int));
+    }
+    if(status == PNG_OK && img_info.interlacem){
+        if((double) rgn.region.width*rgn.region.height*pixel > (double) ((size_t) -1 >> 1)) status = PNG_ERROR_MEMORY;
+        else gathered = (unsigned char*) allocScratch(arena, (size_t) rgn.region.width*rgn.region.height*pixel);
+        if(gathered == NULL) status = PNG_ERROR_MEMORY;
+    }
+
+    if(status == PNG_OK && img_info.interlacem) status = decodeRegionPasses(&rgn, &rd, gathered);
+    else if(status == PNG_OK) status = decodeRegionRows(&rgn, &rd);
+
+    endRowDecoder(&rd);
+    freeScratch(arena, gathered);
+    freeScratch(arena, rgn.sums);
+    freeScratch(arena, rgn.outRow);
+    freeScratch(arena, rgn.span);
+    releaseArena(arena, mark);
+
+    if(status == PNG_OK){
+        statsStage(&decoder->stats, STAGE_DECODE, start, row_bytes*rgn.outHeight);
+        decoder->stats.images++;
+        *outWidth = rgn.outWidth;
+        *outHeight = rgn.outHeight;
+    }
+    if(status != PNG_OK && allocated != NULL){
+        free(allocated);
+        *out = NULL;
+    }
+    return status;
+}
+
+// Unfilters every row down to the bottom of the region and stores the region's part of the ones inside it
+int decodeRegionRows(RegionDecode* rgn, RowDecoder* rd)
+{
+    PNGRegion region = rgn->region;
+    int bitd = rgn->png->iheader.bitd;
+    long int row_bytes = (long int) rgn->outWidth*bytesPerPixel(rgn->format);
+
+    // an unscaled interleaved crop is converted straight into place, unless its first pixel shares a byte
+    int direct = region.scale == 1 && !rgn->planar && (bitd >= 8 || region.x % (8/bitd) == 0);
+
+    for(int r = 0; r < region.y + region.height; r++){
+        unsigned char* row = decodeNextRow(rd);
+        if(row == NULL) return PNG_ERROR_DATA;
+        if(r < region.y) continue;
+
+        statsClock(since);
+        unsigned char* span = direct ? rgn->out + (r - region.y)*row_bytes : rgn->span;
+        unsigned char* pixels = convertColumns(row, span, rgn->format, rgn->png, region.x, region.width);
+        if(!direct) storeRegionRow(rgn, pixels, r - region.y);
+        statsStage(rd->stats, STAGE_EXPAND, since, row_bytes);
+    }
+    return PNG_OK;
+}
+
+// Gathers the region at full size from all seven passes into gathered, then stores it a row at a time
+int decodeRegionPasses(RegionDecode* rgn, RowDecoder* rd, unsigned char* gathered)
+{
+    PNGRegion region = rgn->region;
+    int pixel = bytesPerPixel(rgn->format);
+    long int line = (long int) region.width*pixel;
+
+    for(int pass = 0; pass < 7; pass++){
+        if(!startPass(rd, pass)) continue;
+        Adam7Pass p = ADAM7[pass];
+
+        // the pass's columns that land inside the region, first to last+1
+        int first = region.x > p.x ? (region.x - p.x + p.dx - 1)/p.dx : 0;
+        int last = passSize(region.x + region.width, p.x, p.dx);
+
+        for(int r = 0; r < rd->info.height; r++){
+            int y = p.y + r*p.dy;
+
+            // nothing further down this pass is needed, but the next pass's rows come after it
+            if(y >= region.y + region.height){
+                if(pass == 6) break;
+                if(!skipNextRow(rd)) return PNG_ERROR_DATA;
+                continue;
+            }
+
+            unsigned char* row = decodeNextRow(rd);
+            if(row == NULL) return PNG_ERROR_DATA;
+            if(y < region.y || first >= last) continue;
+
+            statsClock(since);
+            unsigned char* pixels = convertColumns(row, rgn->span, rgn->format, rgn->png, first, last - first);
+            unsigned char* dest = gathered + (y - region.y)*line + (long int) (p.x + first*p.dx - region.x)*pixel;
+            for(int i = first; i < last; i++, pixels += pixel, dest += p.dx*pixel) memcpy(dest, pixels, pixel);
+            statsStage(rd->stats, STAGE_EXPAND, since, (long long) (last - first)*pixel);
+        }
+    }
+
+    for(int r = 0; r < region.height; r++) storeRegionRow(rgn, gathered + r*line, r);
+    return PNG_OK;
+}
+
+// Converts count pixels of an unfiltered row, starting at first, into span. Pixels smaller than a byte can only be
+// picked out a whole byte at a time, so for those the span can start up to 7 pixels early.
+// Returns where pixel first ended up
+unsigned char* convertColumns(unsigned char* row, unsigned char* span, int format, PNG* fpng, int first, int count)
+{
+    PNG columns = *fpng; // the same, but only as wide as the columns, which is all convertRow needs to know
+    IHDR img_info = fpng->iheader;
+    int lead = img_info.bitd < 8 ? first % (8/img_info.bitd) : 0;
+
+    columns.iheader.width = lead + count;
+    convertRow(row + (((long int) (first - lead)*img_info.bitd*img_info.channels) >> 3), span, format, &columns);
+    return span + lead*bytesPerPixel(format);
+}
+
+// Takes row r of the region, converted, and either stores it or adds it into the boxes of the output row it's part of,
+// which is stored once its last row is in
+void storeRegionRow(RegionDecode* rgn, unsigned char* pixels, int r)
+{
+    PNGRegion region = rgn->region;
+    int scale = region.scale;
+
+    if(scale == 1){
+        storeOutputRow(rgn, pixels, r);
+        return;
+    }
+
+    int channels = channelsInFormat(rgn->format);
+    int wide = rgn->format >= PIX_FORMAT_GRAY16;
+    unsigned short* pixels16 = (unsigned short*) pixels;
+    unsigned int* sums = rgn->sums;
+
+    for(int x = 0; x < region.width; x++){
+        unsigned int* box = sums + (x/scale)*channels;
+        for(int chnl = 0; chnl < channels; chnl++) box[chnl] += wide ? pixels16[x*channels + chnl] : pixels[x*channels + chnl];
+    }
+    rgn->boxRows++;
+    if(rgn->boxRows < scale && r < region.height-1) return;
+
+    // boxes on the right and bottom edges can be short, so they're averaged over what they actually hold
+    unsigned short* row16 = (unsigned short*) rgn->outRow;
+    for(int x = 0; x < rgn->outWidth; x++){
+        int columns = x < rgn->outWidth-1 || region.width % scale == 0 ? scale : region.width % scale;
+        unsigned int count = (unsigned int) (columns*rgn->boxRows);
+
+        for(int chnl = 0; chnl < channels; chnl++){
+            unsigned int value = (sums[x*channels + chnl] + count/2)/count;
+            if(wide) row16[x*channels + chnl] = (unsigned short) value;
+            else rgn->outRow[x*channels + chnl] = (unsigned char) value;
+        }
+    }
+    storeOutputRow(rgn, rgn->outRow, r/scale);
+
+    memset(sums, 0, (size_t) rgn->outWidth*channels*sizeof(unsigned int));
+    rgn->boxRows = 0;
+}
+
+// Copies one finished row of output into place, splitting it into planes if that's what was asked for
+void storeOutputRow(RegionDecode* rgn, unsigned char* row, int y)
+{
+    long int row_bytes = (long int) rgn->outWidth*bytesPerPixel(rgn->format);
+
+    if(!rgn->planar) memcpy(rgn->out + y*row_bytes, row, row_bytes);
+    else{
+        long int plane_row = row_bytes/channelsInFormat(rgn->format);
+        scatterToPlanes(row, rgn->out + y*plane_row, rgn->outWidth, rgn->format, plane_row*rgn->outHeight);
+    }
+}
+
+// Reads a region from the command line, as x,y,width,height (0 for the rest of the image) or just x,y
+int getRegionFromArg(char* arg, PNGRegion* region)
+{
+    int count = sscanf(arg, "%d,%d,%d,%d", &region->x, &region->y, &region->width, &region->height);
+    if(count == 2) region->width = region->height = 0;
+    return count == 2 || count == 4;
+}
+
+/*
+Inflate backends:
+Every backend can inflate a whole zlib stream into a buffer of exactly the right size, which is always
+known up front from IHDR. Backends that can also inflate a bit at a time let RowDecoder keep only two rows
+in memory; ones that can't (libdeflate) get the whole IDAT run at once and the rows are unfiltered in place.
+*/
+void* startZlibInflate(void)
+{
+    z_stream* stream = (z_stream*) calloc(1, sizeof(z_stream));
+    if(inflateInit(stream) != Z_OK){
+        free(stream);
+        return NULL;
+    }
+    return stream;
+}
+
+int runZlibInflate(void* state, unsigned char** next_in, unsigned int* avail_in, unsigned char** next_out, unsigned int* avail_out)
+{
+    z_stream* stream = (z_stream*) state;
+    stream->next_in = *next_in;
+    stream->avail_in = *avail_in;
+    stream->next_out = *next_out;
+    stream->avail_out = *avail_out;
+
+    int ret = inflate(stream, Z_NO_FLUSH);
+
+    *next_in = stream->next_in;
+    *avail_in = stream->avail_in;
+    *next_out = stream->next_out;
+    *avail_out = stream->avail_out;
+
+    if(ret == Z_STREAM_END) return INFLATE_DONE;
+    return ret == Z_OK ? INFLATE_OK : INFLATE_ERROR;
+}
+
+int resetZlibInflate(void* state)
+{
+    return inflateReset((z_stream*) state) == Z_OK;
+}
+
+void endZlibInflate(void* state)
+{
+    inflateEnd((z_stream*) state);
+    free(state);
+}
+
+void* startRawZlibInflate(void)
+{
+    z_stream* stream = (z_stream*) calloc(1, sizeof(z_stream));
+    if(stream == NULL || inflateInit2(stream, -15) != Z_OK){
+        free(stream);
+        return NULL;
+    }
+    return stream;
+}
+
+// zlib sets 128 in data_type when it stopped at the start of a block, and adds on any bits of the last byte
+// it hasn't used yet, so exactly 128 means the next block starts on the next byte
+int boundaryZlibInflate(void* state)
+{
+    return ((z_stream*) state)->data_type == 128;
+}
+
+int wholeZlibInflate(void** state, unsigned char* in, long int in_len, unsigned char* out, long int out_len)
+{
+    (void) state;
+    uLongf size = out_len;
+    return uncompress(out, &size, in, in_len) == Z_OK && (long int) size == out_len;
+}
+
+#ifdef HAVE_ZLIBNG
+void* startZlibNGInflate(void)
+{
+    zng_stream* stream = (zng_stream*) calloc(1, sizeof(zng_stream));
+    if(zng_inflateInit(stream) != Z_OK){
+        free(stream);
+        return NULL;
+    }
+    return stream;
+}
+
+int runZlibNGInflate(void* state, unsigned char** next_in, unsigned int* avail_in, unsigned char** next_out, unsigned int* avail_out)
+{
+    zng_stream* stream = (zng_stream*) state;
+    stream->next_in = *next_in;
+    stream->avail_in = *avail_in;
+    stream->next_out = *next_out;
+    stream->avail_out = *avail_out;
+
+    int ret = zng_inflate(stream, Z_NO_FLUSH);
+
+    *next_in = (unsigned char*) stream->next_in;
+    *avail_in = stream->avail_in;
+    *next_out = stream->next_out;
+    *avail_out = stream->avail_out;
+
+    if(ret == Z_STREAM_END) return INFLATE_DONE;
+    return ret == Z_OK ? INFLATE_OK : INFLATE_ERROR;
+}
+
+int resetZlibNGInflate(void* state)
+{
+    return zng_inflateReset((zng_stream*) state) == Z_OK;
+}
+
+void endZlibNGInflate(void* state)
+{
+    zng_inflateEnd((zng_stream*) state);
+    free(state);
+}
+
+void* startRawZlibNGInflate(void)
+{
+    zng_stream* stream = (zng_stream*) calloc(1, sizeof(zng_stream));
+    if(stream == NULL || zng_inflateInit2(stream, -15) != Z_OK){
+        free(stream);
+        return NULL;
+    }
+    return stream;
+}
+
+int boundaryZlibNGInflate(void* state)
+{
+    return ((zng_stream*) state)->data_type == 128;
+}
+
+int wholeZlibNGInflate(void** state, unsigned char* in, long int in_len, unsigned char* out, long int out_len)
+{
+    (void) state;
+    size_t size = out_len;
+    return zng_uncompress(out, &size, in, in_len) == Z_OK && (long int) size == out_len;
+}
+#endif
+
+#ifdef HAVE_LIBDEFLATE
+// The decompressor is made on the first image and kept in *state after that, so only a NULL state pays for it every time
+int wholeLibdeflateInflate(void** state, unsigned char* in, long int in_len, unsigned char* out, long int out_len)
+{
+    struct libdeflate_decompressor* decompressor = state != NULL ? (struct libdeflate_decompressor*) *state : NULL;
+    if(decompressor == NULL) decompressor = libdeflate_alloc_decompressor();
+    if(decompressor == NULL) return 0;
+
+    // passing NULL for the actual size makes libdeflate insist the output is exactly out_len bytes
+    enum libdeflate_result ret = libdeflate_zlib_decompress(decompressor, in, in_len, out, out_len, NULL);
+    if(state != NULL) *state = decompressor;
+    else libdeflate_free_decompressor(decompressor);
+
+    return ret == LIBDEFLATE_SUCCESS;
+}
+
+void endLibdeflateInflate(void* state)
+{
+    libdeflate_free_decompressor((struct libdeflate_decompressor*) state);
+}
+#endif
+
+
+// Returns the backend with this name, or NULL if it wasn't built in
+InflateBackend* getInflateBackend(char* name)
+{
+    for(int i = 0; i < INFLATE_BACKEND_COUNT; i++){
+        if(strcmp(INFLATE_BACKENDS[i].name, name) == 0) return &INFLATE_BACKENDS[i];
+    }
+    return NULL;
+}
+
+// Glues the IDAT run into one buffer (from arena, if it isn't NULL) for the whole-buffer backends.
+// A single IDAT is just used where it is
+unsigned char* gatherIDAT(Chunk* chunks, ChunkIndex index, int* copied, PNGArena* arena)
+{
+    *copied = index.idatCount > 1;
+    if(!*copied) return chunks[index.idatFirst].data;
+
+    unsigned char* gathered = (unsigned char*) allocScratch(arena, index.idatLength);
+    if(gathered == NULL) return NULL;
+    long int offset = 0;
+    for(int j = index.idatFirst; j < index.idatFirst+index.idatCount; j++){
+        memcpy(gathered+offset, chunks[j].data, chunks[j].length);
+        offset += chunks[j].length;
+    }
+    return gathered;
+}
+
+// Times every built in backend inflating the same PNG and checks they all produce the same bytes.
+// Returns PNG_ERROR_DATA if any of them failed or came out different from the first one that worked
+int benchInflateBackends(char* path, int iterations)
+{
+    PNGDecoder decoder;
+    PNG fpng;
+
+    initDecoder(&decoder);
+    int status = readPNG(&decoder, path, &fpng);
+    freeDecoder(&decoder);
+    if(status != PNG_OK) return status;
+
+    // interlaced images inflate to every pass's rows, which inflatedSize knows how to add up
+    long int inflated_size = inflatedSize(fpng.iheader);
+
+    int copied;
+    unsigned char* compressed = gatherIDAT(fpng.chunks, fpng.index, &copied, NULL);
+    unsigned char* reference = NULL;
+    unsigned char* out = (unsigned char*) malloc(inflated_size);
+
+    if(compressed == NULL || out == NULL){
+        if(copied) free(compressed);
+        free(out);
+        freePNG(fpng);
+        return PNG_ERROR_MEMORY;
+    }
+
+    printf("%ld compressed bytes -> %ld inflated bytes, %d iterations\n", fpng.index.idatLength, inflated_size, iterations);
+
+    for(int i = 0; i < INFLATE_BACKEND_COUNT; i++){
+        InflateBackend* backend = &INFLATE_BACKENDS[i];
+        void* state = NULL;
+        int ok = 1;
+        double start = getWallSeconds();
+
+        for(int n = 0; n < iterations && ok; n++) ok = backend->whole(&state, compressed, fpng.index.idatLength, out, inflated_size);
+
+        double seconds = getWallSeconds() - start;
+        if(state != NULL) backend->endWhole(state);
+
+        if(ok && reference == NULL){
+            reference = out;
+            out = (unsigned char*) malloc(inflated_size);
+            if(out == NULL){
+                status = PNG_ERROR_MEMORY;
+                break;
+            }
+        }
+        else if(ok) ok = memcmp(reference, out, inflated_size) == 0;
+
+        if(!ok) status = PNG_ERROR_DATA;
+        if(!ok) printf("%-12s FAILED\n", backend->name);
+        else printf("%-12s %8.1f MB/s\n", backend->name, seconds > 0 ? inflated_size/1e6*iterations/seconds : 0.0);
+    }
+
+    if(copied) free(compressed);
+    free(reference);
+    free(out);
+    freePNG(fpng);
+    return status;
+}
+
+// The pull version of decodePNG: opens the PNG and reads its header, but leaves the pixels to be decoded
+// one row at a time with nextRow, so only a single row is ever held in memory. The reader borrows the
+// decoder until closeRowReader. On failure there's nothing to close
+int openRowReader(PNGDecoder* decoder, char* path, PNGRowReader* reader)
+{
+    return openRowReaderAs(decoder, path, reader, PIX_FORMAT_PIX);
+}
+
+int openRowReaderAs(PNGDecoder* decoder, char* path, PNGRowReader* reader, int format)
+{
+    reader->format = format;
+    reader->y = 0;
+    reader->row = NULL;
+    reader->interleaved = NULL;
+    reader->pixels = NULL;
+
+    reader->status = readPNG(decoder, path, &reader->png);
+    if(reader->status != PNG_OK) return reader->status;
+
+    PNGArena* arena = reader->png.arena;
+    long int row_bytes = (long int) reader->png.iheader.width*bytesPerPixel(format);
+    reader->row = allocScratch(arena, row_bytes);
+    if(format & PIX_PLANAR) reader->interleaved = (unsigned char*) allocScratch(arena, row_bytes);
+
+    if(reader->row == NULL || ((format & PIX_PLANAR) && reader->interleaved == NULL)) reader->status = PNG_ERROR_MEMORY;
+    else reader->status = startRowDecoder(&reader->decoder, decoder, reader->png.chunks, reader->png.index, reader->png.iheader);
+
+    if(reader->status == PNG_OK && reader->png.iheader.interlacem){
+        reader->pixels = (unsigned char*) allocScratch(arena, (size_t) row_bytes*reader->png.iheader.height);
+        if(reader->pixels == NULL) reader->status = PNG_ERROR_MEMORY;
+        else reader->status = decodePasses(&reader->decoder, &reader->png, format & ~PIX_PLANAR, reader->pixels, (unsigned char*) reader->row, NULL, NULL);
+        endRowDecoder(&reader->decoder);
+    }
+
+    if(reader->status != PNG_OK){
+        freeScratch(arena, reader->row);
+        freeScratch(arena, reader->interleaved);
+        freeScratch(arena, reader->pixels);
+        freePNG(reader->png);
+    }
+    return reader->status;
+}
+
+// Returns the next row of pixels from top to bottom, or NULL once the last row has been read or if the
+// image data is broken, which reader->status tells apart. The returned row is overwritten by the next call
+void* nextRow(PNGRowReader* reader)
+{
+    if(reader->status != PNG_OK || reader->y >= reader->png.iheader.height) return NULL;
+    long int row_bytes = (long int) reader->png.iheader.width*bytesPerPixel(reader->format);
+
+    if(reader->pixels != NULL){
+        unsigned char* row = reader->pixels + reader->y*row_bytes;
+        reader->y++;
+        if(!(reader->format & PIX_PLANAR)) return row;
+
+        scatterToPlanes(row, reader->row, reader->png.iheader.width, reader->format, row_bytes/channelsInFormat(reader->format));
+        return reader->row;
+    }
+
+    unsigned char* row = decodeNextRow(&reader->decoder);
+    if(row == NULL){
+        reader->status = PNG_ERROR_DATA;
+        return NULL;
+    }
+    reader->y++;
+
+    statsClock(since);
+    if(!(reader->format & PIX_PLANAR)) convertRow(row, reader->row, reader->format, &reader->png);
+    else{
+        // a planar row is each channel's run of samples, one after the other
+        convertRow(row, reader->interleaved, reader->format, &reader->png);
+        scatterToPlanes(reader->interleaved, reader->row, reader->png.iheader.width, reader->format, row_bytes/channelsInFormat(reader->format));
+    }
+    statsStage(reader->decoder.stats, STAGE_EXPAND, since, row_bytes);
+    return reader->row;
+}
+
+void closeRowReader(PNGRowReader* reader)
+{
+    endRowDecoder(&reader->decoder);
+    freeScratch(reader->png.arena, reader->row);
+    freeScratch(reader->png.arena, reader->interleaved);
+    freeScratch(reader->png.arena, reader->pixels);
+    freePNG(reader->png);
+}
+
+// The push version of decodePNG: calls back once per row instead of building PNG.pixels
+int decodeRowsFromPath(PNGDecoder* decoder, char* path, RowCallback callback, void* user)
+{
+    return decodeRowsFromPathAs(decoder, path, PIX_FORMAT_PIX, callback, user);
+}
+
+int decodeRowsFromPathAs(PNGDecoder* decoder, char* path, int format, RowCallback callback, void* user)
+{
+    PNGRowReader reader;
+    void* row;
+    int y = 0;
+
+    if(openRowReaderAs(decoder, path, &reader, format) != PNG_OK) return reader.status;
+
+    while((row = nextRow(&reader)) != NULL){
+        y++;
+        if(callback(row, y-1, reader.png.iheader, user)) break;
+    }
+
+    int status = reader.status;
+    closeRowReader(&reader);
+    return status;
+}
+
+/*
+Batch decoding:
+Every worker thread has its own PNGDecoder (using its arena) and output buffer, which it reuses from one file
+to the next, and its own range of the path list. A worker takes paths from the front of its range, and once it runs out
+it steals the back half of whichever other worker has the most left. Files are big units of work compared
+to taking a lock, so the ranges are just guarded by a mutex each.
+*/
+int decodeBatch(char** paths, int pathCount, int format, int threads, PNGDecoder* config, BatchCallback callback, void* user)
+{
+    if(pathCount < 0 || callback == NULL) return PNG_ERROR_ARGUMENT;
+    if(threads <= 0) threads = getCoreCount();
+    if(threads > pathCount) threads = pathCount > 0 ? pathCount : 1;
+
+    PNGBatch batch;
+    batch.paths = paths;
+    batch.format = format;
+    batch.callback = callback;
+    batch.user = user;
+    batch.stopped = 0;
+    batch.workerCount = threads;
+    batch.workers = (BatchWorker*) calloc(threads, sizeof(BatchWorker));
+    if(batch.workers == NULL) return PNG_ERROR_MEMORY;
+    initMutex(&batch.lock);
+
+    for(int i = 0; i < threads; i++){
+        BatchWorker* worker = &batch.workers[i];
+        worker->batch = &batch;
+        worker->id = i;
+        worker->next = (int) ((long int) pathCount*i/threads);
+        worker->end = (int) ((long int) pathCount*(i+1)/threads);
+
+        // a PNG only has to last until the callback returns, so each one can live in its worker's arena
+        initDecoder(&worker->decoder);
+        worker->decoder.flags = PNG_USE_ARENA;
+        if(config != NULL){
+            worker->decoder.flags |= config->flags;
+            worker->decoder.backend = config->backend;
+            worker->decoder.cache = config->cache;
+        }
+        initMutex(&worker->lock);
+    }
+
+    // the calling thread is worker 0, so a batch with one thread doesn't start any. If a thread can't be
+    // started its paths just get stolen by the workers that were
+    int started = 1;
+    for(; started < threads; started++){
+        if(!startThread(&batch.workers[started].thread, runBatchWorker, &batch.workers[started])) break;
+    }
+    runBatchWorker(&batch.workers[0]);
+
+    for(int i = 1; i < started; i++) joinThread(batch.workers[i].thread);
+
+    // the workers' stats all end up in config's, so a batch reports like one decoder that did everything
+    for(int i = 0; i < threads; i++){
+        if(config != NULL) addStats(&config->stats, &batch.workers[i].decoder.stats);
+        freeDecoder(&batch.workers[i].decoder);
+        free(batch.workers[i].out);
+        freeMutex(&batch.workers[i].lock);
+    }
+    freeMutex(&batch.lock);
+    free(batch.workers);
+
+    return PNG_OK;
+}
+
+void runBatchWorker(void* arg)
+{
+    BatchWorker* worker = (BatchWorker*) arg;
+    PNGBatch* batch = worker->batch;
+    int index;
+
+    while((index = takeBatchPath(worker)) >= 0){
+        PNG fpng;
+        unsigned char* pixels = NULL;
+        CacheEntry* cached = NULL;
+        int status = readPNG(&worker->decoder, batch->paths[index], &fpng);
+
+        if(status == PNG_OK && worker->decoder.cache != NULL){
+            status = decodeCached(&worker->decoder, &fpng, batch->format, &cached);
+            if(status == PNG_OK) pixels = cached->pixels;
+        }
+        else if(status == PNG_OK){
+            size_t needed = (size_t) fpng.iheader.width*fpng.iheader.height*bytesPerPixel(batch->format);
+
+            // the output buffer only ever grows, so once the worker has seen its biggest image it stops allocating
+            if(needed > worker->outSize){
+                free(worker->out);
+                worker->out = (unsigned char*) malloc(needed);
+                worker->outSize = worker->out == NULL ? 0 : needed;
+            }
+
+            if(worker->out == NULL) status = PNG_ERROR_MEMORY;
+            else{
+                pixels = worker->out;
+                status = decodePixelsAs(&worker->decoder, &fpng, batch->format, &pixels);
+            }
+        }
+
+        int stop = batch->callback(index, batch->paths[index], status, &fpng, status == PNG_OK ? pixels : NULL, batch->user);
+        if(status == PNG_OK) freePNG(fpng);
+        if(cached != NULL) releaseCached(worker->decoder.cache, cached);
+
+        if(stop){
+            lockMutex(&batch->lock);
+            batch->stopped = 1;
+            unlockMutex(&batch->lock);
+        }
+    }
+}
+
+// Hands the worker its next path, stealing one if it has none left. Returns -1 once every path is taken
+int takeBatchPath(BatchWorker* worker)
+{
+    PNGBatch* batch = worker->batch;
+    int index = -1;
+
+    lockMutex(&batch->lock);
+    int stopped = batch->stopped;
+    unlockMutex(&batch->lock);
+    if(stopped) return -1;
+
+    lockMutex(&worker->lock);
+    if(worker->next < worker->end) index = worker->next++;
+    unlockMutex(&worker->lock);
+
+    while(index < 0){
+        BatchWorker* victim = NULL;
+        int most = 0;
+
+        for(int i = 1; i < batch->workerCount; i++){
+            BatchWorker* other = &batch->workers[(worker->id + i) % batch->workerCount];
+
+            lockMutex(&other->lock);
+            int left = other->end - other->next;
+            unlockMutex(&other->lock);
+
+            if(left > most){
+                most = left;
+                victim = other;
+            }
+        }
+        if(victim == NULL) return -1;
+
+        // take the back half, leaving the victim the files it's about to get to
+        int first, last;
+        lockMutex(&victim->lock);
+        int left = victim->end - victim->next;
+        last = victim->end;
+        first = victim->end - (left+1)/2;
+        victim->end = first;
+        unlockMutex(&victim->lock);
+
+        // someone else got there first, look again
+        if(left <= 0) continue;
+
+        lockMutex(&worker->lock);
+        index = first;
+        worker->next = first+1;
+        worker->end = last;
+        unlockMutex(&worker->lock);
+    }
+
+    return index;
+}
+
+/* Decoded Pixel Cache
+
+   Every chunk already carries a CRC of its contents, so an image's decoded pixels are fully determined by its
+   IHDR, PLTE, tRNS and IDAT chunks' CRCs, and the format they're decoded into. A PNGCache keys decoded images on
+   exactly that, which costs nothing beyond the CRC check readPNG does anyway, and keeps them in an LRU list under
+   a memory budget. Given a directory it also writes each decoded image there and maps it back in on a later
+   miss, so the cache outlives the process and is shared by everything pointed at the same directory.
+
+   The key trusts the CRCs the file claims, which is what makes it free: two files with the same chunks but
+   different pixels would need the same CRCs for every one of them, which doesn't happen by accident. */
+
+// Sets up an empty cache holding up to budget bytes of pixels (0 for CACHE_DEFAULT_BUDGET), and
+// if directory isn't NULL, backed by files in it. The directory has to exist already
+int initCache(PNGCache* cache, size_t budget, char* directory)
+{
+    memset(cache, 0, sizeof(PNGCache));
+    cache->budget = budget > 0 ? budget : CACHE_DEFAULT_BUDGET;
+    cache->bucketCount = CACHE_MIN_BUCKETS;
+    cache->buckets = (CacheEntry**) calloc(cache->bucketCount, sizeof(CacheEntry*));
+    if(directory != NULL) cache->directory = (char*) malloc(strlen(directory)+1);
+    if(cache->buckets == NULL || (directory != NULL && cache->directory == NULL)){
+        free(cache->buckets);
+        free(cache->directory);
+        return PNG_ERROR_MEMORY;
+    }
+    if(directory != NULL) strcpy(cache->directory, directory);
+
+    initMutex(&cache->lock);
+    return PNG_OK;
+}
+
+// Frees every entry, which must all have been released by now. The files in the directory are left for next time
+void freeCache(PNGCache* cache)
+{
+    CacheEntry* entry = cache->newest;
+    while(entry != NULL){
+        CacheEntry* older = entry->older;
+        freeCacheEntry(entry);
+        entry = older;
+    }
+
+    free(cache->buckets);
+    free(cache->directory);
+    freeMutex(&cache->lock);
+    memset(cache, 0, sizeof(PNGCache));
+}
+
+// The key for a PNG decoded into format, from the CRCs readPNG has already checked
+CacheKey getCacheKey(PNG* fpng, int format)
+{
+    CacheKey key;
+    ChunkIndex index = fpng->index;
+    int others[3] = {index.ihdr, index.plte, index.trns};
+
+    // keys are compared with memcmp, so the padding has to match too
+    memset(&key, 0, sizeof(CacheKey));
+    key.hash = 0xcbf29ce484222325ULL;
+    for(int i = 0; i < 3; i++){
+        if(others[i] < 0) key.hash = mixCacheHash(key.hash, 0);
+        else key.hash = mixCacheHash(key.hash, bytesToInt(fpng->chunks[others[i]].crc[0], fpng->chunks[others[i]].crc[1], fpng->chunks[others[i]].crc[2], fpng->chunks[others[i]].crc[3]));
+    }
+
+    // the IDATs' lengths go in too, since the same stream can be split up differently
+    for(int i = index.idatFirst; i < index.idatFirst + index.idatCount; i++){
+        Chunk* idat = &fpng->chunks[i];
+        key.hash = mixCacheHash(key.hash, bytesToInt(idat->crc[0], idat->crc[1], idat->crc[2], idat->crc[3]));
+        key.hash = mixCacheHash(key.hash, (unsigned long) idat->length);
+    }
+
+    key.idatLength = index.idatLength;
+    key.width = fpng->iheader.width;
+    key.height = fpng->iheader.height;
+    key.format = format;
+    return key;
+}
+
+// Folds one 32 bit value into a cache key's hash
+unsigned long long mixCacheHash(unsigned long long hash, unsigned long value)
+{
+    hash = (hash ^ (value & 0xffffffffUL)) * 0x9e3779b97f4a7c15ULL;
+    return hash ^ (hash >> 29);
+}
+
+// Hands out fpng's pixels in the given format from decoder->cache, decoding them (and adding them to it) only if
+// they aren't there yet. The pixels are laid out like decodePixelsAs's, belong to the cache, and are read-only.
+// They stay valid until the entry is given back with releaseCached
+int decodeCached(PNGDecoder* decoder, PNG* fpng, int format, CacheEntry** result)
+{
+    PNGCache* cache = decoder->cache;
+    CacheKey key = getCacheKey(fpng, format);
+    *result = NULL;
+    if(cache == NULL) return PNG_ERROR_ARGUMENT;
+
+    lockMutex(&cache->lock);
+    CacheEntry* entry = findCached(cache, key);
+    if(entry != NULL){
+        entry->users++;
+        cache->hits++;
+    }
+    else cache->misses++;
+    unlockMutex(&cache->lock);
+
+    if(entry != NULL){
+        *result = entry;
+        return PNG_OK;
+    }
+
+    entry = (CacheEntry*) calloc(1, sizeof(CacheEntry));
+    if(entry == NULL) return PNG_ERROR_MEMORY;
+    entry->key = key;
+    entry->size = (size_t) key.width*key.height*bytesPerPixel(format);
+    entry->users = 1;
+
+    // another process may already have decoded it into the directory, otherwise decode it and leave it there too
+    int status = PNG_OK;
+    if(!mapCachedFile(cache, entry)){
+        status = decodePixelsAs(decoder, fpng, format, &entry->pixels);
+        if(status == PNG_OK) writeCachedFile(cache, entry);
+    }
+    if(status != PNG_OK){
+        free(entry);
+        return status;
+    }
+
+    // addCached hands back the entry that's already there if another thread got in first
+    lockMutex(&cache->lock);
+    if(entry->mapped) cache->loads++;
+    *result = addCached(cache, entry);
+    unlockMutex(&cache->lock);
+    if(*result != entry) freeCacheEntry(entry);
+    return PNG_OK;
+}
+
+// Gives back an entry from decodeCached, which can then be evicted once it's the least recently used
+void releaseCached(PNGCache* cache, CacheEntry* entry)
+{
+    if(entry == NULL) return;
+
+    lockMutex(&cache->lock);
+    entry->users--;
+    int uncached = !entry->cached && entry->users == 0;
+    if(entry->cached) evictCached(cache);
+    unlockMutex(&cache->lock);
+
+    if(uncached) freeCacheEntry(entry);
+}
+
+// Looks key up and makes it the most recently used entry. The cache has to be locked
+CacheEntry* findCached(PNGCache* cache, CacheKey key)
+{
+    CacheEntry* entry = cache->buckets[key.hash & (cache->bucketCount-1)];
+    while(entry != NULL && memcmp(&entry->key, &key, sizeof(CacheKey)) != 0) entry = entry->next;
+    if(entry == NULL || entry == cache->newest) return entry;
+
+    entry->newer->older = entry->older;
+    if(entry->older != NULL) entry->older->newer = entry->newer;
+    else cache->oldest = entry->newer;
+
+    entry->newer = NULL;
+    entry->older = cache->newest;
+    cache->newest->newer = entry;
+    cache->newest = entry;
+    return entry;
+}
+
+// Adds an entry as the most recently used, unless one with the same key got there first, in which case that one is
+// returned instead (with another user) and the new one is left to be freed. The cache has to be locked
+CacheEntry* addCached(PNGCache* cache, CacheEntry* entry)
+{
+    CacheEntry* existing = findCached(cache, entry->key);
+    if(existing != NULL){
+        existing->users++;
+        return existing;
+    }
+
+    // an image bigger than the whole budget is handed out as it is, and freed when it's released
+    if(entry->size > cache->budget) return entry;
+
+    // keep the chains short by doubling the buckets once there are as many entries
+    if(cache->count >= cache->bucketCount){
+        CacheEntry** buckets = (CacheEntry**) calloc((size_t) cache->bucketCount*2, sizeof(CacheEntry*));
+        if(buckets != NULL){
+            for(CacheEntry* moved = cache->newest; moved != NULL; moved = moved->older){
+                CacheEntry** bucket = &buckets[moved->key.hash & (cache->bucketCount*2-1)];
+                moved->next = *bucket;
+                *bucket = moved;
+            }
+            free(cache->buckets);
+            cache->buckets = buckets;
+            cache->bucketCount *= 2;
+        }
+    }
+
+    CacheEntry** bucket = &cache->buckets[entry->key.hash & (cache->bucketCount-1)];
+    entry->next = *bucket;
+    *bucket = entry;
+
+    entry->cached = 1;
+    entry->newer = NULL;
+    entry->older = cache->newest;
+    if(cache->newest != NULL) cache->newest->newer = entry;
+    else cache->oldest = entry;
+    cache->newest = entry;
+
+    cache->count++;
+    cache->used += entry->size;
+    evictCached(cache);
+    return entry;
+}
+
+// Frees the least recently used entries nobody is using until the cache fits its budget. The cache has to be locked
+void evictCached(PNGCache* cache)
+{
+    CacheEntry* entry = cache->oldest;
+    while(cache->used > cache->budget && entry != NULL){
+        CacheEntry* newer = entry->newer;
+        if(entry->users == 0){
+            unlinkCached(cache, entry);
+            freeCacheEntry(entry);
+        }
+        entry = newer;
+    }
+}
+
+// Takes an entry out of the hash table and the LRU list. The cache has to be locked
+void unlinkCached(PNGCache* cache, CacheEntry* entry)
+{
+    CacheEntry** link = &cache->buckets[entry->key.hash & (cache->bucketCount-1)];
+    while(*link != entry) link = &(*link)->next;
+    *link = entry->next;
+
+    if(entry->newer != NULL) entry->newer->older = entry->older;
+    else cache->newest = entry->older;
+    if(entry->older != NULL) entry->older->newer = entry->newer;
+    else cache->oldest = entry->newer;
+
+    cache->count--;
+    cache->used -= entry->size;
+}
+
+void freeCacheEntry(CacheEntry* entry)
+{
+    if(entry->mapped) unmapBytes(entry->pixels, (long int) entry->size);
+    else free(entry->pixels);
+    free(entry);
+}
+
+// Where an entry's pixels live in the cache directory, or NULL if there isn't one. The path has to be freed
+char* getCachePath(PNGCache* cache, CacheKey key)
+{
+    if(cache->directory == NULL) return NULL;
+
+    size_t length = strlen(cache->directory) + 80;
+    char* path = (char*) malloc(length);
+    if(path != NULL){
+        snprintf(path, length, "%s/%016llx-%dx%d-%d-%ld.pix", cache->directory, key.hash, key.width, key.height, key.format, key.idatLength);
+    }
+    return path;
+}
+
+// Maps an entry's pixels in from the cache directory. Returns 0 if they aren't there (or are the wrong size)
+int mapCachedFile(PNGCache* cache, CacheEntry* entry)
+{
+    char* path = getCachePath(cache, entry->key);
+    if(path == NULL) return 0;
+
+    long int length = 0;
+    unsigned char* pixels = NULL;
+    int mapped = mapBytesFromPath(path, &length, &pixels);
+    free(path);
+    if(!mapped) return 0;
+
+    if((size_t) length != entry->size){
+        unmapBytes(pixels, length);
+        return 0;
+    }
+    entry->pixels = pixels;
+    entry->mapped = 1;
+    return 1;
+}
+
+// Writes an entry's pixels to the cache directory, under a temporary name first so nobody maps half a file.
+// Not being able to is only a missed chance for next time, so it's not an error
+int writeCachedFile(PNGCache* cache, CacheEntry* entry)
+{
+    char* path = getCachePath(cache, entry->key);
+    if(path == NULL) return 0;
+
+    size_t length = strlen(path) + 32;
+    char* temporary = (char*) malloc(length);
+    FILE* file = NULL;
+    int written = 0;
+
+    if(temporary != NULL){
+        snprintf(temporary, length, "%s.%llx.tmp", path, (unsigned long long) getNanoseconds() ^ (unsigned long long) (size_t) entry);
+        file = fopen(temporary, "wb");
+    }
+    if(file != NULL){
+        written = fwrite(entry->pixels, 1, entry->size, file) == entry->size;
+        written = fclose(file) == 0 && written;
+        if(written) written = rename(temporary, path) == 0;
+        if(!written) remove(temporary);
+    }
+
+    free(temporary);
+    free(path);
+    return written;
+}
+
+int getCoreCount(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (int) info.dwNumberOfProcessors : 1;
+#else
+    long int cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? (int) cores : 1;
+#endif
+}
+
+// Seconds on a clock that keeps going while we wait, unlike clock() which only counts CPU time
+double getWallSeconds(void)
+{
+    return getNanoseconds()/1e9;
+}
+
+// The monotonic clock everything is timed with, in nanoseconds
+long long getNanoseconds(void)
+{
+#ifdef _WIN32
+    // the frequency is fixed at boot, so it's only asked for once. Whole seconds and the rest are scaled
+    // separately, since the counter times 1e9 would overflow after a few weeks of uptime
+    static LONGLONG frequency = 0;
+    LARGE_INTEGER now;
+    if(frequency == 0){
+        LARGE_INTEGER asked;
+        QueryPerformanceFrequency(&asked);
+        frequency = asked.QuadPart;
+    }
+    QueryPerformanceCounter(&now);
+    return (long long) (now.QuadPart/frequency)*1000000000LL + (long long) (now.QuadPart%frequency)*1000000000LL/frequency;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec*1000000000LL + now.tv_nsec;
+#endif
+}
+
+// Adds the time since since, and size bytes, to a stage. Returns the time now so the next stage can start from it
+long long addStageStats(PNGStats* stats, int stage, long long since, long long size)
+{
+    long long now = getNanoseconds();
+    stats->nanoseconds[stage] += now-since;
+    stats->bytes[stage] += size;
+    return now;
+}
+
+// Adds one decoder's stats into another's, as a batch does with its workers
+void addStats(PNGStats* total, PNGStats* stats)
+{
+    for(int s = 0; s < STAGE_COUNT; s++){
+        total->nanoseconds[s] += stats->nanoseconds[s];
+        total->bytes[s] += stats->bytes[s];
+    }
+    for(int f = 0; f < 5; f++) total->filterRows[f] += stats->filterRows[f];
+    total->images += stats->images;
+    if(stats->peakScratch > total->peakScratch) total->peakScratch = stats->peakScratch;
+}
+
+// Writes stats as one JSON object: time, bytes and throughput per stage, rows per filter type and peak scratch
+void writeStatsJSON(FILE* file, PNGStats* stats)
+{
+    static const char* stages[STAGE_COUNT] = {"read", "parse", "crc", "inflate", "unfilter", "expand", "decode"};
+    static const char* filters[5] = {"none", "sub", "up", "average", "paeth"};
+
+    fprintf(file, "{\n  \"images\": %lld,\n  \"stages\": {\n", stats->images);
+    for(int s = 0; s < STAGE_COUNT; s++){
+        double mbps = stats->nanoseconds[s] > 0 ? stats->bytes[s]*1e3/stats->nanoseconds[s] : 0;
+        fprintf(file, "    \"%s\": {\"ns\": %lld, \"bytes\": %lld, \"MBps\": %.1f}%s\n", stages[s],
+            stats->nanoseconds[s], stats->bytes[s], mbps, s < STAGE_COUNT-1 ? "," : "");
+    }
+    fprintf(file, "  },\n  \"filters\": {");
+    for(int f = 0; f < 5; f++) fprintf(file, "\"%s\": %lld%s", filters[f], stats->filterRows[f], f < 4 ? ", " : "");
+    fprintf(file, "},\n  \"peakScratchBytes\": %lld\n}\n", stats->peakScratch);
+}
+
+// Writes stats as JSON to path, or to stdout if path is "-"
+int writeStatsToPath(char* path, PNGStats* stats)
+{
+    if(strcmp(path, "-") == 0){
+        writeStatsJSON(stdout, stats);
+        return PNG_OK;
+    }
+
+    FILE* file = fopen(path, "w");
+    if(file == NULL) return PNG_ERROR_IO;
+    writeStatsJSON(file, stats);
+    return fclose(file) == 0 ? PNG_OK : PNG_ERROR_IO;
+}
+
+// Runs jobs 0 to count-1 through run(context, job), on the calling thread and up to threads-1 more.
+// Stops handing out jobs once one fails, and returns that job's status
+int runJobs(int threads, int count, int (*run)(void*, int), void* context)
+{
+    JobQueue queue;
+    PNGThread* workers = (PNGThread*) malloc(sizeof(PNGThread)*(threads > 1 ? threads : 1));
+    int started = 0;
+
+    queue.run = run;
+    queue.context = context;
+    queue.next = 0;
+    queue.count = count;
+    queue.status = PNG_OK;
+    initMutex(&queue.lock);
+
+    for(int i = 1; i < threads && i < count && workers != NULL; i++){
+        if(!startThread(&workers[started], runJobWorker, &queue)) break;
+        started++;
+    }
+    runJobWorker(&queue);
+
+    for(int i = 0; i < started; i++) joinThread(workers[i]);
+    free(workers);
+    freeMutex(&queue.lock);
+
+    return queue.status;
+}
+
+void runJobWorker(void* arg)
+{
+    JobQueue* queue = (JobQueue*) arg;
+
+    while(1){
+        lockMutex(&queue->lock);
+        int job = queue->status == PNG_OK ? queue->next++ : queue->count;
+        unlockMutex(&queue->lock);
+        if(job >= queue->count) return;
+
+        int status = queue->run(queue->context, job);
+        if(status != PNG_OK){
+            lockMutex(&queue->lock);
+            queue->status = status;
+            unlockMutex(&queue->lock);
+        }
+    }
+}
+
+// Runs function(arg) on a new thread
+int startThread(PNGThread* thread, void (*function)(void*), void* arg)
+{
+    ThreadStart* start = (ThreadStart*) malloc(sizeof(ThreadStart));
+    if(start == NULL) return 0;
+
+    start->function = function;
+    start->arg = arg;
+
+#ifdef _WIN32
+    *thread = CreateThread(NULL, 0, threadEntry, start, 0, NULL);
+    if(*thread != NULL) return 1;
+#else
+    if(pthread_create(thread, NULL, threadEntry, start) == 0) return 1;
+#endif
+    free(start);
+    return 0;
+}
+
+#ifdef _WIN32
+DWORD WINAPI threadEntry(LPVOID arg)
+#else
+void* threadEntry(void* arg)
+#endif
+{
+    ThreadStart start = *(ThreadStart*) arg;
+    free(arg);
+
+    start.function(start.arg);
+    return 0;
+}
+
+void joinThread(PNGThread thread)
+{
+#ifdef _WIN32
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+#else
+    pthread_join(thread, NULL);
+#endif
+}
+
+// Adds path to the list, or every .png file directly inside it if it's a directory. The list and every
+// path in it are malloc'd; free them with freePaths
+int addPathsFromPath(char* path, char*** paths, int* pathCount)
+{
+#ifdef _WIN32
+    WIN32_FIND_DATAA found;
+    DWORD attributes = GetFileAttributesA(path);
+    if(attributes == INVALID_FILE_ATTRIBUTES || !(attributes & FILE_ATTRIBUTE_DIRECTORY)) return addPath(path, "", paths, pathCount);
+
+    char* pattern = (char*) malloc(strlen(path) + 8);
+    if(pattern == NULL) return PNG_ERROR_MEMORY;
+    sprintf(pattern, "%s\\*.png", path);
+
+    HANDLE search = FindFirstFileA(pattern, &found);
+    free(pattern);
+    if(search == INVALID_HANDLE_VALUE) return PNG_OK;
+
+    int status = PNG_OK;
+    do{
+        if(!(found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) status = addPath(path, found.cFileName, paths, pathCount);
+    }while(status == PNG_OK && FindNextFileA(search, &found));
+
+    FindClose(search);
+    return status;
+#else
+    struct stat info;
+    if(stat(path, &info) != 0 || !S_ISDIR(info.st_mode)) return addPath(path, "", paths, pathCount);
+
+    DIR* dir = opendir(path);
+    if(dir == NULL) return PNG_ERROR_IO;
+
+    int status = PNG_OK;
+    struct dirent* entry;
+    while(status == PNG_OK && (entry = readdir(dir)) != NULL){
+        size_t length = strlen(entry->d_name);
+        if(length > 4 && strcasecmp(entry->d_name + length - 4, ".png") == 0) status = addPath(path, entry->d_name, paths, pathCount);
+    }
+
+    closedir(dir);
+    return status;
+#endif
+}
+
+// Appends dir and name joined by a separator (or just dir, if name is empty) to the list
+int addPath(char* dir, char* name, char*** paths, int* pathCount)
+{
+    // the list grows in powers of two
+    if((*pathCount & (*pathCount - 1)) == 0){
+        char** grown = (char**) realloc(*paths, sizeof(char*) * (*pathCount > 0 ? *pathCount*2 : 1));
+        if(grown == NULL) return PNG_ERROR_MEMORY;
+        *paths = grown;
+    }
+
+    char* joined = (char*) malloc(strlen(dir) + strlen(name) + 2);
+    if(joined == NULL) return PNG_ERROR_MEMORY;
+
+#ifdef _WIN32
+    sprintf(joined, name[0] ? "%s\\%s" : "%s%s", dir, name);
+#else
+    sprintf(joined, name[0] ? "%s/%s" : "%s%s", dir, name);
+#endif
+
+    (*paths)[(*pathCount)++] = joined;
+    return PNG_OK;
+}
+
+void freePaths(char** paths, int pathCount)
+{
+    for(int i = 0; i < pathCount; i++) free(paths[i]);
+    free(paths);
+}
+
+// The callback for ImageWrite --batch: one line per file, whether it worked or not. user is where each
+// file's status goes, and since every index is handed out exactly once the workers never write the same spot
+int printBatchResult(int index, char* path, int status, PNG* fpng, unsigned char* pixels, void* user)
+{
+    int* statuses = (int*) user;
+    (void) pixels;
+
+    statuses[index] = status;
+    if(status == PNG_OK) printf("%s: %dx%d, %d channels, bit depth %d\n", path, fpng->iheader.width, fpng->iheader.height, fpng->iheader.channels, fpng->iheader.bitd);
+    else printf("%s: ERROR: %s\n", path, describeStatus(status));
+
+    return 0;
+}
+
+// ImageWrite --batch [--threads n] path...: decodes every file given, and every .png in every directory given
+int batchFromArgs(PNGDecoder* config, int argc, char* argv[])
+{
+    char** paths = NULL;
+    int pathCount = 0;
+    int threads = 0;
+    char* stats = NULL;
+    int status = PNG_OK;
+
+    for(int i = 0; i < argc && status == PNG_OK; i++){
+        if(strcmp(argv[i], "--threads") == 0 && i+1 < argc) threads = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--stats") == 0 && i+1 < argc) stats = argv[++i];
+        else status = addPathsFromPath(argv[i], &paths, &pathCount);
+    }
+#ifndef PNG_STATS
+    if(stats != NULL){
+        fprintf(stderr, "ERROR: --stats needs ImageWrite built with -DPNG_STATS\n\n");
+        freePaths(paths, pathCount);
+        return EXIT_FAILURE;
+    }
+#endif
+
+    int* statuses = (int*) calloc(pathCount > 0 ? pathCount : 1, sizeof(int));
+    if(status == PNG_OK && statuses == NULL) status = PNG_ERROR_MEMORY;
+
+    double start = getWallSeconds();
+    if(status == PNG_OK) status = decodeBatch(paths, pathCount, PIX_FORMAT_RGBA8, threads, config, printBatchResult, statuses);
+    double seconds = getWallSeconds() - start;
+
+    int failed = 0;
+    for(int i = 0; i < pathCount && status == PNG_OK; i++) failed += statuses[i] != PNG_OK;
+
+    if(status != PNG_OK) fprintf(stderr, "ERROR: %s\n\n", describeStatus(status));
+    else fprintf(stderr, "decoded %d files (%d failed) in %.3fs on %d threads, %.1f files/sec\n", pathCount, failed, seconds,
+                 threads > 0 ? threads : getCoreCount(), seconds > 0 ? pathCount/seconds : 0.0);
+    if(status == PNG_OK && config->cache != NULL){
+        fprintf(stderr, "cache: %lld hits, %lld misses (%lld of them mapped from the directory), %d images (%.1f MB) kept\n",
+                config->cache->hits, config->cache->misses, config->cache->loads, config->cache->count, config->cache->used/1048576.0);
+    }
+    if(status == PNG_OK && stats != NULL && writeStatsToPath(stats, &config->stats) != PNG_OK){
+        fprintf(stderr, "ERROR: couldn't write the stats to %s\n\n", stats);
+    }
+
+    free(statuses);
+    freePaths(paths, pathCount);
+    return status == PNG_OK && failed == 0 ? 0 : EXIT_FAILURE;
+}
+
+/*
+Decoding one image on several threads:
+Inflate is the slow part, and a deflate stream can normally only be inflated from the front. But if the
+encoder did a full flush somewhere (zlib's Z_FULL_FLUSH), everything after that point starts a fresh block
+at a byte boundary that doesn't refer back to anything before it. A flush always writes an empty stored
+block, which ends in the bytes 00 00 ff ff, so the stream is cut after those bytes into segments that are
+inflated at the same time, each into its own buffer. Four bytes like that can also turn up by chance in
+compressed data, so every segment but the last has to end exactly between two blocks, and together they
+have to make the whole image, or the cuts are thrown away.
+
+Unfiltering can't be split as freely, since Up, Average and Paeth rows need the row above them unfiltered
+first. A row filtered with None or Sub doesn't, though, so the rows are cut into bands that each start on
+one of those (a band that can't find one is merged into the band above it) and the bands are unfiltered
+and converted at the same time.
+
+A stream without flush points still gets two threads: one inflating rows into a ring of slots, and the
+caller unfiltering and converting them as they come.
+*/
+int decodePixelsParallel(PNGDecoder* decoder, PNG* fpng, int format, unsigned char** out, int threads)
+{
+    IHDR img_info = fpng->iheader;
+    long int stride = ((long int) img_info.bitd*img_info.channels*img_info.width + 7) >> 3;
+    double inflated_size = (double) img_info.height*(stride+1);
+    unsigned char* allocated = NULL;
+
+    if(threads <= 0) threads = getCoreCount();
+    // interlaced images are left to decodePixelsAs, since their passes have to be unfiltered one after the other
+    if(threads < 2 || decoder->backend->start == NULL || inflated_size < PARALLEL_MIN_BYTES || img_info.interlacem){
+        return decodePixelsAs(decoder, fpng, format, out);
+    }
+
+    long int row_bytes = (long int) img_info.width*bytesPerPixel(format);
+    if((double) row_bytes*img_info.height > (double) ((size_t) -1 >> 1) || stride > 0x7fffffffL - 64) return PNG_ERROR_MEMORY;
+    statsClock(start);
+
+    if(*out == NULL){
+        allocated = *out = (unsigned char*) malloc((size_t) row_bytes*img_info.height);
+        if(allocated == NULL) return PNG_ERROR_MEMORY;
+    }
+
+    ParallelDecode pd;
+    memset(&pd, 0, sizeof(ParallelDecode));
+    pd.png = fpng;
+    pd.backend = decoder->backend;
+    pd.format = format;
+    pd.out = *out;
+    pd.threads = threads;
+    pd.stride = (int) stride;
+    pd.bpp = (img_info.bitd*img_info.channels) >> 3;
+    if(pd.bpp == 0) pd.bpp = 1;
+    pd.rowSize = pd.stride > img_info.width*img_info.channels ? pd.stride : img_info.width*img_info.channels;
+    selectUnfilterKernels(pd.bpp, pd.unfilters);
+    initMutex(&pd.lock);
+
+    int status = decodeSegments(&pd);
+    if(status != PNG_OK) status = decodePipelined(&pd, decoder);
+
+    freeMutex(&pd.lock);
+    // the stages overlap across threads here, so only the total gets counted
+    if(status == PNG_OK){
+        statsStage(&decoder->stats, STAGE_DECODE, start, row_bytes*img_info.height);
+        decoder->stats.images++;
+    }
+    if(status != PNG_OK && allocated != NULL){
+        free(allocated);
+        *out = NULL;
+    }
+    return status;
+}
+
+// The flush point version. Anything but PNG_OK means the stream couldn't be split, not that it's broken
+int decodeSegments(ParallelDecode* pd)
+{
+    IHDR img_info = pd->png->iheader;
+    long int inflated_size = (long int) img_info.height*(pd->stride+1);
+    int copied;
+    int status = PNG_OK;
+
+    if(pd->backend->startRaw == NULL || pd->backend->boundary == NULL) return PNG_ERROR_ARGUMENT;
+
+    unsigned char* compressed = gatherIDAT(pd->png->chunks, pd->png->index, &copied, NULL);
+    if(compressed == NULL) return PNG_ERROR_MEMORY;
+    long int length = pd->png->index.idatLength;
+
+    // a few segments per thread, so one slow segment doesn't leave the rest waiting on it
+    long int target = length / (pd->threads*4);
+    if(target < PARALLEL_SEGMENT_MIN) target = PARALLEL_SEGMENT_MIN;
+
+    int capacity = pd->threads*4 + 1;
+    pd->segments = (InflateSegment*) calloc(capacity, sizeof(InflateSegment));
+    if(pd->segments == NULL) status = PNG_ERROR_MEMORY;
+
+    if(status == PNG_OK){
+        long int last = 0;
+        pd->segments[0].in = compressed;
+        pd->segmentCount = 1;
+
+        for(long int i = 0; i+4 <= length; i++){
+            if(compressed[i] != 0 || compressed[i+1] != 0 || compressed[i+2] != 0xff || compressed[i+3] != 0xff) continue;
+            if(i+4 - last < target || length - (i+4) < target || pd->segmentCount == capacity) continue;
+
+            pd->segments[pd->segmentCount-1].inLength = i+4 - last;
+            pd->segments[pd->segmentCount].in = compressed + i+4;
+            pd->segments[pd->segmentCount].raw = 1;
+            pd->segmentCount++;
+            last = i+4;
+        }
+        pd->segments[pd->segmentCount-1].inLength = length - last;
+
+        // each segment's buffer starts out at its share of the image, going by how much it has to inflate
+        for(int i = 0; i < pd->segmentCount; i++){
+            pd->segments[i].expected = (long int) ((double) pd->segments[i].inLength/length*inflated_size);
+        }
+        if(pd->segmentCount < 2) status = PNG_ERROR_ARGUMENT;
+    }
+
+    if(status == PNG_OK){
+        status = runJobs(pd->threads, pd->segmentCount, inflateSegmentJob, pd);
+    }
+
+    // the stream has to end in the last segment and nowhere before it, and what's left after it is the
+    // Adler-32 of everything, which the segments' own checksums have to add up to
+    long int total = 0;
+    unsigned long adler = 0;
+    for(int i = 0; i < pd->segmentCount && status == PNG_OK; i++){
+        InflateSegment* segment = &pd->segments[i];
+        if(segment->finished != (i == pd->segmentCount-1)) status = PNG_ERROR_DATA;
+
+        adler = i == 0 ? segment->adler : adler32_combine(adler, segment->adler, segment->outLength);
+        segment->start = total;
+        total += segment->outLength;
+    }
+    if(status == PNG_OK && total < inflated_size) status = PNG_ERROR_DATA;
+    if(status == PNG_OK){
+        InflateSegment* last = &pd->segments[pd->segmentCount-1];
+        if(last->tailLength < 4 || adler != bytesToInt(last->tail[0], last->tail[1], last->tail[2], last->tail[3])) status = PNG_ERROR_DATA;
+    }
+
+    if(status == PNG_OK) status = findBands(pd);
+    if(status == PNG_OK){
+        status = runJobs(pd->threads, pd->bandCount, unfilterBandJob, pd);
+    }
+
+    for(int i = 0; i < pd->segmentCount; i++) free(pd->segments[i].out);
+    free(pd->segments);
+    free(pd->bands);
+    if(copied) free(compressed);
+
+    return status;
+}
+
+// Cuts the rows into bands that each start on a row that doesn't look at the row above it
+int findBands(ParallelDecode* pd)
+{
+    int height = pd->png->iheader.height;
+    int wanted = pd->threads*4;
+    int segment = 0;
+
+    pd->bands = (int*) malloc(sizeof(int)*(wanted+1));
+    if(pd->bands == NULL) return PNG_ERROR_MEMORY;
+
+    pd->bands[0] = 0;
+    pd->bandCount = 1;
+
+    for(int b = 1; b < wanted; b++){
+        int first = (int) ((long int) height*b/wanted);
+        int end = (int) ((long int) height*(b+1)/wanted);
+        if(first <= pd->bands[pd->bandCount-1]) continue;
+
+        for(int r = first; r < end; r++){
+            long int offset = (long int) r*(pd->stride+1);
+            while(offset >= pd->segments[segment].start + pd->segments[segment].outLength) segment++;
+
+            unsigned char filter = pd->segments[segment].out[offset - pd->segments[segment].start];
+            if(filter <= 1){
+                pd->bands[pd->bandCount++] = r;
+                break;
+            }
+        }
+    }
+
+    pd->bands[pd->bandCount] = height;
+    return PNG_OK;
+}
+
+int inflateSegmentJob(void* context, int job)
+{
+    ParallelDecode* pd = (ParallelDecode*) context;
+    return inflateSegment(pd->backend, &pd->segments[job], pd->rowSize - pd->stride + 16);
+}
+
+int unfilterBandJob(void* context, int job)
+{
+    ParallelDecode* pd = (ParallelDecode*) context;
+    return unfilterBand(pd, pd->bands[job], pd->bands[job+1]);
+}
+
+// Inflates one segment into its own buffer, which grows as it needs to and keeps padding bytes at the end
+int inflateSegment(InflateBackend* backend, InflateSegment* segment, long int padding)
+{
+    void* state = segment->raw ? backend->startRaw() : backend->start();
+    if(state == NULL) return PNG_ERROR_MEMORY;
+
+    int status = PNG_OK;
+    int finished = 0;
+    unsigned char* next_in = segment->in;
+    unsigned int avail_in = (unsigned int) segment->inLength;
+
+    segment->outCapacity = segment->expected + segment->expected/8 + 4096;
+    segment->out = (unsigned char*) malloc(segment->outCapacity + padding);
+    segment->outLength = 0;
+
+    while(segment->out != NULL){
+        if(segment->outLength == segment->outCapacity){
+            unsigned char* grown = (unsigned char*) realloc(segment->out, segment->outCapacity*2 + padding);
+            if(grown == NULL){
+                status = PNG_ERROR_MEMORY;
+                break;
+            }
+            segment->out = grown;
+            segment->outCapacity *= 2;
+        }
+
+        long int room = segment->outCapacity - segment->outLength;
+        unsigned char* next_out = segment->out + segment->outLength;
+        unsigned int avail_out = room > 0x40000000L ? 0x40000000U : (unsigned int) room;
+
+        int ret = backend->run(state, &next_in, &avail_in, &next_out, &avail_out);
+        long int produced = next_out - (segment->out + segment->outLength);
+        segment->outLength += produced;
+
+        if(ret == INFLATE_DONE){
+            finished = 1;
+            break;
+        }
+
+        // with nothing left to read and nothing more to write, inflate just says it couldn't make progress
+        if(ret == INFLATE_ERROR && !(avail_in == 0 && produced == 0)) status = PNG_ERROR_DATA;
+        if(ret == INFLATE_ERROR || (avail_in == 0 && avail_out > 0)) break;
+    }
+
+    if(segment->out == NULL) status = PNG_ERROR_MEMORY;
+    if(status == PNG_OK && !finished && !backend->boundary(state)) status = PNG_ERROR_DATA;
+
+    // the raw inflate of the last segment stops short of the zlib trailer, so decodeSegments checks it instead
+    segment->finished = finished;
+    segment->tail = next_in;
+    segment->tailLength = avail_in;
+    if(status == PNG_OK) segment->adler = adler32(adler32(0L, Z_NULL, 0), segment->out, (uInt) segment->outLength);
+
+    backend->end(state);
+    return status;
+}
+
+// Unfilters and converts rows [first, last). Rows that straddle two segments are put back together in a spare row
+int unfilterBand(ParallelDecode* pd, int first, int last)
+{
+    PNG* fpng = pd->png;
+    int status = PNG_OK;
+    int segment = 0;
+    long int row_room = pd->rowSize + 1 + 16;
+
+    // a zeroed row to stand in for the one above the first, and two spare rows
+    unsigned char* spare = (unsigned char*) calloc(3, row_room);
+    unsigned char* planar_row = (pd->format & PIX_PLANAR) ? (unsigned char*) malloc((size_t) fpng->iheader.width*bytesPerPixel(pd->format)) : NULL;
+    if(spare == NULL || ((pd->format & PIX_PLANAR) && planar_row == NULL)) status = PNG_ERROR_MEMORY;
+
+    unsigned char* previous = spare;
+    for(int r = first; r < last && status == PNG_OK; r++){
+        long int offset = (long int) r*(pd->stride+1);
+        long int left = pd->stride+1;
+        unsigned char* row;
+
+        while(offset >= pd->segments[segment].start + pd->segments[segment].outLength) segment++;
+        InflateSegment* in = &pd->segments[segment];
+
+        if(offset + left <= in->start + in->outLength) row = in->out + (offset - in->start);
+        else{
+            row = previous == spare + row_room ? spare + 2*row_room : spare + row_room;
+
+            for(int s = segment; left > 0; s++){
+                long int from = offset - pd->segments[s].start;
+                long int size = pd->segments[s].outLength - from < left ? pd->segments[s].outLength - from : left;
+
+                memcpy(row + (pd->stride+1 - left), pd->segments[s].out + from, size);
+                offset += size;
+                left -= size;
+            }
+        }
+
+        if(row[0] > 4){
+            status = PNG_ERROR_DATA;
+            break;
+        }
+        pd->unfilters[row[0]](row+1, previous+1, pd->stride, pd->bpp);
+        storeRow(row+1, r, fpng, pd->format, pd->out, planar_row);
+
+        previous = row;
+    }
+
+    free(spare);
+    free(planar_row);
+    return status;
+}
+
+// The fallback for streams without flush points: a second thread inflates while the caller unfilters
+int decodePipelined(ParallelDecode* pd, PNGDecoder* decoder)
+{
+    PNG* fpng = pd->png;
+    IHDR img_info = fpng->iheader;
+    PNGThread inflater;
+    long int row_room = pd->rowSize + 1 + 16;
+
+    pd->slotRows = (int) (PARALLEL_SLOT_BYTES / (pd->stride+1));
+    if(pd->slotRows < 1) pd->slotRows = 1;
+    pd->slotSize = (long int) pd->slotRows*(pd->stride+1) + row_room;
+    pd->produced = 0;
+    pd->consumed = 0;
+    pd->status = PNG_OK;
+
+    unsigned char* carry = (unsigned char*) calloc(1, row_room);
+    unsigned char* planar_row = (pd->format & PIX_PLANAR) ? (unsigned char*) malloc((size_t) img_info.width*bytesPerPixel(pd->format)) : NULL;
+    pd->slots = (unsigned char*) malloc(pd->slotSize*PARALLEL_SLOTS);
+
+    int status = startRowDecoder(&pd->rows, decoder, fpng->chunks, fpng->index, img_info);
+    if(status == PNG_OK && (carry == NULL || pd->slots == NULL || ((pd->format & PIX_PLANAR) && planar_row == NULL))) status = PNG_ERROR_MEMORY;
+
+    if(status == PNG_OK){
+        initCond(&pd->changed);
+
+        // if there's no second thread to be had, inflate everything here first; it still works, just in turn
+        int threaded = startThread(&inflater, runPipelineInflate, pd);
+
+        unsigned char* previous = carry;
+        int slot_count = (img_info.height + pd->slotRows - 1) / pd->slotRows;
+
+        for(int k = 0; k < slot_count && status == PNG_OK; k++){
+            if(!threaded) runPipelineInflateSlot(pd, k);
+
+            lockMutex(&pd->lock);
+            while(pd->produced <= k && pd->status == PNG_OK) waitCond(&pd->changed, &pd->lock);
+            status = pd->status;
+            unlockMutex(&pd->lock);
+            if(status != PNG_OK) break;
+
+            unsigned char* slot = pd->slots + (k % PARALLEL_SLOTS)*pd->slotSize;
+            int first = k*pd->slotRows;
+            int rows = img_info.height - first < pd->slotRows ? img_info.height - first : pd->slotRows;
+
+            for(int j = 0; j < rows; j++){
+                unsigned char* row = slot + (long int) j*(pd->stride+1);
+                if(row[0] > 4){
+                    status = PNG_ERROR_DATA;
+                    break;
+                }
+                pd->unfilters[row[0]](row+1, previous+1, pd->stride, pd->bpp);
+                storeRow(row+1, first+j, fpng, pd->format, pd->out, planar_row);
+                previous = row;
+            }
+
+            // the slot's about to be handed back, so hold on to its last row for the next slot's first
+            memcpy(carry, previous, pd->stride+1);
+            previous = carry;
+
+            lockMutex(&pd->lock);
+            pd->consumed++;
+            if(status != PNG_OK) pd->status = status;
+            wakeCond(&pd->changed);
+            unlockMutex(&pd->lock);
+        }
+
+        if(threaded) joinThread(inflater);
+        freeCond(&pd->changed);
+    }
+
+    endRowDecoder(&pd->rows);
+    free(pd->slots);
+    free(carry);
+    free(planar_row);
+    return status;
+}
+
+void runPipelineInflate(void* arg)
+{
+    ParallelDecode* pd = (ParallelDecode*) arg;
+    int height = pd->png->iheader.height;
+
+    for(int k = 0; k*pd->slotRows < height; k++){
+        lockMutex(&pd->lock);
+        while(pd->produced - pd->consumed >= PARALLEL_SLOTS && pd->status == PNG_OK) waitCond(&pd->changed, &pd->lock);
+        int stop = pd->status != PNG_OK;
+        unlockMutex(&pd->lock);
+
+        if(stop || !runPipelineInflateSlot(pd, k)) return;
+    }
+}
+
+// Inflates slot k's rows and hands it to the unfiltering side. Returns 0 if the stream's broken
+int runPipelineInflateSlot(ParallelDecode* pd, int k)
+{
+    int height = pd->png->iheader.height;
+    int first = k*pd->slotRows;
+    int rows = height - first < pd->slotRows ? height - first : pd->slotRows;
+
+    unsigned char* slot = pd->slots + (k % PARALLEL_SLOTS)*pd->slotSize;
+    int ok = inflateBytes(&pd->rows, slot, (unsigned int) ((long int) rows*(pd->stride+1)));
+
+    lockMutex(&pd->lock);
+    if(ok) pd->produced++;
+    else pd->status = PNG_ERROR_DATA;
+    wakeCond(&pd->changed);
+    unlockMutex(&pd->lock);
+
+    return ok;
+}
+
+/*
+Encoding:
+Writing a PNG is reading one backwards. Each row is filtered (with whichever filter is picked for it),
+the filtered rows are deflated into a zlib stream, and the stream is split into IDAT chunks between the
+IHDR (and PLTE) and IEND chunks, every one of them with its CRC.
+
+The rows are cut into blocks of about ENCODE_BLOCK_BYTES, which are filtered and then deflated on as many
+threads as there are, the way pigz does it: each block is a bare deflate stream primed with the 32K of
+filtered rows before it, so it compresses almost as well as one long stream, and ends in a sync flush so
+the next block's bytes can just be put after it. The zlib header goes in front, and the trailer's Adler-32
+is combined from each block's. Since the blocks don't depend on the thread count, neither does the file.
+
+With restartable set, a block isn't primed with the one before it and its first row is filtered with None
+or Sub, so every block can also be inflated and unfiltered on its own by decodePixelsParallel.
+*/
+void initEncoder(PNGEncoder* encoder)
+{
+    encoder->level = 6;
+    encoder->filter = FILTER_ADAPTIVE;
+    encoder->threads = 0;
+    encoder->restartable = 0;
+}
+
+// Writes width x height pixels of the given format (not PIX_FORMAT_PIX or planar) to a PNG file at path.
+// 16 bit samples are native unsigned shorts, the same as decodePixelsAs gives back. If palette isn't NULL
+// the pixels are PIX_FORMAT_GRAY8 indexes into it, and the PNG is written as an indexed one
+int encodePixels(PNGEncoder* encoder, char* path, unsigned char* pixels, int width, int height, int format, PLTE* palette)
+{
+    int color_types[5] = {0, 0, 4, 2, 6};
+    PNGEncode enc;
+
+    if(format <= PIX_FORMAT_PIX || format > PIX_FORMAT_RGBA16 || width <= 0 || height <= 0 || pixels == NULL) return PNG_ERROR_ARGUMENT;
+    if(palette != NULL && (format != PIX_FORMAT_GRAY8 || palette->indexCount < 1 || palette->indexCount > 256)) return PNG_ERROR_ARGUMENT;
+    if(encoder->level < 0 || encoder->level > 9 || encoder->filter < 0 || encoder->filter > FILTER_EXHAUSTIVE) return PNG_ERROR_ARGUMENT;
+
+    memset(&enc, 0, sizeof(PNGEncode));
+    enc.encoder = encoder;
+    enc.pixels = pixels;
+    enc.format = format;
+    enc.indexed = palette != NULL;
+
+    enc.info.width = width;
+    enc.info.height = height;
+    enc.info.bitd = format >= PIX_FORMAT_GRAY16 ? 16 : 8;
+    enc.info.colort = enc.indexed ? 3 : color_types[channelsInFormat(format)];
+    enc.info.channels = channelsInFormat(format);
+
+    long int stride = (long int) width*bytesPerPixel(format);
+    if(stride > 0x7fffffffL - 64 || (double) (stride+1)*height > (double) ((size_t) -1 >> 1)) return PNG_ERROR_MEMORY;
+
+    enc.stride = (int) stride;
+    enc.bpp = bytesPerPixel(format);
+    selectFilterKernels(enc.bpp, enc.filters);
+
+    int block_rows = (int) (ENCODE_BLOCK_BYTES / (stride+1));
+    if(block_rows < 1) block_rows = 1;
+    enc.blockCount = (height + block_rows - 1) / block_rows;
+
+    int threads = encoder->threads > 0 ? encoder->threads : getCoreCount();
+    int status = PNG_OK;
+
+    enc.filtered = (unsigned char*) malloc((size_t) (stride+1)*height);
+    enc.blocks = (EncodeBlock*) calloc(enc.blockCount, sizeof(EncodeBlock));
+    if(enc.filtered == NULL || enc.blocks == NULL) status = PNG_ERROR_MEMORY;
+
+    for(int b = 0; b < enc.blockCount && status == PNG_OK; b++){
+        enc.blocks[b].first = b*block_rows;
+        enc.blocks[b].rows = height - b*block_rows < block_rows ? height - b*block_rows : block_rows;
+    }
+
+    if(status == PNG_OK) status = runJobs(threads, enc.blockCount, filterBlock, &enc);
+    if(status == PNG_OK) status = runJobs(threads, enc.blockCount, deflateBlock, &enc);
+    if(status == PNG_OK) status = writeEncodedPNG(&enc, path, palette);
+
+    for(int b = 0; b < enc.blockCount && enc.blocks != NULL; b++) free(enc.blocks[b].out);
+    free(enc.blocks);
+    free(enc.filtered);
+    return status;
+}
+
+// Writes out a decoded PNG's pixels in the closest format to the one it was read from.
+// Indexed PNGs come out as RGB, since PNG.pixels holds colors rather than indexes, and grayscale ones with
+// less than 8 bits per sample are stretched out to 8. A tRNS chunk becomes an alpha channel
+int writePNG(PNGEncoder* encoder, char* path, PNG* fpng)
+{
+    int formats[5] = {PIX_FORMAT_RGB8, PIX_FORMAT_GRAY8, PIX_FORMAT_GA8, PIX_FORMAT_RGB8, PIX_FORMAT_RGBA8};
+    IHDR img_info = fpng->iheader;
+
+    if(fpng->pixels == NULL || img_info.channels < 1 || img_info.channels > 4) return PNG_ERROR_ARGUMENT;
+
+    int indexed = fpng->palette.indexCount != 0;
+    int keyed = !indexed && fpng->transparency.present;
+    int format = formats[indexed ? (fpng->index.trns >= 0 ? 4 : 0) : img_info.channels + keyed];
+    int wide = img_info.bitd == 16 && !indexed;
+    int maximum = indexed || img_info.bitd >= 8 ? 0xff : (1 << img_info.bitd) - 1;
+    if(wide) format += PIX_FORMAT_GRAY16 - PIX_FORMAT_GRAY8;
+
+    int channels = channelsInFormat(format);
+    long int count = (long int) img_info.width*img_info.height;
+    unsigned char* packed = (unsigned char*) malloc((size_t) count*bytesPerPixel(format));
+    if(packed == NULL) return PNG_ERROR_MEMORY;
+
+    for(long int i = 0; i < count; i++){
+        int* key = fpng->transparency.key;
+        int* rgba = fpng->pixels[i].RGBA;
+        int hidden = keyed && rgba[0] == key[0] && (img_info.channels == 1 || (rgba[1] == key[1] && rgba[2] == key[2]));
+
+        for(int chnl = 0; chnl < channels; chnl++){
+            int value = rgba[chnl]*0xff/maximum;
+            if(keyed && chnl == channels-1) value = hidden ? 0 : (wide ? 0xffff : 0xff);
+            if(wide) ((unsigned short*) packed)[i*channels + chnl] = (unsigned short) value;
+            else packed[i*channels + chnl] = (unsigned char) value;
+        }
+    }
+
+    int status = encodePixels(encoder, path, packed, img_info.width, img_info.height, format, NULL);
+    free(packed);
+    return status;
+}
+
+// Filters every row of one block into PNGEncode.filtered, with its filter byte in front
+int filterBlock(void* context, int block)
+{
+    PNGEncode* enc = (PNGEncode*) context;
+    EncodeBlock* current = &enc->blocks[block];
+    int stride = enc->stride;
+    int status = PNG_OK;
+    z_stream trial;
+
+    // a zeroed row for above the first one, two for rows turned big endian, and one for each filter to try
+    unsigned char* scratch = (unsigned char*) calloc(8, stride+16);
+    if(scratch == NULL) return PNG_ERROR_MEMORY;
+
+    unsigned char* zero = scratch;
+    unsigned char* raw[2] = {scratch + (stride+16), scratch + 2*(stride+16)};
+    unsigned char* candidates[5];
+    for(int t = 0; t < 5; t++) candidates[t] = scratch + (3+t)*(stride+16);
+
+    // the exhaustive search deflates each try after the rows already picked, to see which comes out smallest
+    int exhaustive = enc->encoder->filter == FILTER_EXHAUSTIVE;
+    if(exhaustive){
+        memset(&trial, 0, sizeof(z_stream));
+        if(deflateInit2(&trial, enc->encoder->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK){
+            free(scratch);
+            return PNG_ERROR_MEMORY;
+        }
+    }
+
+    unsigned char* previous = current->first == 0 ? zero : getRawRow(enc, current->first-1, raw[1]);
+
+    for(int r = current->first; r < current->first + current->rows && status == PNG_OK; r++){
+        unsigned char* row = getRawRow(enc, r, previous == raw[0] ? raw[1] : raw[0]);
+        unsigned char* out = enc->filtered + (long int) r*(stride+1);
+        int restart = enc->encoder->restartable && r == current->first;
+
+        status = chooseFilter(enc, row, previous, out, candidates, restart, exhaustive ? &trial : NULL);
+        previous = row;
+    }
+
+    if(exhaustive) deflateEnd(&trial);
+    free(scratch);
+    return status;
+}
+
+// Returns row r as PNG bytes: straight from the pixels for 8 bit samples, or turned big endian in buffer for 16 bit
+unsigned char* getRawRow(PNGEncode* enc, int r, unsigned char* buffer)
+{
+    unsigned char* row = enc->pixels + (long int) r*enc->stride;
+    if(enc->info.bitd != 16) return row;
+
+    unsigned short* samples = (unsigned short*) row;
+    for(int i = 0; i < enc->stride/2; i++){
+        buffer[2*i] = (unsigned char) (samples[i] >> 8);
+        buffer[2*i+1] = (unsigned char) samples[i];
+    }
+    return buffer;
+}
+
+// Filters one row into out (filter byte first) with the encoder's filter, or the best one if it's choosing.
+// A restart row has to be None or Sub. trial is the stream the exhaustive search measures against
+int chooseFilter(PNGEncode* enc, unsigned char* row, unsigned char* previous, unsigned char* out, unsigned char** candidates, int restart, z_stream* trial)
+{
+    int stride = enc->stride;
+    int choice = enc->encoder->filter;
+    int tries = restart ? 2 : 5;
+
+    // indexed images don't filter well, so the heuristic leaves them alone (the search still tries everything)
+    if(choice == FILTER_ADAPTIVE && enc->indexed) choice = 0;
+
+    if(choice < FILTER_ADAPTIVE){
+        if(restart && choice > 1) choice = 1;
+        out[0] = (unsigned char) choice;
+        enc->filters[choice](out+1, row, previous, stride, enc->bpp);
+        return PNG_OK;
+    }
+
+    long int best_size = -1;
+    for(int t = 0; t < tries; t++){
+        enc->filters[t](candidates[t], row, previous, stride, enc->bpp);
+
+        long int size;
+        if(trial == NULL) size = sumAbsolute(candidates[t], stride);
+        else{
+            size = trialDeflate(trial, (unsigned char) t, candidates[t], stride);
+            if(size < 0) return PNG_ERROR_MEMORY;
+        }
+
+        if(best_size < 0 || size < best_size){
+            best_size = size;
+            choice = t;
+        }
+    }
+
+    out[0] = (unsigned char) choice;
+    memcpy(out+1, candidates[choice], stride);
+
+    // the chosen row becomes part of what the next row's tries are measured against
+    if(trial != NULL) return feedDeflate(trial, out, stride+1, Z_NO_FLUSH) ? PNG_OK : PNG_ERROR_MEMORY;
+    return PNG_OK;
+}
+
+// How many bytes the stream grows by if this filtered row (and its filter byte) goes next, or -1 if it can't tell
+long int trialDeflate(z_stream* base, unsigned char filter, unsigned char* row, int stride)
+{
+    z_stream trial;
+    if(deflateCopy(&trial, base) != Z_OK) return -1;
+
+    unsigned long before = trial.total_out;
+    int ok = feedDeflate(&trial, &filter, 1, Z_NO_FLUSH) && feedDeflate(&trial, row, stride, Z_SYNC_FLUSH);
+    long int grown = (long int) (trial.total_out - before);
+
+    deflateEnd(&trial);
+    return ok ? grown : -1;
+}
+
+// Deflates length bytes, throwing the output away; only total_out matters to the search
+int feedDeflate(z_stream* stream, unsigned char* in, long int length, int flush)
+{
+    unsigned char discard[4096];
+
+    stream->next_in = in;
+    stream->avail_in = (unsigned int) length;
+    do{
+        stream->next_out = discard;
+        stream->avail_out = sizeof(discard);
+        if(deflate(stream, flush) == Z_STREAM_ERROR) return 0;
+    }while(stream->avail_out == 0 || stream->avail_in > 0);
+
+    return 1;
+}
+
+// Deflates one block of filtered rows into its own buffer
+int deflateBlock(void* context, int block)
+{
+    PNGEncode* enc = (PNGEncode*) context;
+    EncodeBlock* current = &enc->blocks[block];
+    int last = block == enc->blockCount-1;
+    z_stream stream;
+
+    unsigned char* in = enc->filtered + (long int) current->first*(enc->stride+1);
+    long int length = (long int) current->rows*(enc->stride+1);
+
+    memset(&stream, 0, sizeof(z_stream));
+    if(deflateInit2(&stream, enc->encoder->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) return PNG_ERROR_MEMORY;
+
+    // pick up where the block before left off, unless every block has to stand on its own
+    if(block > 0 && !enc->encoder->restartable){
+        long int dictionary = in - enc->filtered < 32768 ? in - enc->filtered : 32768;
+        deflateSetDictionary(&stream, in - dictionary, (unsigned int) dictionary);
+    }
+
+    current->adler = adler32(adler32(0L, Z_NULL, 0), in, (unsigned int) length);
+
+    // deflateBound covers finishing the stream; a sync flush instead is the five bytes of an empty stored block
+    long int capacity = (long int) deflateBound(&stream, length) + 16;
+    current->out = (unsigned char*) malloc(capacity);
+    if(current->out == NULL){
+        deflateEnd(&stream);
+        return PNG_ERROR_MEMORY;
+    }
+
+    stream.next_in = in;
+    stream.avail_in = (unsigned int) length;
+    stream.next_out = current->out;
+    stream.avail_out = (unsigned int) capacity;
+
+    int ret = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+    int ok = last ? ret == Z_STREAM_END : ret == Z_OK && stream.avail_in == 0 && stream.avail_out > 0;
+
+    current->outLength = capacity - stream.avail_out;
+    deflateEnd(&stream);
+    return ok ? PNG_OK : PNG_ERROR_DATA;
+}
+
+// Puts the blocks together into one zlib stream and writes the file around it
+int writeEncodedPNG(PNGEncode* enc, char* path, PLTE* palette)
+{
+    unsigned char ihdr[13];
+    long int length = 2 + 4;
+
+    for(int b = 0; b < enc->blockCount; b++) length += enc->blocks[b].outLength;
+    unsigned char* stream = (unsigned char*) malloc(length);
+    if(stream == NULL) return PNG_ERROR_MEMORY;
+
+    // the zlib header's level bits are only a hint, so they're set the same way zlib itself would
+    int level = enc->encoder->level;
+    int header = 0x7800 | (level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3) << 6;
+    header += 31 - header % 31;
+    stream[0] = (unsigned char) (header >> 8);
+    stream[1] = (unsigned char) header;
+
+    long int offset = 2;
+    unsigned long adler = enc->blocks[0].adler;
+    for(int b = 0; b < enc->blockCount; b++){
+        memcpy(stream + offset, enc->blocks[b].out, enc->blocks[b].outLength);
+        offset += enc->blocks[b].outLength;
+        if(b > 0) adler = adler32_combine(adler, enc->blocks[b].adler, (long int) enc->blocks[b].rows*(enc->stride+1));
+    }
+    for(int k = 0; k < 4; k++) stream[offset+k] = (unsigned char) (adler >> (24 - 8*k));
+
+    for(int k = 0; k < 4; k++){
+        ihdr[k] = (unsigned char) (enc->info.width >> (24 - 8*k));
+        ihdr[4+k] = (unsigned char) (enc->info.height >> (24 - 8*k));
+    }
+    ihdr[8] = (unsigned char) enc->info.bitd;
+    ihdr[9] = (unsigned char) enc->info.colort;
+    ihdr[10] = ihdr[11] = ihdr[12] = 0;
+
+    FILE* fp = fopen(path, "wb");
+    int ok = fp != NULL && fwrite(SIGNATURE, 1, 8, fp) == 8 && writeChunk(fp, IHDR_CHUNK, ihdr, 13);
+
+    if(ok && palette != NULL){
+        unsigned char plte[256*3];
+        for(int i = 0; i < palette->indexCount; i++){
+            for(int chnl = 0; chnl < 3; chnl++) plte[i*3 + chnl] = (unsigned char) palette->indexes[i].RGBA[chnl];
+        }
+        ok = writeChunk(fp, PLTE_CHUNK, plte, palette->indexCount*3);
+    }
+
+    for(long int start = 0; start < length && ok; start += ENCODE_IDAT_BYTES){
+        ok = writeChunk(fp, IDAT_CHUNK, stream + start, length - start < ENCODE_IDAT_BYTES ? length - start : ENCODE_IDAT_BYTES);
+    }
+    if(ok) ok = writeChunk(fp, IEND_CHUNK, NULL, 0);
+
+    if(fp != NULL && fclose(fp) != 0) ok = 0;
+    free(stream);
+    return ok ? PNG_OK : PNG_ERROR_IO;
+}
+
+// Writes one chunk: its length, type, data and the CRC of the type and data. Returns 0 if the write failed
+int writeChunk(FILE* fp, const unsigned char* type, unsigned char* data, long int length)
+{
+    unsigned char head[8];
+    unsigned char tail[4];
+
+    unsigned long crc = CRC32(0L, (unsigned char*) type, 4);
+    if(length > 0) crc = CRC32(crc, data, (int) length);
+
+    for(int k = 0; k < 4; k++){
+        head[k] = (unsigned char) (length >> (24 - 8*k));
+        head[4+k] = type[k];
+        tail[k] = (unsigned char) (crc >> (24 - 8*k));
+    }
+
+    return fwrite(head, 1, 8, fp) == 8 && (length == 0 || fwrite(data, 1, length, fp) == (size_t) length) && fwrite(tail, 1, 4, fp) == 4;
+}
+
+// ImageWrite --encode in.png out.png [--level n] [--filter f] [--threads n] [--restartable]: reads a PNG and
+// writes it back out with these settings
+int encodeFromArgs(PNGDecoder* decoder, int argc, char* argv[])
+{
+    char* filters[7] = {"none", "sub", "up", "average", "paeth", "adaptive", "exhaustive"};
+    PNGEncoder encoder;
+    PNG fpng;
+
+    initEncoder(&encoder);
+    throwError("usage: ImageWrite --encode in.png out.png [--level 0-9] [--filter none|sub|up|average|paeth|adaptive|exhaustive]\n"
+               "                  [--threads n] [--restartable]\n\n", argc < 2, EXIT_FAILURE);
+
+    for(int i = 2; i < argc; i++){
+        if(strcmp(argv[i], "--level") == 0 && i+1 < argc) encoder.level = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--threads") == 0 && i+1 < argc) encoder.threads = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--restartable") == 0) encoder.restartable = 1;
+        else if(strcmp(argv[i], "--filter") == 0 && i+1 < argc){
+            encoder.filter = -1;
+            i++;
+            for(int f = 0; f < 7; f++) encoder.filter = strcmp(argv[i], filters[f]) == 0 ? f : encoder.filter;
+        }
+    }
+
+    int status = decodePNG(decoder, argv[0], &fpng);
+    if(status == PNG_OK){
+        double start = getWallSeconds();
+        status = writePNG(&encoder, argv[1], &fpng);
+        if(status == PNG_OK) fprintf(stderr, "encoded %dx%d in %.3fs\n", fpng.iheader.width, fpng.iheader.height, getWallSeconds() - start);
+        freePNG(fpng);
+    }
+
+    if(status != PNG_OK) fprintf(stderr, "ERROR: %s\n\n", describeStatus(status));
+    return status == PNG_OK ? 0 : EXIT_FAILURE;
+}
+
+/*
+Forward filters:
+Unlike unfiltering, filtering a row only ever looks at the unfiltered row and the unfiltered row above,
+so every byte can be done at once, whatever the pixel size. The first bpp bytes have no left neighbour
+(it counts as 0) so they're done on their own first.
+*/
+void filterNone(unsigned char* out, unsigned char* row, unsigned char* prev, int stride, int bpp)
+{
+    (void) prev;
+    (void) bpp;
+    memcpy(out, row, stride);
+}
+
+void filterSub(unsigned char* out, unsigned char* row, unsigned char* prev, int stride, int bpp)
+{
+    (void) prev;
+    for(int i = 0; i < stride; i++) out[i] = row[i] - (i >= bpp ? row[i-bpp] : 0);
+}
+
+void filterUp(unsigned char* out, unsigned char* row, unsigned char* prev, int stride, int bpp)
+{
+    (void) bpp;
+    for(int i = 0; i < stride; i++) out[i] = row[i] - prev[i];
+}
+
+void filterAverage(unsigned char* out, unsigned char* row, unsigned char* prev, int stride, int bpp)
+{
+    for(int i = 0; i < stride; i++) out[i] = row[i] - (((i >= bpp ? row[i-bpp] : 0) + prev[i]) >> 1);
+}
+
+void filterPaeth(unsigned char* out, unsigned char* row, unsigned char* prev, int stride, int bpp)
+{
+    for(int i = 0; i < stride; i++){
+        out[i] = row[i] - (i >= bpp ? PaethPredictor(row[i-bpp], prev[i], prev[i-bpp]) : prev[i]);
+    }
+}
 
-            filt_a = c >= bpp ? pixels[r * stride + c - bpp] : 0;
-            filt_b = r > 0 ? pixels[(r - 1) * stride + c] : 0;
-            filt_c = r > 0 && c >= bpp ? pixels[(r - 1) * stride + c - bpp] : 0;
+// The heuristic libpng uses to pick a filter: bytes read as signed, the smaller their absolute sum the better
+long int sumAbsolute(unsigned char* row, int stride)
+{
+    long int sum = 0;
+    int i = 0;
 
-            switch(filter_type){
-                case 0:
-                    pixels[current_pixel] = img[i] & 0xff;
-                    break;
-                case 1:
-                    pixels[current_pixel] = (img[i] + filt_a) & 0xff;
-                    break;
-                case 2:
-                    pixels[current_pixel] = (img[i] + filt_b) & 0xff;
-                    break;
-                case 3:
-                    pixels[current_pixel] = (img[i] + filt_a + filt_c) & 0xff;
-                    break;
-                case 4:
-                    pixels[current_pixel] = (img[i] + PaethPredictor(filt_a, filt_b, filt_c)) & 0xff;
-                    break;
+#ifdef PNG_SIMD_SSE2
+    __m128i zero = _mm_setzero_si128();
+    __m128i total = zero;
+
+    // min(x, -x) as unsigned bytes is |x| as signed ones
+    for(; i+16 <= stride; i += 16){
+        __m128i x = _mm_loadu_si128((__m128i*) (row+i));
+        total = _mm_add_epi64(total, _mm_sad_epu8(_mm_min_epu8(x, _mm_sub_epi8(zero, x)), zero));
+    }
+    long long int halves[2];
+    _mm_storeu_si128((__m128i*) halves, total);
+    sum = (long int) (halves[0] + halves[1]);
+#elif defined(PNG_SIMD_NEON)
+    uint32x4_t total = vdupq_n_u32(0);
+
+    for(; i+16 <= stride; i += 16){
+        uint8x16_t x = vld1q_u8(row+i);
+        total = vpadalq_u16(total, vpaddlq_u8(vminq_u8(x, vsubq_u8(vdupq_n_u8(0), x))));
+    }
+    sum = (long int) vgetq_lane_u32(total, 0) + vgetq_lane_u32(total, 1) + vgetq_lane_u32(total, 2) + vgetq_lane_u32(total, 3);
+#endif
+
+    for(; i < stride; i++) sum += row[i] < 128 ? row[i] : 256 - row[i];
+    return sum;
+}
+
+#ifdef PNG_SIMD_SSE2
+void filterSubSSE2(unsigned char* out, unsigned char* row, unsigned char* prev, int stride, int bpp)
+{
+    (void) prev;
+    int i = 0;
+    for(; i < bpp && i < stride; i++) out[i] = row[i];
+
+    for(; i+16 <= stride; i += 16){
+        __m128i x = _mm_loadu_si128((__m128i*) (row+i));
+        __m128i a = _mm_loadu_si128((__m128i*) (row+i-bpp));
+        _mm_storeu_si128((__m128i*) (out+i), _mm_sub_epi8(x, a));
+    }
+    for(; i < stride; i++) out[i] = row[i] - row[i-bpp];
+}
+
+void filterUpSSE2(unsigned char* out, unsigned char* row, unsigned char* prev, int stride, int bpp)
+{
+    int i = 0;
+    for(; i+16 <= stride; i += 16){
+        __m128i x = _mm_loadu_si128((__m128i*) (row+i));
+        __m128i b = _mm_loadu_si128((__m128i*) (prev+i));
+        _mm_storeu_si128((__m128i*) (out+i), _mm_sub_epi8(x, b));
+    }
+    filterUp(out+i, row+i, prev+i, stride-i, bpp);
+}
+
+void filterAverageSSE2(unsigned char* out, unsigned char* row, unsigned char* prev, int stride, int bpp)
+{
+    __m128i one = _mm_set1_epi8(1);
+    int i = 0;
+    for(; i < bpp && i < stride; i++) out[i] = row[i] - (prev[i] >> 1);
+
+    // _mm_avg_epu8 rounds up, so take the 1 back off where a+b was odd
+    for(; i+16 <= stride; i += 16){
+        __m128i x = _mm_loadu_si128((__m128i*) (row+i));
+        __m128i a = _mm_loadu_si128((__m128i*) (row+i-bpp));
+        __m128i b = _mm_loadu_si128((__m128i*) (prev+i));
+        __m128i average = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+        _mm_storeu_si128((__m128i*) (out+i), _mm_sub_epi8(x, average));
+    }
+    for(; i < stride; i++) out[i] = row[i] - ((row[i-bpp] + prev[i]) >> 1);
+}
+
+void filterPaethSSE2(unsigned char* out, unsigned char* row, unsigned char* prev, int stride, int bpp)
+{
+    __m128i zero = _mm_setzero_si128();
+    int i = 0;
+    for(; i < bpp && i < stride; i++) out[i] = row[i] - prev[i];
+
+    for(; i+16 <= stride; i += 16){
+        __m128i x = _mm_loadu_si128((__m128i*) (row+i));
+        __m128i a8 = _mm_loadu_si128((__m128i*) (row+i-bpp));
+        __m128i b8 = _mm_loadu_si128((__m128i*) (prev+i));
+        __m128i c8 = _mm_loadu_si128((__m128i*) (prev+i-bpp));
+        __m128i predicted[2];
+
+        // the predictor needs 16 bit sums, so each half of the bytes is done separately
+        for(int half = 0; half < 2; half++){
+            __m128i a = half ? _mm_unpackhi_epi8(a8, zero) : _mm_unpacklo_epi8(a8, zero);
+            __m128i b = half ? _mm_unpackhi_epi8(b8, zero) : _mm_unpacklo_epi8(b8, zero);
+            __m128i c = half ? _mm_unpackhi_epi8(c8, zero) : _mm_unpacklo_epi8(c8, zero);
+
+            __m128i pa = _mm_sub_epi16(b, c);
+            __m128i pb = _mm_sub_epi16(a, c);
+            __m128i pc = absSSE2(_mm_add_epi16(pa, pb));
+            predicted[half] = paethSSE2(a, b, c, absSSE2(pa), absSSE2(pb), pc);
+        }
+        _mm_storeu_si128((__m128i*) (out+i), _mm_sub_epi8(x, _mm_packus_epi16(predicted[0], predicted[1])));
+    }
+    for(; i < stride; i++) out[i] = row[i] - PaethPredictor(row[i-bpp], prev[i], prev[i-bpp]);
+}
+#endif
+
+#ifdef PNG_SIMD_NEON
+void filterSubNEON(unsigned char* out, unsigned char* row, unsigned char* prev, int stride, int bpp)
+{
+    (void) prev;
+    int i = 0;
+    for(; i < bpp && i < stride; i++) out[i] = row[i];
+
+    for(; i+16 <= stride; i += 16) vst1q_u8(out+i, vsubq_u8(vld1q_u8(row+i), vld1q_u8(row+i-bpp)));
+    for(; i < stride; i++) out[i] = row[i] - row[i-bpp];
+}
+
+void filterUpNEON(unsigned char* out, unsigned char* row, unsigned char* prev, int stride, int bpp)
+{
+    int i = 0;
+    for(; i+16 <= stride; i += 16) vst1q_u8(out+i, vsubq_u8(vld1q_u8(row+i), vld1q_u8(prev+i)));
+    filterUp(out+i, row+i, prev+i, stride-i, bpp);
+}
+
+void filterAverageNEON(unsigned char* out, unsigned char* row, unsigned char* prev, int stride, int bpp)
+{
+    int i = 0;
+    for(; i < bpp && i < stride; i++) out[i] = row[i] - (prev[i] >> 1);
+
+    // vhaddq_u8 is (a+b)>>1 without overflowing, which is exactly the filter's average
+    for(; i+16 <= stride; i += 16){
+        uint8x16_t average = vhaddq_u8(vld1q_u8(row+i-bpp), vld1q_u8(prev+i));
+        vst1q_u8(out+i, vsubq_u8(vld1q_u8(row+i), average));
+    }
+    for(; i < stride; i++) out[i] = row[i] - ((row[i-bpp] + prev[i]) >> 1);
+}
+
+void filterPaethNEON(unsigned char* out, unsigned char* row, unsigned char* prev, int stride, int bpp)
+{
+    int i = 0;
+    for(; i < bpp && i < stride; i++) out[i] = row[i] - prev[i];
+
+    for(; i+8 <= stride; i += 8){
+        uint8x8_t a = vld1_u8(row+i-bpp);
+        uint8x8_t b = vld1_u8(prev+i);
+        uint8x8_t c = vld1_u8(prev+i-bpp);
+
+        uint16x8_t pa = vabdl_u8(b, c);
+        uint16x8_t pb = vabdl_u8(a, c);
+        uint16x8_t pc = vabdq_u16(vaddl_u8(a, b), vaddl_u8(c, c));
+
+        uint8x8_t use_a = vmovn_u16(vandq_u16(vcleq_u16(pa, pb), vcleq_u16(pa, pc)));
+        uint8x8_t use_b = vmovn_u16(vcleq_u16(pb, pc));
+        vst1_u8(out+i, vsub_u8(vld1_u8(row+i), vbsl_u8(use_a, a, vbsl_u8(use_b, b, c))));
+    }
+    for(; i < stride; i++) out[i] = row[i] - PaethPredictor(row[i-bpp], prev[i], prev[i-bpp]);
+}
+#endif
+
+// Picks the fastest forward filter for each filter type. None of them depend on the pixel size
+void selectFilterKernels(int bpp, FilterKernel* kernels)
+{
+    (void) bpp;
+    kernels[0] = filterNone;
+    kernels[1] = filterSub;
+    kernels[2] = filterUp;
+    kernels[3] = filterAverage;
+    kernels[4] = filterPaeth;
+
+#ifdef PNG_SIMD_SSE2
+    kernels[1] = filterSubSSE2;
+    kernels[2] = filterUpSSE2;
+    kernels[3] = filterAverageSSE2;
+    kernels[4] = filterPaethSSE2;
+#endif
+#ifdef PNG_SIMD_NEON
+    kernels[1] = filterSubNEON;
+    kernels[2] = filterUpNEON;
+    kernels[3] = filterAverageNEON;
+    kernels[4] = filterPaethNEON;
+#endif
+}
+
+
+/*
+Test corpus:
+--make-corpus writes a PNG for every color type and bit depth, at a few sizes from 1x1 up to 1920x1080,
+interlaced and not. Each one also gets the next of the six filter choices (None, Sub, Up, Average, Paeth, or
+all five taking turns) and the next of three IDAT splits (one chunk, 64KB chunks or 1000 byte ones), and every
+other one that can have a tRNS chunk gets one, so going through the lot covers every combination of those with
+something. The pixels are gradients with a bit of noise on top, which deflate about as well as photos do, and
+they only depend on the seed, so the same seed always makes the same files.
+*/
+int makeCorpus(char* dir, unsigned int seed)
+{
+    int types[15][2] = {{0, 1}, {0, 2}, {0, 4}, {0, 8}, {0, 16}, {2, 8}, {2, 16}, {3, 1}, {3, 2}, {3, 4}, {3, 8}, {4, 8}, {4, 16}, {6, 8}, {6, 16}};
+    int sizes[4][2] = {{1, 1}, {37, 23}, {640, 480}, {1920, 1080}};
+    char* filters[6] = {"none", "sub", "up", "average", "paeth", "mixed"};
+    long int splits[3] = {0, 65536, 1000};
+    int count = 0;
+
+#ifdef _WIN32
+    CreateDirectoryA(dir, NULL);
+#else
+    mkdir(dir, 0777);
+#endif
+
+    for(int t = 0; t < 15; t++){
+        for(int s = 0; s < 4; s++){
+            for(int interlace = 0; interlace < 2; interlace++, count++){
+                CorpusImage image = {sizes[s][0], sizes[s][1], types[t][0], types[t][1], interlace, count % 6, splits[count/6 % 3],
+                                     types[t][0] <= 3 && count % 4 >= 2, seed};
+                char path[4096];
+
+                snprintf(path, sizeof(path), "%s/c%d_b%d_i%d_%dx%d_%s_%ld%s.png", dir, image.colort, image.bitd, interlace,
+                         image.width, image.height, filters[image.filter], image.split, image.transparent ? "_trns" : "");
+
+                int status = writeCorpusImage(path, &image);
+                if(status != PNG_OK){
+                    fprintf(stderr, "ERROR: could not write %s: %s\n\n", path, describeStatus(status));
+                    return status;
+                }
             }
-            current_pixel++;
-            i++;
         }
     }
 
-    for(int pixl = 0; pixl < img_info.width*img_info.height; pixl++){
-        rgba_pixels[pixl].RGBA[0] = 0;
-        rgba_pixels[pixl].RGBA[1] = 0;
-        rgba_pixels[pixl].RGBA[2] = 0;
-        rgba_pixels[pixl].RGBA[3] = 0;
+    fprintf(stderr, "wrote %d images to %s\n", count, dir);
+    return PNG_OK;
+}
+
+// Writes one synthetic PNG, filtering and deflating it here rather than with encodePixels, which can't
+// write every kind of PNG the decoder has to read
+int writeCorpusImage(char* path, CorpusImage* image)
+{
+    IHDR img_info;
+    memset(&img_info, 0, sizeof(IHDR));
+    img_info.width = image->width;
+    img_info.height = image->height;
+    img_info.bitd = image->bitd;
+    img_info.colort = image->colort;
+    img_info.interlacem = image->interlacem;
+    img_info.channels = image->colort == 0 || image->colort == 3 ? 1 : image->colort == 4 ? 2 : image->colort == 2 ? 3 : 4;
+
+    long int raw_size = inflatedSize(img_info);
+    long int widest = ((long int) img_info.bitd*img_info.channels*img_info.width + 7) >> 3;
+    int bpp = (img_info.bitd*img_info.channels + 7) >> 3;
+    uLongf packed_size = compressBound(raw_size);
+
+    unsigned char* raw = (unsigned char*) malloc(raw_size);
+    unsigned char* packed = (unsigned char*) malloc(packed_size);
+    unsigned char* rows = (unsigned char*) calloc(2, widest+16);
+    if(raw == NULL || packed == NULL || rows == NULL){
+        free(raw);
+        free(packed);
+        free(rows);
+        return PNG_ERROR_MEMORY;
+    }
+
+    FilterKernel filters[5];
+    selectFilterKernels(bpp, filters);
+
+    // each pass is filtered as an image of its own, one row after the other
+    long int offset = 0;
+    int filter_row = 0;
+    for(int pass = 0; pass < (img_info.interlacem ? 7 : 1); pass++){
+        Adam7Pass p = img_info.interlacem ? ADAM7[pass] : (Adam7Pass) {0, 0, 1, 1, 1, 1};
+        int width = passSize(img_info.width, p.x, p.dx);
+        int height = passSize(img_info.height, p.y, p.dy);
+        int stride = (int) (((long int) img_info.bitd*img_info.channels*width + 7) >> 3);
+        if(width == 0 || height == 0) continue;
+
+        unsigned char* previous = rows;
+        unsigned char* current = rows + widest+16;
+        memset(previous, 0, stride);
+
+        for(int r = 0; r < height; r++, filter_row++){
+            int filter = image->filter < 5 ? image->filter : filter_row % 5;
+            packCorpusRow(image, p.y + r*p.dy, p.x, p.dx, width, current);
+
+            raw[offset] = (unsigned char) filter;
+            filters[filter](raw + offset+1, current, previous, stride, bpp);
+            offset += stride+1;
+
+            unsigned char* swap = previous;
+            previous = current;
+            current = swap;
+        }
+    }
+    free(rows);
+
+    int ok = compress2(packed, &packed_size, raw, raw_size, Z_DEFAULT_COMPRESSION) == Z_OK;
+    free(raw);
 
-        if(color_indexes.indexCount == 0){
-            for(int chnl = 0; chnl < img_info.channels; chnl++){
-                rgba_pixels[pixl].RGBA[chnl] = pixels[(pixl*img_info.channels)+chnl];
+    unsigned char ihdr[13];
+    for(int k = 0; k < 4; k++){
+        ihdr[k] = (unsigned char) (img_info.width >> (24 - 8*k));
+        ihdr[4+k] = (unsigned char) (img_info.height >> (24 - 8*k));
+    }
+    ihdr[8] = (unsigned char) img_info.bitd;
+    ihdr[9] = (unsigned char) img_info.colort;
+    ihdr[10] = ihdr[11] = 0;
+    ihdr[12] = (unsigned char) img_info.interlacem;
+
+    FILE* fp = ok ? fopen(path, "wb") : NULL;
+    ok = fp != NULL && fwrite(SIGNATURE, 1, 8, fp) == 8 && writeChunk(fp, IHDR_CHUNK, ihdr, 13);
+
+    // a palette uses every index the bit depth can hold, up to 200 colors for 8 bit ones, and its tRNS
+    // fades the first half of them in
+    int colors = img_info.bitd < 8 ? 1 << img_info.bitd : 200;
+    unsigned char extra[200*3];
+    if(ok && img_info.colort == 3){
+        for(int i = 0; i < colors*3; i++) extra[i] = (unsigned char) getCorpusSample(image, i, -1, 0);
+        ok = writeChunk(fp, PLTE_CHUNK, extra, colors*3);
+    }
+    if(ok && image->transparent && img_info.colort == 3){
+        for(int i = 0; i < colors/2 + 1; i++) extra[i] = (unsigned char) (i*255/(colors/2 + 1));
+        ok = writeChunk(fp, TRNS_CHUNK, extra, colors/2 + 1);
+    }
+    else if(ok && image->transparent && (img_info.colort == 0 || img_info.colort == 2)){
+        // the top left pixel's color, so some pixels really are keyed out
+        for(int chnl = 0; chnl < img_info.channels; chnl++){
+            int key = getCorpusSample(image, 0, 0, chnl);
+            extra[2*chnl] = (unsigned char) (key >> 8);
+            extra[2*chnl+1] = (unsigned char) key;
+        }
+        ok = writeChunk(fp, TRNS_CHUNK, extra, 2*img_info.channels);
+    }
+
+    long int split = image->split > 0 ? image->split : (long int) packed_size;
+    for(long int start = 0; start < (long int) packed_size && ok; start += split){
+        ok = writeChunk(fp, IDAT_CHUNK, packed + start, (long int) packed_size - start < split ? (long int) packed_size - start : split);
+    }
+    if(ok) ok = writeChunk(fp, IEND_CHUNK, NULL, 0);
+
+    if(fp != NULL && fclose(fp) != 0) ok = 0;
+    free(packed);
+    return ok ? PNG_OK : PNG_ERROR_IO;
+}
+
+// Channel chnl of the pixel at x, y as a sample at the image's bit depth (a palette index for palette images).
+// A y of -1 asks for byte x of the palette instead. Every value comes from hashing where it is with the seed,
+// so a pixel is the same whichever pass it's written in
+int getCorpusSample(CorpusImage* image, int x, int y, int chnl)
+{
+    unsigned int hash = (unsigned int) x*73856093u ^ (unsigned int) (y+1)*19349663u ^ (unsigned int) chnl*83492791u ^ image->seed*2654435761u;
+    hash ^= hash >> 15;
+    hash *= 0x2c1b3c6du;
+    hash ^= hash >> 12;
+    if(y < 0) return (int) (hash & 0xff);
+
+    int maximum = image->colort == 3 ? (image->bitd < 8 ? 1 << image->bitd : 200) - 1 : (1 << image->bitd) - 1;
+    double gradient = (double) x/(image->width > 1 ? image->width-1 : 1)*(chnl+1)/4 + (double) y/(image->height > 1 ? image->height-1 : 1)*(4-chnl)/4;
+    int value = (int) (gradient*maximum/2) + (int) (hash % (unsigned int) (maximum/8 + 1));
+
+    return value > maximum ? maximum : value;
+}
+
+// Packs row y of a pass (width pixels from x0, dx apart) into row as PNG bytes: big endian 16 bit samples,
+// and smaller ones packed from the high bits down
+void packCorpusRow(CorpusImage* image, int y, int x0, int dx, int width, unsigned char* row)
+{
+    int channels = image->colort == 0 || image->colort == 3 ? 1 : image->colort == 4 ? 2 : image->colort == 2 ? 3 : 4;
+    long int samples = (long int) width*channels;
+
+    memset(row, 0, (samples*image->bitd + 7) >> 3);
+    for(long int i = 0; i < samples; i++){
+        int value = getCorpusSample(image, x0 + (int) (i/channels)*dx, y, (int) (i % channels));
+
+        if(image->bitd == 16){
+            row[2*i] = (unsigned char) (value >> 8);
+            row[2*i+1] = (unsigned char) value;
+        }
+        else if(image->bitd == 8) row[i] = (unsigned char) value;
+        else row[i*image->bitd/8] |= (unsigned char) (value << (8 - image->bitd - (i*image->bitd) % 8));
+    }
+}
+
+// ImageWrite --make-corpus directory [--seed n]
+int corpusFromArgs(int argc, char* argv[])
+{
+    unsigned int seed = 1;
+    throwError("usage: ImageWrite --make-corpus directory [--seed n]\n\n", argc < 1, EXIT_FAILURE);
+
+    for(int i = 1; i < argc; i++){
+        if(strcmp(argv[i], "--seed") == 0 && i+1 < argc) seed = (unsigned int) strtoul(argv[++i], NULL, 10);
+    }
+    return makeCorpus(argv[0], seed) == PNG_OK ? 0 : EXIT_FAILURE;
+}
+
+/*
+Benchmarks:
+--bench times the stages of a decode one at a time, each run to completion on the whole file before the next
+starts, so each one's speed can be seen on its own: reading the file, walking the chunks and IHDR, checking
+the CRCs, inflating every IDAT, unfiltering every row and then converting the rows to RGBA8. The pieces are
+the same functions the decoder uses, but a real decode streams inflate, unfilter and convert a row at a time,
+so it's also timed end to end, the way decodePNG would do it. Every stage is run a few times and the fastest
+run kept, since anything slower was only slowed down by something else.
+*/
+int benchFile(PNGDecoder* decoder, char* path, int iterations, int compare, BenchResult* result)
+{
+    PNG fpng;
+    int format = PIX_FORMAT_RGBA8;
+
+    memset(result, 0, sizeof(BenchResult));
+    for(int stage = 0; stage < STAGE_COUNT; stage++) result->seconds[stage] = 1e30;
+    result->reference = 1e30;
+
+    int status = readPNG(decoder, path, &fpng);
+    if(status != PNG_OK) return status;
+
+    IHDR img_info = fpng.iheader;
+    long int inflated_size = inflatedSize(img_info);
+    long int out_size = (long int) img_info.width*img_info.height*bytesPerPixel(format);
+    long int row_size = ((long int) img_info.bitd*img_info.channels*img_info.width + 7) >> 3;
+    if(row_size < (long int) img_info.width*img_info.channels) row_size = (long int) img_info.width*img_info.channels;
+
+    int copied;
+    unsigned char* compressed = gatherIDAT(fpng.chunks, fpng.index, &copied, NULL);
+    unsigned char* inflated = (unsigned char*) malloc(inflated_size + row_size + 16);
+    unsigned char* unfiltered = (unsigned char*) malloc(inflated_size + row_size + 16);
+    unsigned char* out = (unsigned char*) malloc(out_size);
+    unsigned char* pass_row = (unsigned char*) malloc((long int) img_info.width*bytesPerPixel(format));
+    unsigned char* zeros = (unsigned char*) malloc(row_size + 1 + 16);
+    if(compressed == NULL || inflated == NULL || unfiltered == NULL || out == NULL || pass_row == NULL || zeros == NULL) status = PNG_ERROR_MEMORY;
+
+    result->bytes[STAGE_READ] = result->bytes[STAGE_PARSE] = result->bytes[STAGE_CRC] = (double) fpng.byteCount;
+    result->bytes[STAGE_INFLATE] = result->bytes[STAGE_UNFILTER] = (double) inflated_size;
+    result->bytes[STAGE_EXPAND] = result->bytes[STAGE_DECODE] = (double) out_size;
+    result->pixels = (double) img_info.width*img_info.height;
+
+    for(int n = 0; n < iterations && status == PNG_OK; n++){
+        PNG parsed;
+        memset(&parsed, 0, sizeof(PNG));
+
+        double start = getWallSeconds();
+        status = getBytesFromPath(path, &parsed.byteCount, &parsed.bytes);
+        start = keepBest(&result->seconds[STAGE_READ], start);
+
+        if(status == PNG_OK) status = getChunksFromBytes(parsed.bytes, parsed.byteCount, 0, NULL, &parsed.chunks, &parsed.chunkCount, &parsed.index);
+        if(status == PNG_OK) status = getHeaderFromChunks(&parsed);
+        start = keepBest(&result->seconds[STAGE_PARSE], start);
+
+        if(status == PNG_OK && !hasValidCRC(parsed.chunks, parsed.chunkCount, 0)) status = PNG_ERROR_CRC;
+        keepBest(&result->seconds[STAGE_CRC], start);
+
+        freePNG(parsed);
+    }
+
+    for(int n = 0; n < iterations && status == PNG_OK; n++){
+        double start = getWallSeconds();
+        if(!decoder->backend->whole(&decoder->wholeState, compressed, fpng.index.idatLength, inflated, inflated_size)) status = PNG_ERROR_DATA;
+        keepBest(&result->seconds[STAGE_INFLATE], start);
+    }
+
+    // unfiltering is done in place, so each run starts from a fresh copy of the inflated rows
+    for(int n = 0; n < iterations && status == PNG_OK; n++){
+        memcpy(unfiltered, inflated, inflated_size);
+
+        double start = getWallSeconds();
+        status = unfilterAll(img_info, unfiltered, zeros);
+        keepBest(&result->seconds[STAGE_UNFILTER], start);
+    }
+
+    for(int n = 0; n < iterations && status == PNG_OK; n++){
+        double start = getWallSeconds();
+        expandAll(&fpng, unfiltered, format, out, pass_row);
+        keepBest(&result->seconds[STAGE_EXPAND], start);
+    }
+
+    for(int n = 0; n < iterations && status == PNG_OK; n++){
+        PNG decoded;
+
+        double start = getWallSeconds();
+        status = readPNG(decoder, path, &decoded);
+        if(status == PNG_OK){
+            status = decodePixelsAs(decoder, &decoded, format, &out);
+            freePNG(decoded);
+        }
+        keepBest(&result->seconds[STAGE_DECODE], start);
+    }
+
+#ifdef HAVE_LIBPNG
+    result->matched = 1;
+    for(int n = 0; n < iterations && status == PNG_OK && compare; n++){
+        int width, height;
+
+        double start = getWallSeconds();
+        unsigned char* reference = decodeWithLibpng(path, &width, &height);
+        keepBest(&result->reference, start);
+
+        result->matched &= reference != NULL && width == img_info.width && height == img_info.height && memcmp(reference, out, out_size) == 0;
+        free(reference);
+    }
+#else
+    (void) compare;
+#endif
+
+    if(copied) free(compressed);
+    free(inflated);
+    free(unfiltered);
+    free(out);
+    free(pass_row);
+    free(zeros);
+    freePNG(fpng);
+    return status;
+}
+
+// Unfilters a whole inflated image in place, a pass at a time for interlaced ones, the same way decodeNextRow
+// does it a row at a time. zeros is room for a row and its filter byte (and 16 more), to zero for above each first row
+int unfilterAll(IHDR img_info, unsigned char* inflated, unsigned char* zeros)
+{
+    UnfilterKernel unfilters[5];
+    int bpp = (img_info.bitd*img_info.channels) >> 3;
+    long int offset = 0;
+
+    if(bpp == 0) bpp = 1;
+    selectUnfilterKernels(bpp, unfilters);
+
+    for(int pass = 0; pass < (img_info.interlacem ? 7 : 1); pass++){
+        Adam7Pass p = img_info.interlacem ? ADAM7[pass] : (Adam7Pass) {0, 0, 1, 1, 1, 1};
+        int width = passSize(img_info.width, p.x, p.dx);
+        int height = passSize(img_info.height, p.y, p.dy);
+        int stride = (int) (((long int) img_info.bitd*img_info.channels*width + 7) >> 3);
+        if(width == 0 || height == 0) continue;
+
+        memset(zeros, 0, stride+1);
+        unsigned char* previous = zeros;
+
+        for(int r = 0; r < height; r++){
+            unsigned char* row = inflated + offset;
+            if(row[0] > 4) return PNG_ERROR_DATA;
+
+            unfilters[row[0]](row+1, previous+1, stride, bpp);
+            previous = row;
+            offset += stride+1;
+        }
+    }
+    return PNG_OK;
+}
+
+// Converts every row of an unfiltered image into out, scattering interlaced ones through pass_row like decodePasses
+void expandAll(PNG* fpng, unsigned char* unfiltered, int format, unsigned char* out, unsigned char* pass_row)
+{
+    IHDR img_info = fpng->iheader;
+    PNG pass_png = *fpng;
+    long int offset = 0;
+
+    for(int pass = 0; pass < (img_info.interlacem ? 7 : 1); pass++){
+        Adam7Pass p = img_info.interlacem ? ADAM7[pass] : (Adam7Pass) {0, 0, 1, 1, 1, 1};
+        int width = passSize(img_info.width, p.x, p.dx);
+        int height = passSize(img_info.height, p.y, p.dy);
+        int stride = (int) (((long int) img_info.bitd*img_info.channels*width + 7) >> 3);
+        if(width == 0 || height == 0) continue;
+        pass_png.iheader.width = width;
+
+        for(int r = 0; r < height; r++){
+            unsigned char* row = unfiltered + offset + 1;
+            if(!img_info.interlacem) storeRow(row, r, fpng, format, out, NULL);
+            else{
+                convertRow(row, pass_row, format, &pass_png);
+                scatterPassRow(pass_row, out, format, img_info, pass, r, 0);
             }
+            offset += stride+1;
         }
-        else{
-            rgba_pixels[pixl].RGBA[0] = color_indexes.indexes[pixels[pixl]].RGBA[0];
-            rgba_pixels[pixl].RGBA[1] = color_indexes.indexes[pixels[pixl]].RGBA[1];
-            rgba_pixels[pixl].RGBA[2] = color_indexes.indexes[pixels[pixl]].RGBA[2];
+    }
+}
+
+// Keeps the time since start in best if it's the fastest yet, and returns the time now for the next stage to start from
+double keepBest(double* best, double start)
+{
+    double now = getWallSeconds();
+    if(now - start < *best) *best = now - start;
+    return now;
+}
+
+// ImageWrite --bench file.png|directory... [--iterations n] [--compare]: a line for each file, then each stage's
+// speed over all of them
+int benchFromArgs(PNGDecoder* decoder, int argc, char* argv[])
+{
+    char* stages[STAGE_COUNT] = {"read", "parse", "crc", "inflate", "unfilter", "expand", "decode"};
+    double seconds[STAGE_COUNT] = {0};
+    double bytes[STAGE_COUNT] = {0};
+    double pixels = 0, reference = 0;
+    char** paths = NULL;
+    int pathCount = 0;
+    int iterations = 5;
+    int compare = 0;
+    int failed = 0, mismatched = 0;
+    int status = PNG_OK;
+
+    for(int i = 0; i < argc && status == PNG_OK; i++){
+        if(strcmp(argv[i], "--iterations") == 0 && i+1 < argc) iterations = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--compare") == 0) compare = 1;
+        else status = addPathsFromPath(argv[i], &paths, &pathCount);
+    }
+    if(iterations < 1) iterations = 1;
+
+#ifndef HAVE_LIBPNG
+    if(compare){
+        fprintf(stderr, "ERROR: --compare needs libpng, build with -DHAVE_LIBPNG -lpng\n\n");
+        freePaths(paths, pathCount);
+        return EXIT_FAILURE;
+    }
+#endif
+
+    for(int i = 0; i < pathCount && status == PNG_OK; i++){
+        BenchResult result;
+        int file_status = benchFile(decoder, paths[i], iterations, compare, &result);
+
+        if(file_status != PNG_OK){
+            printf("%s: ERROR: %s\n", paths[i], describeStatus(file_status));
+            failed++;
+            continue;
+        }
+
+        for(int stage = 0; stage < STAGE_COUNT; stage++){
+            seconds[stage] += result.seconds[stage];
+            bytes[stage] += result.bytes[stage];
+        }
+        pixels += result.pixels;
+
+        printf("%s: %.3f ms, %.1f Mpixels/s", paths[i], result.seconds[STAGE_DECODE]*1e3, result.pixels/result.seconds[STAGE_DECODE]/1e6);
+        if(compare){
+            reference += result.reference;
+            mismatched += !result.matched;
+            printf(", libpng %.3f ms (%.2fx)%s", result.reference*1e3, result.reference/result.seconds[STAGE_DECODE],
+                   result.matched ? "" : ", PIXELS DIFFER");
+        }
+        printf("\n");
+    }
+
+    if(status == PNG_OK && pathCount > failed){
+        printf("\n%d files, best of %d runs each\n", pathCount - failed, iterations);
+        for(int stage = 0; stage < STAGE_COUNT; stage++){
+            printf("%-9s %10.3f ms %10.1f MB/s\n", stages[stage], seconds[stage]*1e3, bytes[stage]/seconds[stage]/1e6);
+        }
+        printf("decode    %10.1f Mpixels/s\n", pixels/seconds[STAGE_DECODE]/1e6);
+        if(compare){
+            printf("libpng    %10.3f ms %10.1f MB/s, %.2fx the time, %d files differ\n", reference*1e3, bytes[STAGE_DECODE]/reference/1e6,
+                   reference/seconds[STAGE_DECODE], mismatched);
+        }
+    }
+    else if(status != PNG_OK) fprintf(stderr, "ERROR: %s\n\n", describeStatus(status));
+
+    freePaths(paths, pathCount);
+    return status == PNG_OK && failed == 0 && mismatched == 0 ? 0 : EXIT_FAILURE;
+}
+
+#ifdef HAVE_LIBPNG
+// Decodes a PNG to RGBA8 with libpng, the same way decodePixelsAs would: 16 bit samples keep their high byte,
+// smaller ones are scaled up, and tRNS becomes alpha. Returns NULL if libpng couldn't read it
+unsigned char* decodeWithLibpng(char* path, int* width, int* height)
+{
+    FILE* fp = fopen(path, "rb");
+    if(fp == NULL) return NULL;
+
+    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info = png != NULL ? png_create_info_struct(png) : NULL;
+    unsigned char* volatile pixels = NULL;
+    png_bytep* volatile rows = NULL;
+
+    if(info == NULL || setjmp(png_jmpbuf(png))){
+        png_destroy_read_struct(&png, info != NULL ? &info : NULL, NULL);
+        fclose(fp);
+        free(pixels);
+        free(rows);
+        return NULL;
+    }
+
+    png_init_io(png, fp);
+    png_read_info(png, info);
+    png_set_expand(png);
+    png_set_strip_16(png);
+    png_set_gray_to_rgb(png);
+    png_set_filler(png, 0xff, PNG_FILLER_AFTER);
+    png_set_interlace_handling(png);
+    png_read_update_info(png, info);
+
+    *width = (int) png_get_image_width(png, info);
+    *height = (int) png_get_image_height(png, info);
+    pixels = (unsigned char*) malloc((size_t) *width**height*4);
+    rows = (png_bytep*) malloc(sizeof(png_bytep)*(*height > 0 ? *height : 1));
+    if(pixels == NULL || rows == NULL) png_error(png, "out of memory");
+
+    for(int y = 0; y < *height; y++) rows[y] = pixels + (size_t) y**width*4;
+    png_read_image(png, rows);
+    png_read_end(png, NULL);
+
+    png_destroy_read_struct(&png, &info, NULL);
+    fclose(fp);
+    free(rows);
+    return pixels;
+}
+#endif
+
+/*
+Output files:
+The command line writes the decoded pixels straight out of the buffer they were decoded into, with one
+fwrite for the lot unless the samples have to be byte swapped (Netpbm's 16 bit samples are big-endian)
+or printed as text, in which case they go through an OUTPUT_BUFFER_BYTES buffer a piece at a time.
+*/
+// Returns the OUTPUT_ type with that name, or -1
+int getOutputType(char* name)
+{
+    char* names[5] = {"npy", "raw", "ppm", "pam", "text"};
+    for(int i = 0; i < 5; i++){
+        if(strcmp(name, names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+// The pixel format closest to the PNG's own that a type of output file can hold. Palette images become RGB, or RGBA
+// if they have a tRNS chunk, and so do grayscale and RGB ones with a tRNS color key. PPM drops the alpha channel
+int getOutputFormat(PNG* fpng, int type)
+{
+    IHDR img_info = fpng->iheader;
+    int gray = img_info.colort == 0 || img_info.colort == 4;
+    int alpha = img_info.colort == 4 || img_info.colort == 6 || fpng->index.trns >= 0;
+    int format;
+
+    if(type == OUTPUT_PPM) alpha = 0;
+    if(gray) format = alpha ? PIX_FORMAT_GA8 : PIX_FORMAT_GRAY8;
+    else format = alpha ? PIX_FORMAT_RGBA8 : PIX_FORMAT_RGB8;
+
+    if(img_info.bitd == 16) format += PIX_FORMAT_GRAY16 - PIX_FORMAT_GRAY8;
+    return format;
+}
+
+// input with its extension swapped for the output type's, in a new string
+char* getOutputPath(char* input, int type)
+{
+    char* extensions[5] = {".npy", ".raw", ".ppm", ".pam", ".txt"};
+    char* dot = strrchr(input, '.');
+    char* slash = strrchr(input, '/');
+    if(slash == NULL || (strrchr(input, '\\') != NULL && strrchr(input, '\\') > slash)) slash = strrchr(input, '\\');
+
+    size_t stem = dot != NULL && (slash == NULL || dot > slash) ? (size_t) (dot - input) : strlen(input);
+    char* path = (char*) malloc(stem + 5);
+    if(path == NULL) return NULL;
+
+    memcpy(path, input, stem);
+    strcpy(path + stem, extensions[type]);
+    return path;
+}
+
+// Writes width*height pixels of format (as decodePixelsAs makes them) to a new file at path
+int writePixels(char* path, int type, unsigned char* pixels, int width, int height, int format)
+{
+    int channels = channelsInFormat(format);
+    int wide = format >= PIX_FORMAT_GRAY16;
+    long int samples = (long int) width*height*channels;
+    char header[256];
+    int length = 0;
+
+    if(type == OUTPUT_NPY){
+        // the header is padded with spaces so the samples start on a 64 byte boundary, which memory maps nicely
+        char shape[64];
+        if(channels == 1) sprintf(shape, "(%d, %d)", height, width);
+        else sprintf(shape, "(%d, %d, %d)", height, width, channels);
+
+        length = sprintf(header + 10, "{'descr': '%s', 'fortran_order': False, 'shape': %s, }",
+                         wide ? (isBigEndian() ? ">u2" : "<u2") : "|u1", shape);
+        while((10 + length + 1) % 64 != 0) header[10 + length++] = ' ';
+        header[10 + length++] = '\n';
+
+        memcpy(header, "\x93NUMPY\x01\x00", 8);
+        header[8] = (char) (length & 0xff);
+        header[9] = (char) (length >> 8);
+        length += 10;
+    }
+    else if(type == OUTPUT_PPM){
+        length = sprintf(header, "P%d\n%d %d\n%d\n", channels == 1 ? 5 : 6, width, height, wide ? 65535 : 255);
+    }
+    else if(type == OUTPUT_PAM){
+        char* tuples[4] = {"GRAYSCALE", "GRAYSCALE_ALPHA", "RGB", "RGB_ALPHA"};
+        length = sprintf(header, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH %d\nMAXVAL %d\nTUPLTYPE %s\nENDHDR\n",
+                         width, height, channels, wide ? 65535 : 255, tuples[channels-1]);
+    }
+    else if(type == OUTPUT_TEXT){
+        length = sprintf(header, "%d,%d,%d\n", width, height, channels);
+    }
+
+    FILE* fp = fopen(path, "wb");
+    if(fp == NULL) return PNG_ERROR_IO;
+
+    int ok = fwrite(header, 1, length, fp) == (size_t) length;
+    if(ok && type == OUTPUT_TEXT) ok = writeText(fp, pixels, samples, wide);
+    else if(ok) ok = writeSamples(fp, pixels, samples, wide, (type == OUTPUT_PPM || type == OUTPUT_PAM) && !isBigEndian());
+
+    if(fclose(fp) != 0) ok = 0;
+    return ok ? PNG_OK : PNG_ERROR_IO;
+}
+
+// Writes count samples, byte swapping 16 bit ones first if swap is set. Returns 0 if the write fails
+int writeSamples(FILE* fp, unsigned char* samples, long int count, int wide, int swap)
+{
+    long int size = count*(wide ? 2 : 1);
+    if(!wide || !swap) return fwrite(samples, 1, size, fp) == (size_t) size;
+
+    unsigned char* buffer = (unsigned char*) malloc(OUTPUT_BUFFER_BYTES);
+    int ok = buffer != NULL;
+
+    for(long int done = 0; done < size && ok; done += OUTPUT_BUFFER_BYTES){
+        long int piece = size - done < OUTPUT_BUFFER_BYTES ? size - done : OUTPUT_BUFFER_BYTES;
+        for(long int i = 0; i < piece; i += 2){
+            buffer[i] = samples[done+i+1];
+            buffer[i+1] = samples[done+i];
+        }
+        ok = fwrite(buffer, 1, piece, fp) == (size_t) piece;
+    }
+
+    free(buffer);
+    return ok;
+}
+
+// Prints count samples as decimal text with a comma after each one, filling a buffer by hand rather than
+// calling fprintf once per sample. Returns 0 if the write fails
+int writeText(FILE* fp, unsigned char* samples, long int count, int wide)
+{
+    unsigned char* buffer = (unsigned char*) malloc(OUTPUT_BUFFER_BYTES);
+    long int used = 0;
+    int ok = buffer != NULL;
+
+    for(long int i = 0; i < count && ok; i++){
+        char digits[8];
+        int length = 0;
+        unsigned int value = wide ? ((unsigned short*) samples)[i] : samples[i];
+
+        do{
+            digits[length++] = (char) ('0' + value % 10);
+            value /= 10;
+        } while(value != 0);
+
+        while(length > 0) buffer[used++] = digits[--length];
+        buffer[used++] = ',';
+
+        if(used > OUTPUT_BUFFER_BYTES - 8){
+            ok = fwrite(buffer, 1, used, fp) == (size_t) used;
+            used = 0;
         }
     }
 
-    free(pixels);
-    return rgba_pixels;
+    if(ok){
+        buffer[used++] = '\n';
+        ok = fwrite(buffer, 1, used, fp) == (size_t) used;
+    }
+    free(buffer);
+    return ok;
+}
+
+int isBigEndian(void)
+{
+    unsigned short one = 1;
+    return *(unsigned char*) &one == 0;
 }